@@ -0,0 +1,418 @@
+#include "bow.hpp"
+#include "histogram.hpp"
+#include "knn.hpp"
+#include "scheduler.hpp"
+
+#include <iostream>
+#include <sstream>
+#include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+#include <atomic>
+#include <chrono>
+#include <omp.h>
+
+/*
+ * Microbenchmarks of the hot kernels on synthetic, deterministic data.
+ * Results go to stdout as JSON, one object per benchmark:
+ *
+ *     name, params     what was measured
+ *     iterations       timed runs, after one warm-up run
+ *     median_ns, mean_ns, min_ns
+ *                      latency of one run
+ *     items_per_s      throughput in `unit` (pixels, samples, rows, ...)
+ *     allocs_per_op, bytes_per_op
+ *                      heap allocations of one run (glibc only, else -1)
+ *
+ * The context also holds filter_tolerance_ratio, the tolerance check of
+ * the convolution engine against dense filter2D (see convolution.hpp);
+ * the benchmark fails, with status -1, when it exceeds 1.
+ *
+ * Usage: ./benchmark [--filter <substring>] [--min-time <seconds>]
+ */
+
+/* ------------------------- allocation counting --------------------------- */
+
+// Every allocation of the process, OpenCV buffers included, goes through
+// these wrappers around the glibc allocator.
+#ifdef __GLIBC__
+static std::atomic<unsigned long long> allocCount(0);
+static std::atomic<unsigned long long> allocBytes(0);
+
+extern "C" {
+void* __libc_malloc(size_t n);
+void* __libc_calloc(size_t count, size_t n);
+void* __libc_realloc(void* p, size_t n);
+void* __libc_memalign(size_t alignment, size_t n);
+void __libc_free(void* p);
+
+void* malloc(size_t n) __THROW
+{
+    allocCount.fetch_add(1, std::memory_order_relaxed);
+    allocBytes.fetch_add(n, std::memory_order_relaxed);
+    return __libc_malloc(n);
+}
+
+void* calloc(size_t count, size_t n) __THROW
+{
+    allocCount.fetch_add(1, std::memory_order_relaxed);
+    allocBytes.fetch_add(count * n, std::memory_order_relaxed);
+    return __libc_calloc(count, n);
+}
+
+void* realloc(void* p, size_t n) __THROW
+{
+    allocCount.fetch_add(1, std::memory_order_relaxed);
+    allocBytes.fetch_add(n, std::memory_order_relaxed);
+    return __libc_realloc(p, n);
+}
+
+int posix_memalign(void** p, size_t alignment, size_t n) __THROW
+{
+    allocCount.fetch_add(1, std::memory_order_relaxed);
+    allocBytes.fetch_add(n, std::memory_order_relaxed);
+    *p = __libc_memalign(alignment, n);
+    return *p || n == 0 ? 0 : ENOMEM;
+}
+
+void* memalign(size_t alignment, size_t n) __THROW
+{
+    allocCount.fetch_add(1, std::memory_order_relaxed);
+    allocBytes.fetch_add(n, std::memory_order_relaxed);
+    return __libc_memalign(alignment, n);
+}
+
+void* aligned_alloc(size_t alignment, size_t n) __THROW
+{
+    return memalign(alignment, n);
+}
+
+void free(void* p) __THROW
+{
+    __libc_free(p);
+}
+}
+
+static void allocationCounters(unsigned long long& count,
+                               unsigned long long& bytes)
+{
+    count = allocCount.load();
+    bytes = allocBytes.load();
+}
+#else
+static void allocationCounters(unsigned long long& count,
+                               unsigned long long& bytes)
+{
+    count = bytes = 0;
+}
+#endif
+
+/* ------------------------------ the harness ------------------------------ */
+
+class Bench
+{
+private:
+    string filter;   // only run benchmarks whose name contains it
+    double minTime;  // seconds of timed runs per benchmark
+    vector<string> results;
+
+public:
+    Bench(const string& filter, double minTime)
+        : filter(filter), minTime(minTime) {}
+
+    /*
+     * Times op. params is a JSON object body, items the amount of work
+     * of one run in unit.
+     */
+    template <typename Op>
+    void run(const string& name, const string& params, double items,
+             const char* unit, Op op)
+    {
+        if (!filter.empty() && name.find(filter) == string::npos)
+            return;
+        typedef std::chrono::steady_clock Clock;
+
+        op(); // warm-up: first-touch of buffers, lazy initialization
+
+        vector<double> ns;
+        unsigned long long count0, bytes0, count1, bytes1;
+        allocationCounters(count0, bytes0);
+        double total = 0;
+        while ((total < minTime * 1e9 || ns.size() < 3) && ns.size() < 100000)
+        {
+            Clock::time_point t0 = Clock::now();
+            op();
+            double t = std::chrono::duration<double, std::nano>(
+                           Clock::now() - t0).count();
+            ns.push_back(t);
+            total += t;
+        }
+        allocationCounters(count1, bytes1);
+
+        size_t n = ns.size();
+        double mean = total / n;
+        std::sort(ns.begin(), ns.end());
+        double median = ns[n / 2];
+#ifdef __GLIBC__
+        double allocs = (double)(count1 - count0) / n;
+        double bytes = (double)(bytes1 - bytes0) / n;
+#else
+        double allocs = -1, bytes = -1;
+#endif
+
+        std::ostringstream json;
+        json.precision(6);
+        json << "{\"name\": \"" << name << "\", \"params\": {" << params
+             << "}, \"iterations\": " << n
+             << ", \"median_ns\": " << median
+             << ", \"mean_ns\": " << mean
+             << ", \"min_ns\": " << ns[0]
+             << ", \"items_per_s\": " << items / (median * 1e-9)
+             << ", \"unit\": \"" << unit << "\""
+             << ", \"allocs_per_op\": " << allocs
+             << ", \"bytes_per_op\": " << bytes << "}";
+        results.push_back(json.str());
+        cerr << name << " {" << params << "}: " << median / 1e6 << " ms\n";
+    }
+
+    void print(const string& context)
+    {
+        cout << "{\"context\": {" << context << "},\n \"benchmarks\": [\n";
+        for (size_t i = 0; i < results.size(); i++)
+            cout << "  " << results[i]
+                 << (i + 1 < results.size() ? ",\n" : "\n");
+        cout << "]}\n";
+    }
+};
+
+/* ---------------------------- synthetic data ----------------------------- */
+
+/*
+ * Smoothed noise: a fixed seed makes every run see the same pixels, and
+ * the blur gives the filters texture rather than white noise to respond
+ * to.
+ */
+static Mat syntheticImage(int rows, int cols)
+{
+    Mat image(rows, cols, CV_8UC3);
+    RNG rng(12345);
+    rng.fill(image, RNG::UNIFORM, 0, 256);
+    GaussianBlur(image, image, Size(7, 7), 2);
+    return image;
+}
+
+static Mat randomWords(int K, int dims, int depth)
+{
+    Mat words(K, dims, CV_32F);
+    RNG rng(K);
+    rng.fill(words, RNG::NORMAL, 0, 20);
+    words.convertTo(words, depth);
+    return words;
+}
+
+// N L1-normalized histograms over K words.
+static Mat randomHistograms(int N, int K)
+{
+    Mat h(N, K, CV_64F);
+    RNG rng(N);
+    rng.fill(h, RNG::UNIFORM, 0, 1);
+    for (int i = 0; i < N; i++)
+    {
+        Mat row = h.row(i);
+        row /= sum(row)[0];
+    }
+    return h;
+}
+
+// N L1-normalized histograms with nonzero random bins out of K.
+static Mat randomSparseHistograms(int N, int K, int nonzero)
+{
+    Mat h = Mat::zeros(N, K, CV_64F);
+    RNG rng(N + K);
+    for (int i = 0; i < N; i++)
+    {
+        double* row = h.ptr<double>(i);
+        for (int j = 0; j < nonzero; j++)
+            row[rng.uniform(0, K)] += rng.uniform(0., 1.);
+        Mat r = h.row(i);
+        r /= sum(r)[0];
+    }
+    return h;
+}
+
+static string param(const char* name, int value)
+{
+    return "\"" + string(name) + "\": " + to_string(value);
+}
+
+int main(int argc, char **argv)
+{
+    // The task pool owns the cores (see scheduler.hpp).
+    OpenCvThreadsOff openCvThreadsOff;
+
+    string filter;
+    double minTime = 0.5;
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        if (arg == "--filter" && i+1 < argc)
+            filter = argv[++i];
+        else if (arg == "--min-time" && i+1 < argc)
+            minTime = atof(argv[++i]);
+        else
+        {
+            cout << "Usage: ./benchmark [--filter <substring>] "
+                 << "[--min-time <seconds>]\n";
+            return -1;
+        }
+    }
+
+    Bench bench(filter, minTime);
+    FilterBank filterbank;
+    int depth = filterbank.getDepth();
+
+    // Accuracy before speed: the responses the benchmarks time must be
+    // those of dense filtering, within the stated tolerance.
+    double toleranceRatio;
+    {
+        Mat lab;
+        filterbank.toLab(syntheticImage(256, 256), lab);
+        toleranceRatio = filterbank.getEngine().toleranceRatio(lab);
+    }
+
+    // FilterBank::filter across image sizes.
+    for (int size : {128, 256, 512})
+    {
+        Mat image = syntheticImage(size, size);
+        Mat response;
+        bench.run("filter", param("size", size), size * size, "pixels",
+                  [&] { filterbank.filter(image, response); });
+    }
+
+    Mat image = syntheticImage(256, 256);
+    Mat responses;
+    filterbank.filter(image, responses);
+    int dims = responses.cols;
+
+    // Word assignment across dictionary sizes: the per-pixel kernel, the
+    // batched one, and the whole getWordmap (filtering included).
+    for (int K : {64, 150, 512, 2048})
+    {
+        Mat words = randomWords(K, dims, depth);
+        Dictionary dict;
+        dict.setWords(words, Mat(), depth);
+        string p = param("K", K) + ", " + param("pixels", responses.rows);
+
+        TransposedCenters transposed;
+        transposed.create(words);
+        vector<int> labels(responses.rows);
+        bench.run("nearestWord", p, responses.rows, "pixels", [&] {
+            for (int i = 0; i < responses.rows; i++)
+                labels[i] = transposed.nearest(responses.ptr<float>(i));
+        });
+        bench.run("assignNearest", p, responses.rows, "pixels", [&] {
+            assignNearest(responses, words, dict.getCenterNorms(),
+                          &labels[0]);
+        });
+        bench.run("getWordmap", p, responses.rows, "pixels",
+                  [&] { dict.getWordmap(image, filterbank); });
+    }
+
+    // Reduced-resolution word maps of a camera-sized image, see
+    // FilterBank::setResolution.
+    {
+        Mat camera = syntheticImage(960, 1280);
+        Dictionary dict;
+        dict.setWords(randomWords(150, dims, depth), Mat(), depth);
+        // maxSide, pyramidLevels, stride
+        const int settings[][3] = {
+            {0, 0, 1}, {0, 2, 1}, {0, 2, 2}, {640, 0, 1}, {640, 2, 2}
+        };
+        for (const int* s : settings)
+        {
+            ResolutionParams resolution;
+            resolution.maxSide = s[0];
+            resolution.pyramidLevels = s[1];
+            resolution.stride = s[2];
+            FilterBank reduced;
+            reduced.setResolution(resolution);
+            bench.run("getWordmapReduced", param("max_side", s[0]) + ", "
+                      + param("pyramid", s[1]) + ", " + param("stride", s[2]),
+                      camera.total(), "pixels",
+                      [&] { dict.getWordmap(camera, reduced); });
+        }
+    }
+
+    // Histogram of a 512x512 word map.
+    {
+        Mat wordmap(512, 512, CV_32S);
+        RNG rng(7);
+        rng.fill(wordmap, RNG::UNIFORM, 0, 150);
+        Mat h;
+        bench.run("computeHistogram", param("K", 150) + ", "
+                  + param("pixels", 512 * 512), 512 * 512, "pixels",
+                  [&] { computeHistogram(wordmap, h, 150); });
+    }
+
+    // Histogram intersection and kNN across training-set sizes.
+    for (int N : {1000, 10000, 100000})
+    {
+        Mat training = randomHistograms(N, 150);
+        Mat queries = randomHistograms(64, 150);
+        vector<int> labels(N);
+        for (int i = 0; i < N; i++)
+            labels[i] = 1 + i % 10;
+        Mat query = queries.row(0);
+        string p = param("N", N) + ", " + param("K", 150);
+
+        if (N <= 10000)
+            bench.run("distance", p, N, "rows",
+                      [&] { distance(query, training); });
+
+        KnnClassifier knn;
+        knn.setTrainingSet(training, labels);
+        bench.run("knnClassify", p, N, "rows",
+                  [&] { knn.classify(query, 5); });
+        vector<int> predicted;
+        bench.run("knnClassifyBatch", p + ", " + param("queries", 64),
+                  (double)N * 64, "rows",
+                  [&] { knn.classifyBatch(queries, 5, predicted); });
+
+    }
+
+    // The inverted index, on the sparse histograms of a large vocabulary
+    // (dense ones get no index, see KnnClassifier::buildIndex).
+    for (int N : {10000, 100000})
+    {
+        Mat training = randomSparseHistograms(N, 4096, 64);
+        Mat queries = randomSparseHistograms(1, 4096, 64);
+        vector<int> labels(N);
+        for (int i = 0; i < N; i++)
+            labels[i] = 1 + i % 10;
+        Mat query = queries.row(0);
+        string p = param("N", N) + ", " + param("K", 4096) + ", "
+                   + param("nonzero", 64);
+
+        KnnClassifier knn;
+        knn.setTrainingSet(training, labels);
+        bench.run("knnClassifySparse", p, N, "rows",
+                  [&] { knn.classify(query, 5); });
+        knn.buildIndex();
+        bench.run("knnClassifyIndexed", p, N, "rows",
+                  [&] { knn.classify(query, 5); });
+    }
+
+    TransposedCenters probe;
+    probe.create(randomWords(8, 8, CV_32F));
+    bench.print("\"simd\": \"" + string(probe.kernelName())
+                + "\", \"threads\": " + to_string(omp_get_max_threads())
+                + ", \"filter_tolerance_ratio\": "
+                + to_string(toleranceRatio));
+    if (toleranceRatio > 1)
+    {
+        cerr << "Filter responses exceed the tolerance of the convolution "
+             << "engine (ratio " << toleranceRatio << ")\n";
+        return -1;
+    }
+    return 0;
+}
@@ -1,17 +1,28 @@
 #include "bow.hpp"
+#include "profile.hpp"
+#include "scheduler.hpp"
+#include "workspace.hpp"
 #include <algorithm>
 #include <cmath>
 #include <iostream>
+#include <set>
 
 using namespace std;
 using namespace cv;
 
 #define NUM_CHANNEL 3
 
+// Smallest sigma a filter keeps on a pyramid level, so that the reduced
+// kernel (at least 13 taps) still samples its shape well.
+static const double PYRAMID_MIN_SIGMA = 2.0;
+// Pixels per word assignment task: large enough to amortize the task,
+// small enough for a 640x480 image to spread over a few dozen cores.
+static const int ASSIGN_TILE_ROWS = 8192;
+
 /*
  * Default constructor of filterbank.
  */
-FilterBank::FilterBank()
+FilterBank::FilterBank(int depth) : depth(depth)
 {
     // Default parameters.
     vector<double> s = {1, 2, 3};      // scales
@@ -28,7 +39,8 @@ FilterBank::FilterBank()
 FilterBank::FilterBank(vector<double>& scales,
                        vector<double>& gaussianSigmas,
                        vector<double>& logSigmas,
-                       vector<double>& dGaussianSigmas)
+                       vector<double>& dGaussianSigmas,
+                       int depth) : depth(depth)
 {
     initialize(scales, gaussianSigmas, logSigmas, dGaussianSigmas);
 }
@@ -43,6 +55,11 @@ void FilterBank::initialize(vector<double>& scales,
                     vector<double>& logSigmas,
                     vector<double>& dGaussianSigmas)
 {
+    params[0] = scales;
+    params[1] = gaussianSigmas;
+    params[2] = logSigmas;
+    params[3] = dGaussianSigmas;
+
     for (double scale : scales)
     {
         double scaleMultiply = pow(sqrt(2), scale);
@@ -50,63 +67,330 @@ void FilterBank::initialize(vector<double>& scales,
         // Creates gaussian filters.
         for (double s : gaussianSigmas)
         {
-            double sigma = s*scaleMultiply;
-            int ksize = ceil(sigma*6+1);
-            Mat kernel = getGaussianFilter(ksize, sigma);
-            filters.push_back(kernel);
+            types.push_back(FILTER_GAUSSIAN);
+            sigmas.push_back(s*scaleMultiply);
         }
 
         // Create d/dx, d/dy gaussians.
-        Mat dx, dy;
-        getDerivKernels(dx, dy, 1, 1, 3);
-        dy = dy.t();
         for (double s : dGaussianSigmas)
         {
-            double sigma = s*scaleMultiply;
-            int ksize = ceil(sigma*6+1);
-            Mat kernel = getGaussianFilter(ksize, sigma);
-            Mat dk;
-            filter2D(kernel, dk, -1, dx);
-            filters.push_back(dk);
-            filter2D(kernel, dk, -1, dy);
-            filters.push_back(dk);
+            types.push_back(FILTER_DX);
+            sigmas.push_back(s*scaleMultiply);
+            types.push_back(FILTER_DY);
+            sigmas.push_back(s*scaleMultiply);
         }
 
         // Creates LoG filters.
         for (double s : logSigmas)
         {
-            double sigma = s*scaleMultiply;
-            int ksize = ceil(sigma*6+1);
-            Mat kernel = getLOGFilter(ksize, sigma);
-            filters.push_back(kernel);
+            types.push_back(FILTER_LOG);
+            sigmas.push_back(s*scaleMultiply);
         }
     }
+
+    engine = ConvolutionEngine(depth);
+    for (size_t i = 0; i < types.size(); i++)
+    {
+        filters.push_back(makeFilter(types[i], sigmas[i]));
+        engine.addKernel(filters.back());
+    }
+}
+
+/*
+ * One filter of the bank, with a support of 6 sigmas.
+ */
+Mat FilterBank::makeFilter(FilterType type, double sigma)
+{
+    int ksize = ceil(sigma*6+1);
+    if (type == FILTER_LOG)
+        return getLOGFilter(ksize, sigma);
+
+    Mat kernel = getGaussianFilter(ksize, sigma);
+    if (type == FILTER_GAUSSIAN)
+        return kernel;
+
+    Mat dx, dy, dk;
+    getDerivKernels(dx, dy, 1, 1, 3);
+    dy = dy.t();
+    filter2D(kernel, dk, -1, type == FILTER_DX ? dx : dy);
+    return dk;
 }
 
 /*
  * Get the filter response of image.
  * response is a numPixels * (numFilters*3) matrix.
  */
-void FilterBank::filter(Mat& image, Mat& response)
+void FilterBank::filter(const Mat& image, Mat& response,
+                        Workspace* workspace) const
+{
+    WorkspaceLease ws(workspace);
+    // Convert to Lab, in a copy
+    Mat lab = ws->buffer(WS_LAB, image.rows, image.cols,
+                         CV_MAKETYPE(depth, NUM_CHANNEL));
+    toLab(image, lab);
+    filterRows(lab, 0, lab.rows, response, &*ws);
+}
+
+/*
+ * Converts a BGR image to Lab in the precision of the filterbank.
+ */
+void FilterBank::toLab(const Mat& image, Mat& lab) const
 {
-    int numPixels = image.rows * image.cols;
+    ProfileTimer timer(PROFILE_LAB, image.total());
+    Mat tmp = threadWorkspace().buffer(WS_LAB, image.rows, image.cols,
+                                       CV_8UC3);
+    cvtColor(image, tmp, CV_BGR2Lab);
+    tmp.convertTo(lab, depth);
+}
+
+/*
+ * Filter responses of rows [rowStart, rowEnd) of a Lab image.
+ * Only the strip plus getHalo() rows on each side is filtered, and the
+ * result is the same as the corresponding rows of filter().
+ */
+void FilterBank::filterRows(const Mat& lab, int rowStart, int rowEnd,
+                            Mat& response, Workspace* workspace) const
+{
+    int halo = engine.getHalo();
+    int top = max(0, rowStart - halo);
+    int bottom = min(lab.rows, rowEnd + halo);
+    int numPixels = (rowEnd - rowStart) * lab.cols;
     int numFilters = filters.size();
-    int ddepth = -1;
-    Mat tmp;
+    vector<Mat> responses;
+    ProfileTimer timer(PROFILE_FILTER, numPixels);
+
+    response.create(numPixels, numFilters*3, depth);
 
-    cvtColor(image, image, CV_BGR2Lab); // Convert to Lab
-    response.create(numPixels, numFilters*3, CV_64F);
+    WorkspaceLease ws(workspace);
+    engine.apply(lab.rowRange(top, bottom), responses, &*ws);
+
+    parallelFor(0, numFilters, 1, [&](int i0, int i1) {
+        for (int i = i0; i < i1; i++)
+        {
+            // drop the halo rows
+            Mat tmp = responses[i].rowRange(rowStart - top, rowEnd - top);
+            tmp = tmp.reshape(1, numPixels); // numPixels*3 1-channel matrix
+            tmp.copyTo(response.colRange(3*i, 3*i+3));
+        }
+    });
+}
 
+/*
+ * Dot products of every kernel with the patch around (y,x) of a Lab image.
+ * Out-of-image taps use BORDER_REFLECT_101, like filter().
+ */
+template <typename T>
+static void filterPixel(const Mat& lab, int y, int x,
+                        const vector<Mat>& filters, T* out)
+{
+    vector<int> rowIdx, colIdx;
     int idx = 0;
-    for (Mat filter : filters)
+    for (const Mat& kernel : filters)
+    {
+        int ay = kernel.rows / 2;
+        int ax = kernel.cols / 2;
+        rowIdx.resize(kernel.rows);
+        colIdx.resize(kernel.cols);
+        for (int i = 0; i < kernel.rows; i++)
+            rowIdx[i] = borderInterpolate(y + i - ay, lab.rows,
+                                          BORDER_REFLECT_101);
+        for (int j = 0; j < kernel.cols; j++)
+            colIdx[j] = borderInterpolate(x + j - ax, lab.cols,
+                                          BORDER_REFLECT_101);
+
+        double sum[NUM_CHANNEL] = {0, 0, 0};
+        for (int i = 0; i < kernel.rows; i++)
+        {
+            const double* k = kernel.ptr<double>(i);
+            const T* row = lab.ptr<T>(rowIdx[i]);
+            for (int j = 0; j < kernel.cols; j++)
+            {
+                const T* px = row + NUM_CHANNEL*colIdx[j];
+                for (int c = 0; c < NUM_CHANNEL; c++)
+                    sum[c] += k[j] * px[c];
+            }
+        }
+        for (int c = 0; c < NUM_CHANNEL; c++)
+            out[idx++] = (T)sum[c];
+    }
+}
+
+/*
+ * Filter responses at a few pixels only (row-major pixel indices).
+ * response is a pixels.size() * (numFilters*3) matrix whose rows match the
+ * corresponding rows of filter(), without convolving the whole image.
+ */
+void FilterBank::filterAt(const Mat& lab, const vector<int>& pixels,
+                          Mat& response) const
+{
+    int numFilters = filters.size();
+    response.create(pixels.size(), numFilters*3, depth);
+
+    for (size_t p = 0; p < pixels.size(); p++)
     {
-        filter2D(image, tmp, ddepth, filter); // store filtered image in tmp
-        tmp = tmp.reshape(1, numPixels); // make numPixels*3 1-channel matrix
-        tmp.copyTo(response.colRange(idx, idx+3));
-        idx += 3;
+        int y = pixels[p] / lab.cols;
+        int x = pixels[p] % lab.cols;
+        if (depth == CV_32F)
+            filterPixel(lab, y, x, filters, response.ptr<float>(p));
+        else
+            filterPixel(lab, y, x, filters, response.ptr<double>(p));
+    }
+}
+
+int FilterBank::getHalo() const
+{
+    return engine.getHalo();
+}
+
+int FilterBank::getDepth() const
+{
+    return depth;
+}
+
+int FilterBank::getNumFilters() const
+{
+    return filters.size();
+}
+
+const ConvolutionEngine& FilterBank::getEngine() const
+{
+    return engine;
+}
+
+void FilterBank::setResolution(const ResolutionParams& params)
+{
+    resolution = params;
+    resolution.maxSide = max(params.maxSide, 0);
+    resolution.pyramidLevels = max(params.pyramidLevels, 0);
+    resolution.stride = max(params.stride, 1);
+
+    levelEngines.clear();
+    levelFilters.clear();
+    int levels = resolution.pyramidLevels;
+    if (levels == 0)
+        return;
+
+    levelEngines.assign(levels + 1, ConvolutionEngine(depth));
+    levelFilters.assign(levels + 1, vector<int>());
+    for (size_t i = 0; i < filters.size(); i++)
+    {
+        int l = 0;
+        while (l < levels && sigmas[i] >= PYRAMID_MIN_SIGMA * (2 << l))
+            l++;
+        levelFilters[l].push_back(i);
+        levelEngines[l].addKernel(l == 0 ? filters[i]
+                                  : makeFilter(types[i], sigmas[i] / (1 << l)));
+    }
+}
+
+const ResolutionParams& FilterBank::getResolution() const
+{
+    return resolution;
+}
+
+bool FilterBank::isReduced() const
+{
+    return resolution.maxSide > 0 || resolution.pyramidLevels > 0
+           || resolution.stride > 1;
+}
+
+void FilterBank::filterReduced(const Mat& image, Mat& response,
+                               Size& grid) const
+{
+    Mat capped = image;
+    int side = max(image.rows, image.cols);
+    if (resolution.maxSide > 0 && side > resolution.maxSide)
+    {
+        double f = (double)resolution.maxSide / side;
+        resize(image, capped, Size(max(1, (int)round(image.cols * f)),
+                                   max(1, (int)round(image.rows * f))),
+               0, 0, INTER_AREA);
+    }
+    Mat lab;
+    toLab(capped, lab);
+
+    int stride = resolution.stride;
+    grid = Size((lab.cols + stride - 1) / stride,
+                (lab.rows + stride - 1) / stride);
+    int numPixels = grid.area();
+    response.create(numPixels, filters.size()*3, depth);
+    ProfileTimer timer(PROFILE_FILTER, numPixels);
+
+    vector<int> all;
+    if (levelEngines.empty())
+        for (size_t i = 0; i < filters.size(); i++)
+            all.push_back(i);
+
+    Mat level = lab;
+    Mat mapX(grid, CV_32F), mapY(grid, CV_32F);
+    int numLevels = max((int)levelEngines.size(), 1);
+    for (int l = 0; l < numLevels; l++)
+    {
+        if (l > 0)
+            resize(level, level, Size((level.cols + 1) / 2,
+                                      (level.rows + 1) / 2),
+                   0, 0, INTER_AREA);
+        const vector<int>& indices = levelEngines.empty() ? all
+                                                          : levelFilters[l];
+        if (indices.empty())
+            continue;
+        vector<Mat> responses;
+        (levelEngines.empty() ? engine : levelEngines[l]).apply(level,
+                                                                responses);
+
+        // Grid point (x*stride, y*stride) of lab, in level coordinates
+        // (pixel centers aligned as by resize).
+        bool sampled = l > 0 || stride > 1;
+        if (sampled)
+        {
+            double fx = (double)level.cols / lab.cols;
+            double fy = (double)level.rows / lab.rows;
+            for (int y = 0; y < grid.height; y++)
+            {
+                float* mx = mapX.ptr<float>(y);
+                float* my = mapY.ptr<float>(y);
+                for (int x = 0; x < grid.width; x++)
+                {
+                    mx[x] = (float)((x*stride + 0.5) * fx - 0.5);
+                    my[x] = (float)((y*stride + 0.5) * fy - 0.5);
+                }
+            }
+        }
+
+        for (size_t j = 0; j < indices.size(); j++)
+        {
+            int i = indices[j];
+            Mat r;
+            if (sampled)
+                remap(responses[j], r, mapX, mapY, INTER_LINEAR,
+                      BORDER_REPLICATE);
+            else
+                r = responses[j];
+            // A filter of sigma s/2^l on the level sees the image 2^l
+            // times smaller: Gaussians (unnormalized) respond 4^l times
+            // weaker, derivatives 2^l times, LoGs the same.
+            double gain = 1;
+            if (types[i] == FILTER_GAUSSIAN)
+                gain = 1 << (2*l);
+            else if (types[i] != FILTER_LOG)
+                gain = 1 << l;
+            r.reshape(1, numPixels).convertTo(response.colRange(3*i, 3*i+3),
+                                              depth, gain);
+        }
     }
 }
 
+void FilterBank::getParams(vector<double>& scales,
+                           vector<double>& gaussianSigmas,
+                           vector<double>& logSigmas,
+                           vector<double>& dGaussianSigmas) const
+{
+    scales = params[0];
+    gaussianSigmas = params[1];
+    logSigmas = params[2];
+    dGaussianSigmas = params[3];
+}
+
 /*
  * Gaussian kernel generator.
  */
@@ -162,7 +446,9 @@ Mat FilterBank::getLOGFilter(int ksize, double sigma)
 }
 
 
-Dictionary::Dictionary(){
+Dictionary::Dictionary()
+    : exactAssignment(false), stripRows(0), sparseSampling(false),
+      treeBranching(0), treeLevels(0), distortion(0) {
     
 }
 Dictionary::~Dictionary() {
@@ -177,73 +463,237 @@ Dictionary::~Dictionary() {
  */
 void Dictionary::create(int alpha, int K, FilterBank& filterbank,
             vector<string>& trainingImagesPath, string& imagesDir) {
-   
-    int numImg = (int)trainingImagesPath.size();
-    int numRes;
+    Mat samples;
+    sampleImages(alpha, filterbank, trainingImagesPath, imagesDir, 0,
+                 samples);
+    cluster(K, samples);
+}
+
+void Dictionary::sampleImages(int alpha, const FilterBank& filterbank,
+            vector<string>& imagesPath, string& imagesDir, int firstIndex,
+            Mat& samples) const {
+    int numImg = (int)imagesPath.size();
+    int depth = filterbank.getDepth();
 
     //for each the images, get the filter response
     //select alpha responses from each image and put all in a Mat
-    Mat Response; 
-    Mat allSelectedFilterResponses;
-    vector<int> randomIndex;
-    int N = 0;
+    //pixel sampling follows the k-means seed, so a fixed seed gives a
+    //reproducible dictionary
+    uint64 seed = kmeansParams.seed ? kmeansParams.seed
+                                    : (uint64)getTickCount();
+
+    //read, filter and sample the images in a pipeline (see pipeline.hpp);
+    //each image draws its pixels from its own generator, so the result
+    //does not depend on the order the workers finish in
+    vector<Mat> selected(numImg);
+    runPipeline(imagesPath, imagesDir, pipelineParams,
+                [&](PipelineItem& item) {
+        const Mat& Img = item.image;
+        if(Img.empty())
+            return;
+
+        RNG imageRng(seed + firstIndex + item.index);
+        sampleResponses(Img, filterbank, alpha, imageRng,
+                        selected[item.index]);
+    });
+
+    //stack the samples of all images, in image order
+    int numSelected = 0, dims = 0;
     for(int i = 0; i < numImg; i++) {
-        //cout << "Processing image " << i+1 << "/" << numImg << endl;
+        numSelected += selected[i].rows;
+        dims = max(dims, selected[i].cols);
+    }
+    samples.create(numSelected, dims, depth);
+    numSelected = 0;
+    for(int i = 0; i < numImg; i++) {
+        if(selected[i].empty())
+            continue;
+        selected[i].copyTo(samples.rowRange(numSelected,
+                                            numSelected + selected[i].rows));
+        numSelected += selected[i].rows;
+    }
+}
 
-       //read the image
-        Mat Img = imread(imagesDir + trainingImagesPath[i], 1);
+void Dictionary::cluster(int K, const Mat& samples) {
+    int depth = samples.depth();
 
-       //filter response
-        filterbank.filter(Img, Response);
+    //kmeans to get K clusters
+    //the trainer works on CV_32F; shared, not copied, on the float path
+    Mat floatAllResponses = samples;
+    if(samples.depth() != CV_32F)
+        samples.convertTo(floatAllResponses, CV_32F);
+    Mat kmeansResultCenters;
+    if(treeBranching > 0) {
+        //hierarchical vocabulary: the leaves are the words
+        VocabularyTree built;
+        built.build(floatAllResponses, treeBranching, treeLevels,
+                    kmeansParams);
+        built.getWords(kmeansResultCenters);
+        tree.set(built.getCenters(), built.getNodes(), depth);
+    }
+    else {
+        KMeans trainer(K, kmeansParams);
+        trainer.fit(floatAllResponses, kmeansResultCenters);
+        tree = VocabularyTree();
+    }
+    kmeansResultCenters.convertTo(dictionary, depth);
+    computeCenterNorms(dictionary, centerNorms);
+    transposed.create(dictionary);
 
-        numRes = Response.cols;
+    //baseline of the drift check, see measureDistortion
+    distortion = measureDistortion(samples);
+}
 
-        randomIndex.clear();
-        //decide which alpha pixels to take
-        N = Response.rows;
-        //decide which alpha pixels to take        
-        randAlpha(randomIndex, N, alpha);
+bool Dictionary::cluster(int K, SampleSource& samples, int depth) {
+    if(treeBranching > 0 || kmeansParams.miniBatch <= 0) {
+        cout << "Clustering samples on disk needs flat mini-batch k-means"
+             << endl;
+        return false;
+    }
+    if(samples.rows() < K) {
+        cout << "Only " << samples.rows() << " samples for " << K
+             << " words" << endl;
+        return false;
+    }
 
-        Mat newMat = Mat::zeros(alpha, numRes, CV_64F);
-        for(int j = 0; j < alpha; j++) {
-            for(int k = 0; k < numRes; k++)
-            newMat.at<double>(j,k) = Response.at<double>(randomIndex[j],k);
-        }
+    Mat kmeansResultCenters;
+    KMeans trainer(K, kmeansParams);
+    if(trainer.fit(samples, kmeansResultCenters) < 0) {
+        cout << "Error reading the samples" << endl;
+        return false;
+    }
+    tree = VocabularyTree();
+    kmeansResultCenters.convertTo(dictionary, depth);
+    computeCenterNorms(dictionary, centerNorms);
+    transposed.create(dictionary);
+
+    //baseline of the drift check, on as many samples as k-means probes
+    RNG rng(kmeansParams.seed ? kmeansParams.seed : (uint64)getTickCount());
+    int n = min(samples.rows(), max(10 * kmeansParams.miniBatch, 100 * K));
+    Mat probe;
+    if(!drawSamples(samples, n, rng, probe)) {
+        cout << "Error reading the samples" << endl;
+        return false;
+    }
+    distortion = measureDistortion(probe);
+    return true;
+}
 
-        for(int j = 0; j < alpha; j++) {
-            allSelectedFilterResponses.push_back(newMat.row(j));
-        }
+//responses at alpha random pixels of one image
+void Dictionary::sampleResponses(const Mat& image,
+                                 const FilterBank& filterbank, int alpha,
+                                 RNG& rng, Mat& samples) const {
+    //decide which alpha pixels to take
+    vector<int> randomIndex;
+    randAlpha(rng, randomIndex, image.rows * image.cols, alpha);
 
-       
+    if(sparseSampling) {
+        //filter responses at the chosen pixels only
+        Mat lab;
+        filterbank.toLab(image, lab);
+        filterbank.filterAt(lab, randomIndex, samples);
     }
-    
+    else {
+        WorkspaceLease ws;
+        Mat Response = ws->buffer(WS_RESPONSE, image.rows * image.cols,
+                                  3 * filterbank.getNumFilters(),
+                                  filterbank.getDepth());
+        filterbank.filter(image, Response, &*ws);
+        samples.create(randomIndex.size(), Response.cols,
+                       filterbank.getDepth());
+        for(int j = 0; j < (int)randomIndex.size(); j++)
+            Response.row(randomIndex[j]).copyTo(samples.row(j));
+    }
+}
 
-    //kmeans to get K clusters
-    int allResponsesRows = allSelectedFilterResponses.rows;
-    Mat floatAllResponses(allResponsesRows, numRes, CV_32F);
-    for(int i = 0; i < allResponsesRows; i++)
-        for(int j = 0; j < numRes; j++)
-            floatAllResponses.at<float>(i,j) = (float) allSelectedFilterResponses.at<double>(i,j);
-    //cout<<"float result :"<< endl << floatAllResponses << endl;
-    Mat kmeansResultCenters;
-    Mat labels;
-    TermCriteria criteria;
-    criteria.epsilon = 0.01;
-    double compactness = kmeans(floatAllResponses, K, labels, 
-        criteria, 3, KMEANS_RANDOM_CENTERS, kmeansResultCenters );
-    //cout<<"cluster after kmeans" << endl << kmeansResultCenters << endl;
-    dictionary = Mat::zeros(K, numRes, CV_64F);
-    for(int i = 0; i < K; i++)
-        for(int j = 0; j < numRes; j++)
-            dictionary.at<double>(i,j) = (double) kmeansResultCenters.at<float>(i,j);
+double Dictionary::measureDistortion(const Mat& samples) const {
+    if(samples.empty() || dictionary.empty())
+        return 0;
+    Mat converted = samples;
+    if(samples.depth() != dictionary.depth())
+        samples.convertTo(converted, dictionary.depth());
+    vector<int> labels(converted.rows);
+    vector<double> distances(converted.rows);
+    assignNearest(converted, dictionary, centerNorms, &labels[0],
+                  &distances[0]);
+    double total = 0;
+    for(size_t i = 0; i < distances.size(); i++)
+        total += distances[i];
+    return total / distances.size();
+}
+
+double Dictionary::getDistortion() const {
+    return distortion;
+}
+
+
+//Floyd's algorithm: min(alpha, N) distinct indices out of [0, N) in
+//O(alpha), instead of shuffling all N pixel indices
+void Dictionary::randAlpha(RNG& rng, vector<int> &randomIndex, int N,
+                           int alpha) const {
+    set<int> chosen;
+    for(int j = N - min(alpha, N); j < N; j++) {
+        int t = rng.uniform(0, j + 1);
+        if(!chosen.insert(t).second)
+            chosen.insert(j);
+    }
+    randomIndex.assign(chosen.begin(), chosen.end());
+}
+
+void Dictionary::setSparseSampling(bool sparse) {
+    sparseSampling = sparse;
+}
+
+bool Dictionary::getSparseSampling() const {
+    return sparseSampling;
+}
+
+void Dictionary::setKMeansParams(const KMeansParams& params) {
+    kmeansParams = params;
+}
+
+void Dictionary::setPipelineParams(const PipelineParams& params) {
+    pipelineParams = params;
+}
+
+void Dictionary::setVocabularyTree(int branching, int levels) {
+    treeBranching = branching;
+    treeLevels = levels;
+}
+
+void Dictionary::setTree(const VocabularyTree& tree) {
+    CV_Assert(tree.getNumWords() == dictionary.rows);
+    this->tree = tree;
+}
+
+const VocabularyTree& Dictionary::getTree() const {
+    return tree;
 }
 
+void Dictionary::setWords(const Mat& words, const Mat& norms, int depth) {
+    tree = VocabularyTree();
+    if(words.depth() == depth)
+        dictionary = words;
+    else
+        words.convertTo(dictionary, depth);
+
+    if(!norms.empty() && norms.depth() == depth
+       && norms.total() == (size_t)dictionary.rows)
+        centerNorms = norms;
+    else
+        computeCenterNorms(dictionary, centerNorms);
+    if(dictionary.empty())
+        transposed = TransposedCenters();
+    else
+        transposed.create(dictionary);
+}
 
-void Dictionary::randAlpha(vector<int> &randomIndex, int N, int alpha) {
-    for(int i = 0; i < N; i++)
-        randomIndex.push_back(i);
-    random_shuffle(randomIndex.begin(), randomIndex.end());
+const Mat& Dictionary::getWords() const {
+    return dictionary;
+}
 
+const Mat& Dictionary::getCenterNorms() const {
+    return centerNorms;
 }
  
 //defination of path input, for example: ../data/
@@ -253,77 +703,162 @@ void Dictionary::save(const string& path) {
     String fullPath = path + dictName;
     FileStorage fs(fullPath, FileStorage::WRITE);  
     fs << "dictionary" << dictionary;  
+    fs << "responses" << RESPONSE_VERSION;
+    if(!tree.empty())
+        tree.write(fs);
+    fs << "distortion" << distortion;
     fs.release();
     return;
 
 }
 
-void Dictionary::load(const string& path) {
+bool Dictionary::load(const string& path, int depth) {
     FileStorage fs(path, FileStorage::READ);    
-    fs["dictionary"] >> dictionary;
+    Mat stored;
+    dictionary.release();
+    centerNorms.release();
+    transposed = TransposedCenters();
+    tree = VocabularyTree();
+    if(!fs.isOpened()) {
+        cout << "Error reading " << path << endl;
+        return false;
+    }
+    //absent from dictionaries of 8-bit responses, see RESPONSE_VERSION
+    int version = 1;
+    if(!fs["responses"].isNone())
+        fs["responses"] >> version;
+    if(version != RESPONSE_VERSION) {
+        cout << path << " was computed from filter responses of version "
+             << version << ", not " << RESPONSE_VERSION
+             << "; train the dictionary again" << endl;
+        return false;
+    }
+    fs["dictionary"] >> stored;
+    //dictionaries may have been saved with either precision
+    stored.convertTo(dictionary, depth);
+    tree.read(fs["vocabulary_tree"], depth);
+    //absent from dictionaries saved before the drift check existed
+    distortion = 0;
+    if(!fs["distortion"].isNone())
+        fs["distortion"] >> distortion;
     fs.release();
-    return;
+    if(dictionary.empty())
+        return false;
+    if(!tree.empty() && (tree.getNumWords() != dictionary.rows
+                         || tree.getCenters().cols != dictionary.cols)) {
+        cout << path << ": the vocabulary tree has " << tree.getNumWords()
+             << " words of " << tree.getCenters().cols
+             << " dimensions, the dictionary " << dictionary.rows << " of "
+             << dictionary.cols << endl;
+        dictionary.release();
+        tree = VocabularyTree();
+        return false;
+    }
+    computeCenterNorms(dictionary, centerNorms);
+    transposed.create(dictionary);
+    return true;
 }
 
-int Dictionary::getWordsNum() {
+int Dictionary::getWordsNum() const {
     return dictionary.rows;
 }
 
-Mat Dictionary::getWordmap(const Mat& image, FilterBank& filterbank) {
+void Dictionary::setExactAssignment(bool exact) {
+    exactAssignment = exact;
+}
+
+void Dictionary::setStripRows(int rows) {
+    stripRows = rows;
+}
+
+Mat Dictionary::getWordmap(const Mat& image, const FilterBank& filterbank,
+                           Workspace* workspace) const {
     int numRows = image.rows;
     int numCols = image.cols;
-    int allPixel = numRows * numCols; 
-    Mat imageBackup = image;
+    int numResponses = 3 * filterbank.getNumFilters();
+    int depth = filterbank.getDepth();
 
+    //lab and responses live in the workspace, so in steady state the
+    //word map is the only allocation
+    WorkspaceLease ws(workspace);
     Mat Response; 
-    filterbank.filter(imageBackup, Response);
-    int numRes = Response.cols;
-
-    Mat wordMap = Mat::zeros(numRows, numCols, CV_32S);
-
-    for(int i = 0; i < numRows; i++)
-        for(int j = 0; j < numCols; j++)
-        {
-            Mat oneResponse = Mat::zeros(1, numRes,CV_64F);
-
-            for(int k = 0; k < numRes; k++)
-                oneResponse.at<double>(0,k) = Response.at<double>(i*numCols+j,k);
 
-            int mapping = nearestWord(oneResponse);
+    if(filterbank.isReduced()) {
+        //one word per point of the reduced grid
+        Size grid;
+        filterbank.filterReduced(image, Response, grid);
+        Mat wordMap(grid, CV_32S);
+        assignWords(Response, wordMap.ptr<int>(0));
+        return wordMap;
+    }
 
-            wordMap.at<int>(i,j) = mapping;
+    Mat wordMap(numRows, numCols, CV_32S);
+    int* labels = wordMap.ptr<int>(0);
+
+    if(stripRows > 0) {
+        //streaming: filter and assign one strip at a time, so only
+        //stripRows rows of responses are alive at once
+        Mat lab = ws->buffer(WS_LAB, numRows, numCols,
+                             CV_MAKETYPE(depth, NUM_CHANNEL));
+        filterbank.toLab(image, lab);
+        for(int r0 = 0; r0 < numRows; r0 += stripRows) {
+            int r1 = min(r0 + stripRows, numRows);
+            Response = ws->buffer(WS_RESPONSE, (r1 - r0)*numCols,
+                                  numResponses, depth);
+            filterbank.filterRows(lab, r0, r1, Response, &*ws);
+            assignWords(Response, labels + r0*numCols);
         }
+        return wordMap;
+    }
+
+    Response = ws->buffer(WS_RESPONSE, numRows*numCols, numResponses, depth);
+    filterbank.filter(image, Response, &*ws);
+    assignWords(Response, labels);
     
     return wordMap;
 }
 
-int Dictionary::nearestWord(Mat& oneResponse) {
-    int K = dictionary.rows;
-    int numCols = dictionary.cols;
+void Dictionary::assignWords(const Mat& Response, int* labels) const {
+    CV_Assert(Response.depth() == dictionary.depth());
+    ProfileTimer timer(PROFILE_ASSIGN, Response.rows);
 
-    //initialize
-    double distance = 0;
-    int word = 0;
-    for(int i = 0; i < numCols; i++)
-    {
-        double diff = oneResponse.at<double>(0,i) - dictionary.at<double>(0,i);
-        distance += diff*diff;
-    }
+    //row tiles as parallel tasks; pixels are independent
+    parallelFor(0, Response.rows, ASSIGN_TILE_ROWS, [&](int r0, int r1) {
+        assignRows(Response.rowRange(r0, r1), labels + r0);
+    });
+}
 
-    for(int i = 1; i < K; i++)
-    {
-        double temp = 0;
-        for(int j = 0; j < numCols; j++)
+void Dictionary::assignRows(const Mat& Response, int* labels) const {
+    if(!tree.empty()) {
+        //O(branching * levels) per pixel, see vocabtree.hpp
+        for(int p = 0; p < Response.rows; p++)
         {
-            double diff = oneResponse.at<double>(0,j) - dictionary.at<double>(i,j);
-            temp += diff*diff;
+            if(Response.depth() == CV_32F)
+                labels[p] = tree.lookup(Response.ptr<float>(p));
+            else
+                labels[p] = tree.lookup(Response.ptr<double>(p));
         }
-        if(temp < distance) 
+    }
+    else if(exactAssignment) {
+        for(int p = 0; p < Response.rows; p++)
         {
-            distance = temp;
-            word = i;
+            if(Response.depth() == CV_32F)
+                labels[p] = nearestWord(Response.ptr<float>(p));
+            else
+                labels[p] = nearestWord(Response.ptr<double>(p));
         }
-
     }
-    return word;
+    else {
+        //batched assignment of all pixels, tile by tile (see nearest.hpp)
+        assignNearest(Response, dictionary, centerNorms, labels);
+    }
+}
+
+/*
+ * Runs the SIMD kernel selected for this CPU over the transposed
+ * dictionary (see TransposedCenters in nearest.hpp).
+ */
+template <typename T>
+int Dictionary::nearestWord(const T* oneResponse) const {
+    return transposed.nearest(oneResponse);
 }
@@ -5,13 +5,60 @@
 #include <vector>
 #include <string>
 
+#include "convolution.hpp"
+#include "nearest.hpp"
+#include "kmeans.hpp"
+#include "vocabtree.hpp"
+#include "pipeline.hpp"
+
 using namespace std;
 using namespace cv;
 
+/*
+ * Reduced-cost inference, trading accuracy for latency on large images
+ * (see FilterBank::setResolution). The defaults filter every pixel at
+ * native resolution.
+ */
+struct ResolutionParams
+{
+    int maxSide;       // longer image side is scaled down to at most this
+                       // many pixels first, 0: native resolution
+    int pyramidLevels; // filters with a large enough sigma run on up to
+                       // this many halvings of the image, 0: none
+    int stride;        // responses (and words) every stride pixels in
+                       // each direction, 1: every pixel
+
+    ResolutionParams() : maxSide(0), pyramidLevels(0), stride(1) {}
+};
+
+/*
+ * Version of the filter responses, stored in every file computed from
+ * them (dictionary.xml, histograms.xml). Version 1, in files without the
+ * field, was the saturated 8-bit output of filter2D on the 8-bit Lab
+ * image; version 2 is the unsaturated output of the convolution engine on
+ * a floating point Lab image. Words and histograms of another version do
+ * not match the responses computed now, so such files are rejected.
+ */
+const int RESPONSE_VERSION = 2;
+
 class FilterBank
 {
 private:
+    enum FilterType { FILTER_GAUSSIAN, FILTER_DX, FILTER_DY, FILTER_LOG };
+
     vector<Mat> filters; // filter list
+    vector<FilterType> types; // kind and sigma of every filter, to build
+    vector<double> sigmas;    // it again for a pyramid level
+    ConvolutionEngine engine; // decomposed filters, see convolution.hpp
+    int depth; // precision of the responses, CV_32F or CV_64F
+    // parameters the filters were built from: scales, gaussianSigmas,
+    // logSigmas and dGaussianSigmas
+    vector<double> params[4];
+    ResolutionParams resolution;
+    // pyramid level l runs levelFilters[l] (indices into filters), scaled
+    // to the level, through levelEngines[l]; empty without a pyramid
+    vector<ConvolutionEngine> levelEngines;
+    vector<vector<int> > levelFilters;
 
     void initialize(vector<double>& scales,
                     vector<double>& gaussianSigmas,
@@ -23,24 +70,107 @@ private:
      */
     Mat getGaussianFilter(int ksize, double sigma);
     Mat getLOGFilter(int ksize, double sigma);
+    Mat makeFilter(FilterType type, double sigma);
 
 public:
-    FilterBank();
+    /*
+     * depth selects the precision of the whole response pipeline:
+     * CV_32F (default) or CV_64F.
+     */
+    FilterBank(int depth = CV_32F);
     FilterBank(vector<double>& scales, vector<double>& gaussianSigmas,
-               vector<double>& logSigmas, vector<double>& dGaussianSigmas);
+               vector<double>& logSigmas, vector<double>& dGaussianSigmas,
+               int depth = CV_32F);
     ~FilterBank();
 
     /*
-     * Get the filter response of image.
-     * response is a numPixels * (numFilters*3) matrix.
+     * Get the filter response of image (BGR, left unchanged).
+     * response is a numPixels * (numFilters*3) matrix of type depth.
+     *
+     * The filtering methods are const and only touch their arguments, so
+     * one filterbank can be shared by many threads.
+     *
+     * Intermediates (Lab image, per-kernel outputs, spectra) come from
+     * workspace, or from a pooled one if NULL (see workspace.hpp).
+     * response is only reallocated when its size changes; a workspace
+     * buffer of the right size (WS_RESPONSE) makes the whole call free of
+     * allocations.
      */
-    void filter(Mat& image, Mat& response);
+    void filter(const Mat& image, Mat& response,
+                Workspace* workspace = NULL) const;
+
+    /*
+     * Streaming interface: converts a BGR image to Lab once, then computes
+     * the responses of rows [rowStart, rowEnd) only. Each call filters
+     * getHalo() extra rows above and below the strip, which is the
+     * largest kernel half-size.
+     */
+    void toLab(const Mat& image, Mat& lab) const;
+    void filterRows(const Mat& lab, int rowStart, int rowEnd,
+                    Mat& response, Workspace* workspace = NULL) const;
+    int getHalo() const;
+
+    /*
+     * Responses at the given pixels only (row-major indices into lab),
+     * by direct dot products of each kernel with the surrounding patch.
+     * Row i of response equals row pixels[i] of filter().
+     */
+    void filterAt(const Mat& lab, const vector<int>& pixels,
+                  Mat& response) const;
+
+    int getDepth() const;
+    int getNumFilters() const;
+    const ConvolutionEngine& getEngine() const;
+
+    /*
+     * Reduced-cost responses for inference, used by Dictionary::getWordmap
+     * whenever isReduced():
+     *
+     *   - the image is first scaled down (INTER_AREA) so that its longer
+     *     side is at most maxSide;
+     *   - with pyramidLevels = n, a filter of sigma s runs on the level
+     *     l = min(n, floor(log2(s / 2))) of a pyramid of halvings, as the
+     *     same filter of sigma s / 2^l, so the large kernels shrink 4^l
+     *     times in area and the image as much; its response is scaled
+     *     back to native units and interpolated at the grid points;
+     *   - responses are only produced every stride pixels.
+     *
+     * Not thread-safe: call during setup, before sharing the filterbank.
+     */
+    void setResolution(const ResolutionParams& params);
+    const ResolutionParams& getResolution() const;
+    bool isReduced() const;
+
+    /*
+     * Responses of image (BGR) on the reduced grid described above, one
+     * row per grid point in row-major order; grid receives its size.
+     */
+    void filterReduced(const Mat& image, Mat& response, Size& grid) const;
+
+    /*
+     * Returns the parameters the filterbank was built with.
+     */
+    void getParams(vector<double>& scales, vector<double>& gaussianSigmas,
+                   vector<double>& logSigmas,
+                   vector<double>& dGaussianSigmas) const;
 };
 
 class Dictionary
 {
 private:
     Mat dictionary;
+    Mat centerNorms; // ||c||^2 of every word, see nearest.hpp
+    TransposedCenters transposed; // SoA layout for the per-pixel kernel
+    bool exactAssignment;
+    int stripRows;
+    bool sparseSampling;
+    KMeansParams kmeansParams;
+    PipelineParams pipelineParams;
+    VocabularyTree tree; // empty unless the dictionary is hierarchical
+    int treeBranching;
+    int treeLevels;
+    double distortion; // mean squared distance of the training samples
+                       // to their words, 0 if unknown
     vector<Mat> vec_allFilterResponses;
 
 public:
@@ -51,26 +181,147 @@ public:
                 vector<string>& trainingImagesPath, string& imagesDir);
 
     /*
-     * Saves the dictionary to a local file.
+     * The two halves of create(), for sharded training (see shard.hpp).
+     * sampleImages stacks the responses at alpha random pixels of every
+     * image, drawn as create() would for images firstIndex,
+     * firstIndex+1, ... of its list. cluster builds the words (flat or
+     * tree) from such samples.
+     */
+    void sampleImages(int alpha, const FilterBank& filterbank,
+                      vector<string>& imagesPath, string& imagesDir,
+                      int firstIndex, Mat& samples) const;
+    void cluster(int K, const Mat& samples);
+
+    /*
+     * Flat mini-batch clustering of samples that are read as needed
+     * (e.g. PartialSamples, shard.hpp); depth is that of the filterbank.
+     * The distortion baseline is measured on a random subsample. Returns
+     * false, with a message, on a vocabulary tree, without mini-batch
+     * parameters or if the samples cannot be read.
+     */
+    bool cluster(int K, SampleSource& samples, int depth);
+
+    /*
+     * Sampling mode of create(). By default full-image responses are
+     * computed and sampled; when sparse, the alpha pixels of each image
+     * are drawn first and the filterbank is evaluated at those pixels
+     * only. The two modes draw different samples, hence different
+     * dictionaries.
+     */
+    void setSparseSampling(bool sparse);
+    bool getSparseSampling() const;
+
+    /*
+     * Clustering parameters of create() (see kmeans.hpp). A fixed seed
+     * also fixes the pixel sampling, giving a reproducible dictionary.
+     */
+    void setKMeansParams(const KMeansParams& params);
+
+    /*
+     * Threads of the read/filter stages create() runs the training images
+     * through (see pipeline.hpp).
+     */
+    void setPipelineParams(const PipelineParams& params);
+
+    /*
+     * When branching > 0, create() builds a vocabulary tree of that
+     * branching factor and depth (see vocabtree.hpp) instead of a flat
+     * k-means dictionary, and its K argument is ignored: the leaves are
+     * the words. getWordmap then assigns pixels by descending the tree.
+     */
+    void setVocabularyTree(int branching, int levels);
+
+    /*
+     * Uses a stored tree, whose leaves must be the current words.
+     */
+    void setTree(const VocabularyTree& tree);
+    const VocabularyTree& getTree() const;
+
+    /*
+     * Uses words (K x numFilters*3) as the dictionary. If norms holds the
+     * precomputed ||c||^2 and words already has the requested depth, the
+     * matrices are shared rather than copied (e.g. a memory-mapped model).
+     * Drops any vocabulary tree.
+     */
+    void setWords(const Mat& words, const Mat& norms, int depth = CV_32F);
+
+    /*
+     * The dictionary matrix and its centroid norms.
+     */
+    const Mat& getWords() const;
+    const Mat& getCenterNorms() const;
+
+    /*
+     * Saves the dictionary to a local file, with the vocabulary tree if
+     * there is one.
      */
     void save(const string& path);
 
     /*
-     * Loads a dictionary stored in a local file.
+     * Loads a dictionary stored in a local file and converts it to depth,
+     * which must match the depth of the filterbank used with it. Returns
+     * false, leaving the dictionary empty, if the file is missing or holds
+     * words of another RESPONSE_VERSION.
+     */
+    bool load(const string& path, int depth = CV_32F);
+
+    /*
+     * Responses at alpha random pixels of image, as create() samples
+     * them (one pixel per row).
+     */
+    void sampleResponses(const Mat& image, const FilterBank& filterbank,
+                         int alpha, RNG& rng, Mat& samples) const;
+
+    /*
+     * Mean squared distance of samples to their nearest words. create()
+     * records it for its own samples (getDistortion, saved with the
+     * dictionary); a clearly larger value on new images means the words
+     * no longer fit the data and the dictionary is worth rebuilding.
      */
-    void load(const string& path);
+    double measureDistortion(const Mat& samples) const;
+    double getDistortion() const;
 
     /*
      * Returns the number of visual words contained in dictionary.
      */
-    int getWordsNum();
+    int getWordsNum() const;
 
-    Mat getWordmap(const Mat& image, FilterBank& filterbank);
+    /*
+     * Selects how pixels are assigned to words: the batched GEMM
+     * expansion (default), or the per-pixel SIMD kernel, which returns
+     * exactly the labels of a plain scalar distance loop. A vocabulary
+     * tree, if present, takes precedence over both.
+     */
+    void setExactAssignment(bool exact);
+
+    /*
+     * When rows > 0, getWordmap processes the image in horizontal strips
+     * of that many rows: each strip is filtered and assigned before the
+     * next one, so peak memory follows the strip size instead of the
+     * image size. Every strip also filters 2*getHalo() extra rows, so
+     * small strips cost more filtering; 0 (default) disables streaming.
+     */
+    void setStripRows(int rows);
+
+    /*
+     * Word of every pixel of image (BGR, left unchanged), CV_32S. Safe to
+     * call from many threads on one dictionary once it is set up.
+     * If the filterbank is set to reduced resolution, the word map covers
+     * its grid instead (FilterBank::filterReduced) and strips are not
+     * used; histograms of it are normalized all the same.
+     * Intermediates come from workspace, or a pooled one if NULL.
+     */
+    Mat getWordmap(const Mat& image, const FilterBank& filterbank,
+                   Workspace* workspace = NULL) const;
 
 private:
-    void randAlpha(vector<int> &randomIndex, int N, int alpha);
+    void randAlpha(RNG& rng, vector<int> &randomIndex, int N,
+                   int alpha) const;
     void dbg_initialize(vector<Mat>& vec_allFilterResponses);
-    int nearestWord(Mat& oneResponse); 
+    void assignWords(const Mat& Response, int* labels) const;
+    void assignRows(const Mat& Response, int* labels) const;
+    template <typename T>
+    int nearestWord(const T* oneResponse) const;
 
 };
 
@@ -0,0 +1,64 @@
+#include "bow.hpp"
+#include "histogram.hpp"
+#include "model.hpp"
+
+#include <iostream>
+#include <fstream>
+
+
+/* Declaration of functions */
+void help();
+
+/*
+ * Converts the XML artifacts written by train (dictionary, histograms and
+ * training labels) into a single binary model file for evaluate --model.
+ */
+int main(int argc, char **argv)
+{
+    if (argc != 2)
+    {
+        help();
+        return -1;
+    }
+
+    // The parameter must be the same as what was used in training phase.
+    FilterBank filterbank;
+
+    Dictionary dict;
+    dict.load("dictionary/dictionary.xml", filterbank.getDepth());
+
+    Mat histograms;
+    readHistogramFile("histograms.xml", histograms);
+
+    vector<int> trainingLabels;
+    string labelsPath = histogramLabelsPath();
+    ifstream in(labelsPath.c_str());
+    int label;
+    while (in >> label)
+        trainingLabels.push_back(label);
+
+    if (dict.getWordsNum() == 0 || histograms.empty()
+        || (int)trainingLabels.size() != histograms.rows)
+    {
+        cout << "Error: dictionary/dictionary.xml, histograms.xml and ";
+        cout << labelsPath << " are missing or inconsistent.\n";
+        return -1;
+    }
+
+    if (!Model::save(argv[1], filterbank, dict, histograms, trainingLabels))
+    {
+        cout << "Error writing " << argv[1] << endl;
+        return -1;
+    }
+    cout << "Wrote " << histograms.rows << " histograms and "
+         << dict.getWordsNum() << " words to " << argv[1] << endl;
+    return 0;
+}
+
+void help()
+{
+    cout << "Usage: ./bundle <model_file>\n";
+    cout << "\tPacks dictionary/dictionary.xml, histograms.xml and ";
+    cout << HISTOGRAM_LABELS << " (training_label.txt for older ";
+    cout << "histograms) into <model_file>.\n";
+}
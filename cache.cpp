@@ -0,0 +1,250 @@
+#include "cache.hpp"
+#include "wordmap.hpp"
+#include "profile.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <ctime>
+#include <vector>
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+
+// Changes whenever the stored form of an entry does.
+static const uint64 CACHE_FORMAT = 1;
+// Age after which a temporary file of put() is taken as left by an
+// interrupted writer: other processes sharing the directory may still be
+// writing younger ones.
+static const time_t STALE_TMP_SECONDS = 3600;
+
+uint64 hashBytes(const void* data, size_t n, uint64 seed)
+{
+    const unsigned char* p = (const unsigned char*)data;
+    uint64 h = seed;
+    for (size_t i = 0; i < n; i++)
+    {
+        h ^= p[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static uint64 hashMat(const cv::Mat& m, uint64 h)
+{
+    int dims[3] = {m.rows, m.cols, m.type()};
+    h = hashBytes(dims, sizeof(dims), h);
+    for (int i = 0; i < m.rows; i++)
+        h = hashBytes(m.ptr(i), m.cols * m.elemSize(), h);
+    return h;
+}
+
+static uint64 hashVector(const std::vector<double>& v, uint64 h)
+{
+    size_t n = v.size();
+    h = hashBytes(&n, sizeof(n), h);
+    return v.empty() ? h : hashBytes(&v[0], n * sizeof(double), h);
+}
+
+FeatureCache::FeatureCache()
+    : maxBytes(0), totalBytes(0), context(0), hits(0), misses(0),
+      writes(0)
+{
+}
+
+bool FeatureCache::open(const std::string& dir, size_t maxBytes)
+{
+    DIR* d = opendir(dir.c_str());
+    if (d == NULL)
+        return false;
+
+    this->dir = dir;
+    if (this->dir.empty() || this->dir[this->dir.size() - 1] != '/')
+        this->dir += '/';
+    this->maxBytes = maxBytes;
+
+    // Existing entries, most recently used first.
+    std::vector<std::pair<time_t, Entry> > found;
+    time_t now = time(NULL);
+    struct dirent* e;
+    while ((e = readdir(d)) != NULL)
+    {
+        std::string name = e->d_name;
+        std::string path = this->dir + name;
+        struct stat st;
+        if (name.find(".tmp") != std::string::npos)
+        {
+            if (stat(path.c_str(), &st) == 0
+                && now - st.st_mtime > STALE_TMP_SECONDS)
+                remove(path.c_str()); // left by an interrupted put()
+            continue;
+        }
+        if (name.size() < 5 || name.compare(name.size() - 5, 5, ".wmap") != 0
+            || stat(path.c_str(), &st) != 0)
+            continue;
+        Entry entry = {name, (size_t)st.st_size};
+        found.push_back(std::make_pair(st.st_mtime, entry));
+    }
+    closedir(d);
+    std::sort(found.begin(), found.end(),
+              [](const std::pair<time_t, Entry>& a,
+                 const std::pair<time_t, Entry>& b) {
+                  return a.first > b.first;
+              });
+
+    std::lock_guard<std::mutex> guard(lock);
+    entries.clear();
+    index.clear();
+    totalBytes = 0;
+    for (size_t i = 0; i < found.size(); i++)
+    {
+        entries.push_back(found[i].second);
+        index[found[i].second.name] = --entries.end();
+        totalBytes += found[i].second.bytes;
+    }
+    evict();
+    return true;
+}
+
+bool FeatureCache::isOpen() const
+{
+    return !dir.empty();
+}
+
+uint64 featureContext(const FilterBank& filterbank,
+                      const Dictionary& dictionary)
+{
+    uint64 h = hashBytes(&CACHE_FORMAT, sizeof(CACHE_FORMAT));
+
+    std::vector<double> params[4];
+    filterbank.getParams(params[0], params[1], params[2], params[3]);
+    for (int i = 0; i < 4; i++)
+        h = hashVector(params[i], h);
+    int depth = filterbank.getDepth();
+    h = hashBytes(&depth, sizeof(depth), h);
+    if (filterbank.isReduced())
+    {
+        // Native word maps keep their entries from before reduced modes.
+        const ResolutionParams& r = filterbank.getResolution();
+        int reduced[3] = {r.maxSide, r.pyramidLevels, r.stride};
+        h = hashBytes(reduced, sizeof(reduced), h);
+    }
+
+    h = hashMat(dictionary.getWords(), h);
+    h = hashMat(dictionary.getTree().getCenters(), h);
+    h = hashMat(dictionary.getTree().getNodes(), h);
+    return h;
+}
+
+void FeatureCache::setContext(const FilterBank& filterbank,
+                              const Dictionary& dictionary)
+{
+    context = featureContext(filterbank, dictionary);
+}
+
+std::string FeatureCache::entryName(uint64 contentHash) const
+{
+    char name[64];
+    snprintf(name, sizeof(name), "%016llx-%016llx.wmap",
+             (unsigned long long)context, (unsigned long long)contentHash);
+    return name;
+}
+
+bool FeatureCache::get(uint64 contentHash, cv::Mat& wordmap, int numWords)
+{
+    ProfileTimer timer(PROFILE_CACHE_GET);
+    std::string name = entryName(contentHash);
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        std::unordered_map<std::string, std::list<Entry>::iterator>::iterator
+            it = index.find(name);
+        if (it == index.end())
+        {
+            misses++;
+            return false;
+        }
+        entries.splice(entries.begin(), entries, it->second);
+    }
+
+    std::string path = dir + name;
+    if (!loadWordmap(path, wordmap, numWords))
+    {
+        // Deleted or damaged behind our back: never read it again.
+        wordmap.release();
+        remove(path.c_str());
+        std::lock_guard<std::mutex> guard(lock);
+        std::unordered_map<std::string, std::list<Entry>::iterator>::iterator
+            it = index.find(name);
+        if (it != index.end())
+        {
+            totalBytes -= it->second->bytes;
+            entries.erase(it->second);
+            index.erase(it);
+        }
+        misses++;
+        return false;
+    }
+    utime(path.c_str(), NULL); // recency for the next run
+
+    timer.setWork(1);
+    std::lock_guard<std::mutex> guard(lock);
+    hits++;
+    return true;
+}
+
+void FeatureCache::put(uint64 contentHash, const cv::Mat& wordmap,
+                       int numWords)
+{
+    ProfileTimer timer(PROFILE_CACHE_PUT);
+    std::string name = entryName(contentHash);
+    std::string path = dir + name;
+    std::string tmp;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        // Unique across the processes sharing the directory too.
+        tmp = path + ".tmp" + std::to_string((long)getpid()) + "-"
+              + std::to_string(writes++);
+    }
+
+    struct stat st;
+    if (!saveWordmap(tmp, wordmap, numWords, true)
+        || stat(tmp.c_str(), &st) != 0
+        || rename(tmp.c_str(), path.c_str()) != 0)
+    {
+        remove(tmp.c_str());
+        return;
+    }
+    timer.setWork((double)st.st_size);
+
+    std::lock_guard<std::mutex> guard(lock);
+    std::unordered_map<std::string, std::list<Entry>::iterator>::iterator
+        it = index.find(name);
+    if (it != index.end())
+    {
+        // Another thread stored the same image.
+        totalBytes -= it->second->bytes;
+        entries.erase(it->second);
+        index.erase(it);
+    }
+    Entry entry = {name, (size_t)st.st_size};
+    entries.push_front(entry);
+    index[name] = entries.begin();
+    totalBytes += entry.bytes;
+    evict();
+}
+
+/*
+ * Deletes least recently used entries until the cache fits its limit.
+ * Called with the lock held.
+ */
+void FeatureCache::evict()
+{
+    while (totalBytes > maxBytes && !entries.empty())
+    {
+        const Entry& victim = entries.back();
+        remove((dir + victim.name).c_str());
+        totalBytes -= victim.bytes;
+        index.erase(victim.name);
+        entries.pop_back();
+    }
+}
@@ -0,0 +1,94 @@
+#ifndef CACHE_H_
+#define CACHE_H_
+
+#include <opencv2/opencv.hpp>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "bow.hpp"
+
+/*
+ * 64-bit FNV-1a hash of n bytes, continuing from seed.
+ */
+uint64 hashBytes(const void* data, size_t n,
+                 uint64 seed = 14695981039346656037ULL);
+
+/*
+ * Hash of everything a word map depends on: filterbank parameters,
+ * precision and resolution, dictionary words and vocabulary tree.
+ */
+uint64 featureContext(const FilterBank& filterbank,
+                      const Dictionary& dictionary);
+
+/*
+ * On-disk cache of word maps, content addressed: an entry is keyed by the
+ * hash of the encoded image file and by the featureContext of the
+ * filterbank and dictionary. Retraining with the same dictionary only
+ * computes the word maps of new or changed images; a new dictionary
+ * simply misses, and its stale entries age out.
+ *
+ * Entries are .wmap files (run-length encoded, see wordmap.hpp) named
+ * <context>-<content>.wmap in one directory. The total size is bounded:
+ * once it exceeds the limit, the least recently used entries are deleted.
+ * Recency survives restarts through the file modification times, which
+ * hits refresh.
+ *
+ * get() and put() may be called from many threads; a put() writes a
+ * temporary file and renames it, so readers never see partial entries.
+ */
+class FeatureCache
+{
+private:
+    struct Entry
+    {
+        std::string name;
+        size_t bytes;
+    };
+
+    std::string dir;
+    size_t maxBytes;
+    size_t totalBytes;
+    uint64 context;
+    std::mutex lock;
+    // Most recently used first; index maps names into it.
+    std::list<Entry> entries;
+    std::unordered_map<std::string, std::list<Entry>::iterator> index;
+    size_t hits;
+    size_t misses;
+    size_t writes; // names the temporary files of put()
+
+    std::string entryName(uint64 contentHash) const;
+    void evict();
+
+public:
+    FeatureCache();
+
+    /*
+     * Uses dir (which must exist) as the cache, holding at most maxBytes.
+     * Returns false if the directory cannot be read.
+     */
+    bool open(const std::string& dir, size_t maxBytes);
+    bool isOpen() const;
+
+    /*
+     * Selects the entries valid for this filterbank and dictionary. Must
+     * be called before get/put, and again whenever either changes.
+     */
+    void setContext(const FilterBank& filterbank, const Dictionary& dictionary);
+
+    /*
+     * Word map of the image whose file hashes to contentHash, with labels
+     * in [0, numWords). Returns false on a miss; an entry that cannot be
+     * read or holds other labels is deleted and counts as one.
+     */
+    bool get(uint64 contentHash, cv::Mat& wordmap, int numWords);
+    void put(uint64 contentHash, const cv::Mat& wordmap, int numWords);
+
+    size_t getHits() const { return hits; }
+    size_t getMisses() const { return misses; }
+    size_t getBytes() const { return totalBytes; }
+};
+
+#endif
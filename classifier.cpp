@@ -0,0 +1,223 @@
+#include "classifier.hpp"
+#include "histogram.hpp"
+#include <fstream>
+
+CascadeResult classifyCascade(const cv::Mat& image, const FilterBank& coarse,
+                              const FilterBank& fine, const Dictionary& dict,
+                              const KnnClassifier& knn, int k,
+                              double minMargin, std::vector<int>* votes)
+{
+    CascadeResult result;
+    std::vector<int> v;
+    cv::Mat wordmap = dict.getWordmap(image, coarse);
+    cv::Mat h;
+    computeHistogram(wordmap, h, dict.getWordsNum());
+    result.coarseLabel = knn.classify(h, k, &v);
+    result.margin = voteMargin(v);
+    if (result.margin >= minMargin)
+    {
+        result.label = result.coarseLabel;
+        result.stage = 0;
+    }
+    else
+    {
+        wordmap = dict.getWordmap(image, fine);
+        computeHistogram(wordmap, h, dict.getWordsNum());
+        result.label = knn.classify(h, k, &v);
+        result.stage = 1;
+    }
+    if (votes)
+        votes->swap(v);
+    return result;
+}
+
+BowClassifier::BowClassifier()
+    : k(5), stripRows(0), cascade(false)
+{
+}
+
+/*
+ * Replaces the model by one built and checked aside. The previous
+ * mapping, if any, must only be closed after this: knn may point into it.
+ */
+void BowClassifier::install(const FilterBank& newFilterbank,
+                            const Dictionary& newDictionary,
+                            const KnnClassifier& newKnn)
+{
+    filterbank = newFilterbank;
+    dictionary = newDictionary;
+    dictionary.setStripRows(stripRows);
+    knn = newKnn;
+    rebuildCoarse();
+}
+
+/*
+ * The first stage of the cascade: the current filters, at the coarse
+ * resolution.
+ */
+void BowClassifier::rebuildCoarse()
+{
+    if (!cascade)
+        return;
+    coarse = filterbank;
+    coarse.setResolution(cascadeParams.coarse);
+}
+
+bool BowClassifier::loadModel(const std::string& path)
+{
+    Model opened;
+    if (!opened.open(path))
+        return false;
+    FilterBank newFilterbank = opened.getFilterBank();
+    Dictionary newDictionary;
+    opened.loadDictionary(newDictionary, newFilterbank.getDepth());
+    std::vector<int> labels;
+    opened.getLabels(labels);
+    KnnClassifier newKnn;
+    if (!newKnn.setTrainingSet(opened.getHistograms(), labels))
+        return false;
+
+    install(newFilterbank, newDictionary, newKnn);
+    model.swap(opened); // the previous mapping is closed with opened
+    return true;
+}
+
+bool BowClassifier::load(const std::string& dictionaryPath,
+                         const std::string& histogramsPath,
+                         const std::string& labelsPath)
+{
+    // Built aside: on error the current model, and the mapping its kNN
+    // training set may point into, stay untouched.
+    FilterBank newFilterbank;
+    Dictionary newDictionary;
+    if (!newDictionary.load(dictionaryPath, newFilterbank.getDepth()))
+        return false;
+
+    cv::Mat histograms;
+    if (!readHistogramFile(histogramsPath, histograms))
+        return false;
+
+    std::vector<int> labels;
+    std::ifstream in(labelsPath.c_str());
+    int label;
+    while (in >> label)
+        labels.push_back(label);
+
+    if (newDictionary.getWordsNum() == 0 || histograms.empty()
+        || histograms.rows != (int)labels.size()
+        || histograms.cols != newDictionary.getWordsNum())
+        return false;
+    KnnClassifier newKnn;
+    if (!newKnn.setTrainingSet(histograms, labels))
+        return false;
+
+    install(newFilterbank, newDictionary, newKnn);
+    Model none;
+    model.swap(none); // closes the previous mapping, if any
+    return true;
+}
+
+void BowClassifier::setK(int k)
+{
+    this->k = k;
+}
+
+bool BowClassifier::buildIndex(const KnnIndexParams& params)
+{
+    return knn.buildIndex(params);
+}
+
+void BowClassifier::setStripRows(int rows)
+{
+    stripRows = rows;
+    dictionary.setStripRows(rows);
+}
+
+void BowClassifier::setResolution(const ResolutionParams& params)
+{
+    filterbank.setResolution(params);
+    rebuildCoarse();
+}
+
+void BowClassifier::setCascade(const CascadeParams& params)
+{
+    cascadeParams = params;
+    cascade = true;
+    rebuildCoarse();
+}
+
+void BowClassifier::disableCascade()
+{
+    cascade = false;
+    coarse = FilterBank();
+}
+
+bool BowClassifier::hasCascade() const
+{
+    return cascade;
+}
+
+const CascadeParams& BowClassifier::getCascade() const
+{
+    return cascadeParams;
+}
+
+int BowClassifier::getNumWords() const
+{
+    return dictionary.getWordsNum();
+}
+
+int BowClassifier::getNumClasses() const
+{
+    return knn.getNumClasses();
+}
+
+const FilterBank& BowClassifier::getFilterBank() const
+{
+    return filterbank;
+}
+
+const Dictionary& BowClassifier::getDictionary() const
+{
+    return dictionary;
+}
+
+const KnnClassifier& BowClassifier::getKnn() const
+{
+    return knn;
+}
+
+void BowClassifier::histogram(const cv::Mat& image, cv::Mat& h,
+                              int stage) const
+{
+    cv::Mat wordmap = dictionary.getWordmap(image, cascade && stage == 0
+                                                   ? coarse : filterbank);
+    computeHistogram(wordmap, h, dictionary.getWordsNum());
+}
+
+int BowClassifier::classify(const cv::Mat& image, std::vector<int>* votes,
+                            int* stage) const
+{
+    if (cascade)
+    {
+        CascadeResult result = classifyCascade(image, coarse, filterbank,
+                                               dictionary, knn, k,
+                                               cascadeParams.minMargin, votes);
+        if (stage)
+            *stage = result.stage;
+        return result.label;
+    }
+    if (stage)
+        *stage = 1;
+    cv::Mat h;
+    histogram(image, h);
+    return knn.classify(h, k, votes);
+}
+
+void BowClassifier::classifyHistograms(const cv::Mat& histograms,
+                                       std::vector<int>& labels,
+                                       std::vector<std::vector<int> >* votes)
+                                       const
+{
+    knn.classifyBatch(histograms, k, labels, votes);
+}
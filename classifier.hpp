@@ -0,0 +1,171 @@
+#ifndef CLASSIFIER_H_
+#define CLASSIFIER_H_
+
+#include <opencv2/opencv.hpp>
+#include <string>
+#include <vector>
+
+#include "bow.hpp"
+#include "knn.hpp"
+#include "model.hpp"
+
+/*
+ * Coarse-to-fine classification: an image is first classified from the
+ * word map of a cheap reduced-resolution filterbank (see
+ * FilterBank::setResolution), and that answer is kept when its kNN vote
+ * is confident enough (voteMargin in knn.hpp). Only the remaining,
+ * ambiguous images pay for the full filterbank.
+ */
+struct CascadeParams
+{
+    ResolutionParams coarse; // first stage
+    double minMargin;        // accept the first stage from this margin on
+
+    CascadeParams() : minMargin(0.6)
+    {
+        coarse.maxSide = 320;
+        coarse.pyramidLevels = 1;
+        coarse.stride = 2;
+    }
+};
+
+/*
+ * Outcome of classifyCascade.
+ */
+struct CascadeResult
+{
+    int label;        // final label
+    int stage;        // 0: accepted from the coarse stage, 1: full stage
+    int coarseLabel;  // answer of the coarse stage
+    double margin;    // its vote margin
+};
+
+/*
+ * Runs the cascade for image: coarse is the first stage's filterbank,
+ * fine the full one (each may have its own resolution), sharing the
+ * dictionary and the kNN training set. votes, if not NULL, receives the
+ * votes of the stage that answered.
+ */
+CascadeResult classifyCascade(const cv::Mat& image, const FilterBank& coarse,
+                              const FilterBank& fine, const Dictionary& dict,
+                              const KnnClassifier& knn, int k,
+                              double minMargin,
+                              std::vector<int>* votes = NULL);
+
+/*
+ * Library entry point: a trained bag-of-words model (filterbank,
+ * dictionary and kNN training set) that classifies BGR images.
+ *
+ * Loading and the set* methods are not thread-safe and belong to setup.
+ * After that every const method can be called concurrently from any
+ * number of threads on one shared instance; none of them modifies its
+ * inputs.
+ *
+ * Built into libbow.a together with the rest of the pipeline; link with
+ * OpenCV and -fopenmp.
+ */
+class BowClassifier
+{
+private:
+    Model model; // mapping of a binary model, if loaded from one
+    FilterBank filterbank;
+    Dictionary dictionary;
+    KnnClassifier knn;
+    int k;
+    int stripRows;
+    bool cascade;              // classify through the cascade
+    CascadeParams cascadeParams;
+    FilterBank coarse;         // its first stage, rebuilt from filterbank
+                               // whenever that changes
+
+    void rebuildCoarse();
+
+    BowClassifier(const BowClassifier&); // not copyable: may own a mapping
+    BowClassifier& operator=(const BowClassifier&);
+
+    void install(const FilterBank& newFilterbank,
+                 const Dictionary& newDictionary,
+                 const KnnClassifier& newKnn);
+
+public:
+    BowClassifier();
+
+    /*
+     * Loads a binary model written by ./bundle. Returns false on error,
+     * leaving the current model in place.
+     */
+    bool loadModel(const std::string& path);
+
+    /*
+     * Loads the files written by ./train: the dictionary, the training
+     * histograms and one label per histogram. Returns false on error,
+     * leaving the current model in place.
+     */
+    bool load(const std::string& dictionaryPath,
+              const std::string& histogramsPath,
+              const std::string& labelsPath);
+
+    /*
+     * Neighbours voting in classify (default 5), and the inverted index
+     * of the kNN search (see knn.hpp).
+     */
+    void setK(int k);
+    bool buildIndex(const KnnIndexParams& params = KnnIndexParams());
+
+    /*
+     * Word-map streaming, see Dictionary::setStripRows.
+     */
+    void setStripRows(int rows);
+
+    /*
+     * Reduced-cost inference on large images (resolution cap, pyramid,
+     * strided grid), see FilterBank::setResolution. Call it after
+     * loading the model.
+     */
+    void setResolution(const ResolutionParams& params);
+
+    /*
+     * Makes classify() go through the coarse-to-fine cascade (see
+     * CascadeParams), or back to the full filterbank only. The setting
+     * carries over to models loaded later.
+     */
+    void setCascade(const CascadeParams& params);
+    void disableCascade();
+    bool hasCascade() const;
+    const CascadeParams& getCascade() const;
+
+    int getNumWords() const;
+    int getNumClasses() const;
+    const FilterBank& getFilterBank() const;
+    const Dictionary& getDictionary() const;
+    const KnnClassifier& getKnn() const;
+
+    /*
+     * Normalized word histogram of image, 1 x getNumWords(), CV_64F, from
+     * the full filterbank (stage 1) or from the first stage of the
+     * cascade (stage 0, the full filterbank without a cascade). Batched
+     * callers run the cascade themselves: classifyHistograms on the stage
+     * 0 histograms, then stage 1 for the rows whose voteMargin is below
+     * getCascade().minMargin.
+     */
+    void histogram(const cv::Mat& image, cv::Mat& h, int stage = 1) const;
+
+    /*
+     * Label of image, within [1, getNumClasses()]. votes, if not NULL,
+     * receives the votes of every label (index 0 unused). stage, if not
+     * NULL, receives the cascade stage that answered (always 1 without
+     * a cascade).
+     */
+    int classify(const cv::Mat& image, std::vector<int>* votes = NULL,
+                 int* stage = NULL) const;
+
+    /*
+     * Labels of histograms (one per row), scored in one batched pass.
+     */
+    void classifyHistograms(const cv::Mat& histograms,
+                            std::vector<int>& labels,
+                            std::vector<std::vector<int> >* votes = NULL)
+                            const;
+};
+
+#endif
@@ -0,0 +1,238 @@
+#include "convolution.hpp"
+#include "profile.hpp"
+#include "scheduler.hpp"
+#include "workspace.hpp"
+#include <algorithm>
+#include <cmath>
+
+ConvolutionEngine::ConvolutionEngine(int depth, double tol, int fftMinSize)
+    : depth(depth), tol(tol), fftMinSize(fftMinSize), fftHalo(0)
+{
+    CV_Assert(depth == CV_32F || depth == CV_64F);
+}
+
+/*
+ * Decomposes kernel into separable terms and decides how it is applied.
+ */
+void ConvolutionEngine::addKernel(const cv::Mat& kernel)
+{
+    SeparableKernel k;
+    kernel.convertTo(k.kernel, CV_64F);
+
+    // kernel = U * diag(w) * Vt, singular values in descending order.
+    cv::SVD svd(k.kernel);
+    double energy = 0;
+    for (int i = 0; i < svd.w.rows; i++)
+        energy += svd.w.at<double>(i) * svd.w.at<double>(i);
+
+    // Keeps terms until the residual energy falls below the tolerance.
+    double residual = energy;
+    double allowed = tol * tol * energy;
+    for (int i = 0; i < svd.w.rows && residual > allowed; i++)
+    {
+        double s = svd.w.at<double>(i);
+        double r = std::sqrt(s);
+        cv::Mat kx, ky;
+        cv::Mat(svd.u.col(i) * r).convertTo(ky, depth);
+        cv::Mat(svd.vt.row(i) * r).convertTo(kx, depth);
+        k.ky.push_back(ky);
+        k.kx.push_back(kx);
+        residual -= s * s;
+    }
+
+    // Large kernels go through the FFT. So do kernels whose separable form
+    // is not cheaper than the dense one.
+    int rows = k.kernel.rows;
+    int cols = k.kernel.cols;
+    k.useFFT = std::max(rows, cols) >= fftMinSize
+               || k.rank() * (rows + cols) >= rows * cols;
+    if (k.useFFT)
+        fftHalo = std::max(fftHalo, std::max(rows, cols) / 2);
+
+    kernels.push_back(k);
+}
+
+int ConvolutionEngine::size() const
+{
+    return (int)kernels.size();
+}
+
+int ConvolutionEngine::getHalo() const
+{
+    int halo = 0;
+    for (const SeparableKernel& k : kernels)
+        halo = std::max(halo, std::max(k.kernel.rows, k.kernel.cols) / 2);
+    return halo;
+}
+
+int ConvolutionEngine::getDepth() const
+{
+    return depth;
+}
+
+const SeparableKernel& ConvolutionEngine::getKernel(int i) const
+{
+    return kernels[i];
+}
+
+/*
+ * Filters src with every kernel. dst[i] is the response to kernel i.
+ */
+void ConvolutionEngine::apply(const cv::Mat& src, std::vector<cv::Mat>& dst,
+                              Workspace* workspace) const
+{
+    CV_Assert(src.depth() == depth);
+    dst.resize(kernels.size());
+    for (size_t i = 0; i < kernels.size(); i++)
+    {
+        if (workspace)
+            dst[i] = workspace->buffer(WS_KERNEL_OUTPUT, (int)i, src.rows,
+                                       src.cols, src.type());
+        else
+            dst[i].create(src.size(), src.type());
+    }
+
+    // Spectra of the padded image planes, shared by all FFT kernels.
+    WorkspaceLease ws(workspace);
+    int channels = src.channels();
+    std::vector<cv::Mat> spectra(channels);
+    cv::Size dftSize;
+    if (fftHalo > 0)
+    {
+        ProfileTimer timer(PROFILE_SPECTRA, (double)src.total());
+        cv::Mat padded = ws->buffer(WS_PADDED, src.rows + 2*fftHalo,
+                                    src.cols + 2*fftHalo, src.type());
+        cv::copyMakeBorder(src, padded, fftHalo, fftHalo, fftHalo, fftHalo,
+                           cv::BORDER_REFLECT_101);
+        dftSize = cv::Size(cv::getOptimalDFTSize(padded.cols),
+                           cv::getOptimalDFTSize(padded.rows));
+
+        parallelFor(0, channels, 1, [&](int c0, int c1) {
+            for (int c = c0; c < c1; c++)
+            {
+                cv::Mat plane = ws->buffer(WS_DFT_PLANE, c, dftSize.height,
+                                           dftSize.width, depth);
+                plane.setTo(0);
+                cv::Mat roi = plane(cv::Rect(0, 0, padded.cols, padded.rows));
+                cv::extractChannel(padded, roi, c);
+                spectra[c] = ws->buffer(WS_SPECTRUM, c, dftSize.height,
+                                        dftSize.width, depth);
+                cv::dft(plane, spectra[c], 0, padded.rows);
+            }
+        });
+    }
+
+    // One task per kernel: they only share the read-only spectra.
+    parallelFor(0, (int)kernels.size(), 1, [&](int i0, int i1) {
+        for (int i = i0; i < i1; i++)
+        {
+            ProfileTimer timer(PROFILE_KERNEL, (double)src.total(), i);
+            if (kernels[i].useFFT)
+                applyFFT(spectra, dftSize, src.size(), kernels[i], dst[i]);
+            else
+                applySeparable(kernels[i], src, dst[i]);
+        }
+    });
+}
+
+/*
+ * Sum of row/column passes, one per separable term.
+ */
+void ConvolutionEngine::applySeparable(const SeparableKernel& k,
+                                       const cv::Mat& src,
+                                       cv::Mat& dst) const
+{
+    cv::Mat term = threadWorkspace().buffer(WS_SEPARABLE_TERM, src.rows,
+                                            src.cols, src.type());
+    for (int i = 0; i < k.rank(); i++)
+    {
+        if (i == 0)
+        {
+            cv::sepFilter2D(src, dst, -1, k.kx[i], k.ky[i]);
+        }
+        else
+        {
+            cv::sepFilter2D(src, term, -1, k.kx[i], k.ky[i]);
+            dst += term;
+        }
+    }
+}
+
+/*
+ * Correlation in the frequency domain. imageSpectra hold the DFT of every
+ * channel of the image padded by fftHalo on each side.
+ */
+void ConvolutionEngine::applyFFT(const std::vector<cv::Mat>& imageSpectra,
+                                 const cv::Size& dftSize,
+                                 const cv::Size& imageSize,
+                                 const SeparableKernel& k,
+                                 cv::Mat& dst) const
+{
+    // Kernel tasks never fork, so their temporaries can come from the
+    // thread's workspace.
+    Workspace& scratch = threadWorkspace();
+    cv::Mat kplane = scratch.buffer(WS_DFT_PLANE, dftSize.height,
+                                    dftSize.width, depth);
+    kplane.setTo(0);
+    cv::Mat kroi = kplane(cv::Rect(0, 0, k.kernel.cols, k.kernel.rows));
+    k.kernel.convertTo(kroi, depth);
+    cv::Mat kspec = scratch.buffer(WS_SPECTRUM, dftSize.height,
+                                   dftSize.width, depth);
+    cv::dft(kplane, kspec, 0, k.kernel.rows);
+
+    // Output pixel (y,x) reads the padded image from
+    // (y + fftHalo - anchor.y, x + fftHalo - anchor.x) onwards.
+    cv::Rect roi(fftHalo - k.kernel.cols / 2, fftHalo - k.kernel.rows / 2,
+                 imageSize.width, imageSize.height);
+
+    cv::Mat prod = scratch.buffer(WS_DFT_PRODUCT, 0, dftSize.height,
+                                  dftSize.width, depth);
+    cv::Mat corr = scratch.buffer(WS_DFT_PRODUCT, 1, dftSize.height,
+                                  dftSize.width, depth);
+    dst.create(imageSize, CV_MAKETYPE(depth, (int)imageSpectra.size()));
+    for (size_t c = 0; c < imageSpectra.size(); c++)
+    {
+        cv::mulSpectrums(imageSpectra[c], kspec, prod, 0, true);
+        cv::dft(prod, corr,
+                cv::DFT_INVERSE | cv::DFT_SCALE | cv::DFT_REAL_OUTPUT,
+                roi.y + roi.height);
+        cv::insertChannel(corr(roi), dst, (int)c);
+    }
+}
+
+double ConvolutionEngine::toleranceRatio(const cv::Mat& src) const
+{
+    // Rounding, relative to the largest possible response
+    // ||kernel||_F * ||patch||_F, and in absolute terms for flat patches.
+    double rounding = depth == CV_64F ? 1e-12 : 1e-5;
+
+    std::vector<cv::Mat> dst;
+    apply(src, dst);
+    cv::Mat squared;
+    src.convertTo(squared, CV_64F);
+    squared = squared.mul(squared);
+
+    double worst = 0;
+    for (size_t i = 0; i < kernels.size(); i++)
+    {
+        const SeparableKernel& k = kernels[i];
+        cv::Mat dense, out, diff, patchNorm, ratio;
+        cv::filter2D(src, dense, CV_64F, k.kernel, cv::Point(-1, -1), 0,
+                     cv::BORDER_REFLECT_101);
+        dst[i].convertTo(out, CV_64F);
+        cv::absdiff(out, dense, diff);
+
+        // ||patch||_F of every pixel and channel, over the kernel support.
+        cv::boxFilter(squared, patchNorm, CV_64F, k.kernel.size(),
+                      cv::Point(-1, -1), false, cv::BORDER_REFLECT_101);
+        cv::sqrt(patchNorm, patchNorm);
+        cv::Mat bound = patchNorm * ((tol + rounding) * cv::norm(k.kernel))
+                        + rounding;
+
+        double maxRatio;
+        cv::divide(diff, bound, ratio);
+        cv::minMaxLoc(ratio.reshape(1), NULL, &maxRatio);
+        worst = std::max(worst, maxRatio);
+    }
+    return worst;
+}
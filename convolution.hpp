@@ -0,0 +1,94 @@
+#ifndef CONVOLUTION_H_
+#define CONVOLUTION_H_
+
+#include <opencv2/opencv.hpp>
+#include <vector>
+
+#include "workspace.hpp"
+
+/*
+ * A filter kernel decomposed into a sum of separable (rank-1) terms:
+ *     kernel ~= sum_i ky[i] * kx[i]^T
+ * The decomposition is obtained by SVD, and terms are dropped as long as
+ * the Frobenius norm of the residual stays below tol * ||kernel||_F.
+ */
+struct SeparableKernel
+{
+    cv::Mat kernel;             // original dense kernel (CV_64F)
+    std::vector<cv::Mat> kx;    // row (horizontal) factors, 1 x cols
+    std::vector<cv::Mat> ky;    // column (vertical) factors, rows x 1
+                                // (factors are stored in the engine depth)
+    bool useFFT;                // convolve in the frequency domain
+
+    int rank() const { return (int)kx.size(); }
+};
+
+/*
+ * Applies a fixed set of 2D kernels to an image, producing the same result
+ * as filter2D(src, dst, -1, kernel) with BORDER_REFLECT_101 for every
+ * kernel.
+ *
+ * Each kernel is decomposed once when it is added. Small kernels are
+ * applied as row/column passes (one pair per separable term), large ones
+ * by FFT correlation, where the spectrum of the padded image is shared by
+ * all large kernels.
+ *
+ * Tolerance: for every output pixel, the difference with the dense
+ * filter2D result is bounded by tol * ||kernel||_F * ||patch||_F (the
+ * dropped SVD terms), plus floating point rounding of the FFT, which is
+ * about 1e-12 (CV_64F) or 1e-5 (CV_32F) relative to the response.
+ */
+class ConvolutionEngine
+{
+private:
+    std::vector<SeparableKernel> kernels;
+    int depth;            // CV_32F or CV_64F
+    double tol;           // relative truncation tolerance of the SVD
+    int fftMinSize;       // kernels at least this large go through the FFT
+    int fftHalo;          // largest half-size among the FFT kernels
+
+    void applySeparable(const SeparableKernel& k, const cv::Mat& src,
+                        cv::Mat& dst) const;
+    void applyFFT(const std::vector<cv::Mat>& imageSpectra,
+                  const cv::Size& dftSize, const cv::Size& imageSize,
+                  const SeparableKernel& k, cv::Mat& dst) const;
+
+public:
+    ConvolutionEngine(int depth = CV_64F, double tol = 1e-6,
+                      int fftMinSize = 64);
+
+    /*
+     * Decomposes kernel and appends it to the engine.
+     */
+    void addKernel(const cv::Mat& kernel);
+
+    /*
+     * Number of kernels and the largest kernel half-size.
+     */
+    int size() const;
+    int getHalo() const;
+    int getDepth() const;
+
+    const SeparableKernel& getKernel(int i) const;
+
+    /*
+     * Filters src (any number of channels, depth equal to the engine
+     * depth) with every kernel. dst[i] has the same size and type as src.
+     * Kernels run as parallel tasks (see parallelFor in scheduler.hpp).
+     *
+     * With a workspace, dst and the intermediates are its buffers (see
+     * workspace.hpp), valid until its next use; without, dst owns its
+     * memory and intermediates come from a pooled workspace.
+     */
+    void apply(const cv::Mat& src, std::vector<cv::Mat>& dst,
+               Workspace* workspace = NULL) const;
+
+    /*
+     * Checks the tolerance above on src against dense filter2D: returns
+     * the largest ratio of the difference to the bound, over every
+     * kernel, pixel and channel. At most 1 when the bound holds.
+     */
+    double toleranceRatio(const cv::Mat& src) const;
+};
+
+#endif
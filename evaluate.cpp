@@ -1,8 +1,20 @@
 #include "bow.hpp"
+#include "classifier.hpp"
 #include "histogram.hpp"
+#include "model.hpp"
+#include "knn.hpp"
+#include "pipeline.hpp"
+#include "cache.hpp"
+#include "profile.hpp"
+#include "scheduler.hpp"
+#include "workspace.hpp"
 
 #include <iostream>
 #include <fstream>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <omp.h>
 
 
 /* Declaration of functions */
@@ -11,76 +23,459 @@ void readTestImagePaths(vector<string>& testImagesPath,
         const char *filename);
 void readRealLabels(vector<int>& readLabels, const char *filename);
 void readTrainingLabels(vector<int>& trainingLabels, const char *filename);
-void readHistograms(Mat& H, const char *filename);
-int knnClassify(Mat& testH, Mat& histograms, vector<int>& trainingLabels,
-        int K);
+bool readHistograms(Mat& H, const char *filename);
+void sweepResolutions(vector<string>& testImagesPath, vector<int>& realLabels,
+        string& imageDir, FilterBank& filterbank, Dictionary& dict,
+        KnnClassifier& knn, const PipelineParams& pipelineParams);
+void reportCascade(const vector<CascadeResult>& stages,
+        const vector<int>& predicted, const vector<int>& realLabels,
+        const CascadeParams& params);
+int checkPrecision(const char *filename);
 
 int main(int argc, char **argv)
 {
-    if (argc != 2)
+    // The task pool owns the cores (see scheduler.hpp).
+    OpenCvThreadsOff openCvThreadsOff;
+
+    if (argc == 3 && string(argv[1]) == "--check-precision")
+        return checkPrecision(argv[2]);
+
+    const char *testSet = NULL;
+    const char *modelPath = NULL;
+    int stripRows = 0;
+    double queryMass = 0; // 0: no index
+    bool reportRecall = false;
+    PipelineParams pipelineParams;
+    const char *cacheDir = NULL;
+    size_t cacheMB = 1024;
+    const char *profilePath = NULL;
+    const char *tracePath = NULL;
+    ResolutionParams resolution;
+    bool sweep = false;
+    bool cascade = false;
+    CascadeParams cascadeParams;
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        if (arg == "--strip-rows" && i+1 < argc)
+            stripRows = atoi(argv[++i]);
+        else if (arg == "--model" && i+1 < argc)
+            modelPath = argv[++i];
+        else if (arg == "--index" && i+1 < argc)
+            queryMass = atof(argv[++i]);
+        else if (arg == "--recall")
+            reportRecall = true;
+        else if (arg == "--readers" && i+1 < argc)
+            pipelineParams.readers = atoi(argv[++i]);
+        else if (arg == "--threads" && i+1 < argc)
+            pipelineParams.workers = atoi(argv[++i]);
+        else if (arg == "--queue" && i+1 < argc)
+            pipelineParams.queueSize = atoi(argv[++i]);
+        else if (arg == "--cache" && i+1 < argc)
+            cacheDir = argv[++i];
+        else if (arg == "--cache-size" && i+1 < argc)
+            cacheMB = strtoull(argv[++i], NULL, 10);
+        else if (arg == "--profile" && i+1 < argc)
+            profilePath = argv[++i];
+        else if (arg == "--trace" && i+1 < argc)
+            tracePath = argv[++i];
+        else if (arg == "--max-side" && i+1 < argc)
+            resolution.maxSide = atoi(argv[++i]);
+        else if (arg == "--pyramid" && i+1 < argc)
+            resolution.pyramidLevels = atoi(argv[++i]);
+        else if (arg == "--stride" && i+1 < argc)
+            resolution.stride = atoi(argv[++i]);
+        else if (arg == "--resolution-sweep")
+            sweep = true;
+        else if (arg == "--cascade" && i+1 < argc)
+        {
+            cascade = true;
+            cascadeParams.minMargin = atof(argv[++i]);
+        }
+        else if (arg == "--coarse" && i+1 < argc)
+        {
+            ResolutionParams& c = cascadeParams.coarse;
+            if (sscanf(argv[++i], "%d,%d,%d", &c.maxSide, &c.pyramidLevels,
+                       &c.stride) != 3)
+            {
+                help();
+                return -1;
+            }
+        }
+        else if (testSet == NULL && arg[0] != '-')
+            testSet = argv[i];
+        else
+        {
+            help();
+            return -1;
+        }
+    }
+    if (testSet == NULL)
     {
         help();
         return -1;
     }
+    if (cascade && (cacheDir || reportRecall))
+    {
+        // cached word maps and the recall measurement are about the full
+        // resolution only
+        cout << "--cascade cannot be combined with --cache or --recall\n";
+        return -1;
+    }
+    if (profilePath || tracePath)
+        enableProfiling(tracePath != NULL);
 
     string imageDir = "images/";
 
     vector<string> testImagesPath;
     vector<int> realLabels;
     vector<int> trainingLabels;
+    // First, so that it is destroyed last: the dictionary and histograms
+    // may point into its mapping.
+    Model model;
     Mat histograms;
 
-    readTestImagePaths(testImagesPath, argv[1]);
+    readTestImagePaths(testImagesPath, testSet);
     readRealLabels(realLabels, "test_label.txt");
-    readTrainingLabels(trainingLabels, "training_label.txt");
-    readHistograms(histograms, "histograms.xml");
 
     // Initializes filterbank.
     // The parameter must be the same as what was used in training phase.
     FilterBank filterbank;
-
-    // Loads dictionary
     Dictionary dict;
-    dict.load("dictionary/dictionary.xml");
 
-    Mat cm = Mat::zeros(9, 9, CV_32S); // confusion matrix
+    if (modelPath)
+    {
+        // Everything comes from the mapped model file.
+        if (!model.open(modelPath))
+        {
+            cout << "Error opening model " << modelPath << endl;
+            return -1;
+        }
+        filterbank = model.getFilterBank();
+        model.loadDictionary(dict, filterbank.getDepth());
+        histograms = model.getHistograms();
+        model.getLabels(trainingLabels);
+    }
+    else
+    {
+        readTrainingLabels(trainingLabels, histogramLabelsPath().c_str());
+        // Loads histograms and dictionary
+        if (!readHistograms(histograms, "histograms.xml")
+            || !dict.load("dictionary/dictionary.xml"))
+            return -1;
+    }
+    dict.setStripRows(stripRows);
+    // The first stage of the cascade starts from the same filters.
+    FilterBank coarse = filterbank;
+    coarse.setResolution(cascadeParams.coarse);
+    filterbank.setResolution(resolution);
 
-    /* Evaluates classifier. Computes confusion matrix. */
-    for (int i = 0; i < testImagesPath.size(); i++)
+    KnnClassifier knn;
+    if (!knn.setTrainingSet(histograms, trainingLabels))
+    {
+        cout << "The training labels do not match the histograms, or one "
+             << "is below 1\n";
+        return -1;
+    }
+    if (queryMass > 0)
+    {
+        KnnIndexParams indexParams;
+        indexParams.queryMass = queryMass;
+        if (!knn.buildIndex(indexParams))
+            cout << "The training histograms are dense; searching without "
+                 << "the index\n";
+    }
+    if (sweep)
+    {
+        sweepResolutions(testImagesPath, realLabels, imageDir, filterbank,
+                         dict, knn, pipelineParams);
+        return 0;
+    }
+
+    FeatureCache cache;
+    if (cacheDir)
     {
-        //cout << "Testing image " << i+1 << "/" << testImagesPath.size();
+        if (!cache.open(cacheDir, cacheMB << 20))
+        {
+            cout << "Error opening cache " << cacheDir << endl;
+            return -1;
+        }
+        cache.setContext(filterbank, dict);
+        pipelineParams.hashContent = true;
+    }
 
-        string& imagePath = testImagesPath[i];
-        Mat image = imread(imageDir + imagePath);
-        Mat wordmap = dict.getWordmap(image, filterbank);
-        
-        Mat h;
-        computeHistogram(wordmap, h, dict.getWordsNum());
+    // Labels are within [1, numClasses], the indices of cm within
+    // [0, numClasses-1].
+    int numClasses = 0;
+    for (int label : trainingLabels)
+        numClasses = max(numClasses, label);
+    for (int label : realLabels)
+        numClasses = max(numClasses, label);
+    Mat cm = Mat::zeros(numClasses, numClasses, CV_32S); // confusion matrix
+    int numTests = min(testImagesPath.size(), realLabels.size());
+    // Test histograms, scored in one kNN batch once every image is read.
+    Mat testHistograms;
+    if (!cascade)
+        testHistograms.create(numTests, dict.getWordsNum(), CV_64F);
+    vector<char> wasRead(numTests, 0);
+    double start = omp_get_wtime();
 
-        // Predicts the label of the test image using knn. k = 5.
-        int predictedLabel = knnClassify(h, histograms, trainingLabels, 5);
-        int realLabel = realLabels[i];
+    /* Evaluates classifier. Computes confusion matrix. */
+    // Images are read and their histograms computed in the pipeline of
+    // pipeline.hpp; predicted[i] is 0 if image i could not be read.
+    testImagesPath.resize(numTests);
+    vector<int> predicted(numTests, 0);
+    vector<CascadeResult> stages(numTests);
+    runPipeline(testImagesPath, imageDir, pipelineParams,
+                [&](PipelineItem& item) {
+        if (item.image.empty())
+            return;
+        if (cascade)
+        {
+            stages[item.index] = classifyCascade(item.image, coarse,
+                                                 filterbank, dict, knn, 5,
+                                                 cascadeParams.minMargin);
+            predicted[item.index] = stages[item.index].label;
+            return;
+        }
+        if (!cacheDir
+            || !cache.get(item.contentHash, item.wordmap, dict.getWordsNum()))
+        {
+            item.wordmap = dict.getWordmap(item.image, filterbank);
+            if (cacheDir)
+                cache.put(item.contentHash, item.wordmap, dict.getWordsNum());
+        }
+        computeHistogram(item.wordmap, item.histogram, dict.getWordsNum());
+        item.histogram.copyTo(testHistograms.row(item.index));
+        wasRead[item.index] = 1;
+    });
+    // The scratch buffers of the image stages are idle from here on.
+    releaseWorkspaces();
 
-        // The range of label is within [1,9], while the index of cm is
-        // within [0,8].
-        int &res = cm.at<int>(realLabel-1, predictedLabel-1);
+    // Predicts the labels of the test images using knn. k = 5.
+    Mat readHistograms;
+    vector<int> readIndices;
+    if (!cascade)
+    {
+        for (int i = 0; i < numTests; i++)
+            if (wasRead[i])
+            {
+                readHistograms.push_back(testHistograms.row(i));
+                readIndices.push_back(i);
+            }
+        vector<int> labels;
+        if (!readIndices.empty())
+            knn.classifyBatch(readHistograms, 5, labels);
+        for (size_t r = 0; r < readIndices.size(); r++)
+            predicted[readIndices[r]] = labels[r];
+    }
+
+    for (int i = 0; i < numTests; i++)
+    {
+        if (predicted[i] == 0)
+        {
+            cout << "Error reading " << testImagesPath[i] << endl;
+            continue;
+        }
+        if (realLabels[i] < 1)
+        {
+            cout << "Invalid label " << realLabels[i] << " for "
+                 << testImagesPath[i] << endl;
+            continue;
+        }
+        int &res = cm.at<int>(realLabels[i]-1, predicted[i]-1);
         res = res + 1;
     }
+    double seconds = omp_get_wtime() - start;
 
     double tr = trace(cm)[0];
     double sumv = sum(cm)[0];
     cout << "Evaluation result (k = 5)\n";
     cout << "Confusion matrix:\n" << cm << endl;
     cout << "Accuracy: " << tr/sumv << endl;
+    cout << "Throughput: " << numTests / seconds << " images/s ("
+         << numTests << " images in " << seconds << " s, "
+         << (pipelineParams.workers > 0 ? pipelineParams.workers
+                                        : omp_get_num_procs())
+         << " threads)\n";
+    if (cascade)
+        reportCascade(stages, predicted, realLabels, cascadeParams);
+    if (reportRecall && !readHistograms.empty())
+        cout << "Recall@5 against brute force: "
+             << knn.recall(readHistograms, 5) << endl;
+    if (profilePath && !writeProfile(profilePath))
+        cout << "Error writing " << profilePath << endl;
+    if (tracePath && !writeTrace(tracePath))
+        cout << "Error writing " << tracePath << endl;
 
     return 0;
 }
 
 void help()
 {
-    cout << "Usage: ./evaluate <test_set>\n";
+    cout << "Usage: ./evaluate [--strip-rows <n>] [--model <file>] ";
+    cout << "[--index <mass>] [--recall]\n";
+    cout << "                  [--readers <n>] [--threads <n>] ";
+    cout << "[--queue <n>]\n";
+    cout << "                  [--cache <dir>] [--cache-size <MB>] ";
+    cout << "[--profile <f>] [--trace <f>]\n";
+    cout << "                  [--max-side <n>] [--pyramid <levels>] ";
+    cout << "[--stride <n>] [--resolution-sweep]\n";
+    cout << "                  [--cascade <margin>] ";
+    cout << "[--coarse <max_side>,<pyramid>,<stride>]\n";
+    cout << "                  <test_set>\n";
+    cout << "       ./evaluate --check-precision <image_set>\n";
     cout << "\t<test_set> is a txt file that contains the relative paths ";
     cout << "of all testing images.\n";
+    cout << "\t--strip-rows computes word maps in strips of n rows.\n";
+    cout << "\t--model loads a binary model written by ./bundle instead of ";
+    cout << "the XML files.\n";
+    cout << "\t--index searches the neighbours with an inverted index ";
+    cout << "over the visual words, scanning the largest query bins up to ";
+    cout << "<mass> of the histogram: 1 is exact, smaller is faster and ";
+    cout << "approximate. Only sparse histograms (large or tree ";
+    cout << "vocabularies) are indexed.\n";
+    cout << "\t--recall reports the fraction of the true 5 nearest ";
+    cout << "neighbours the search returned.\n";
+    cout << "\t--readers, --threads and --queue set the threads reading ";
+    cout << "images (default 2), the threads classifying them (default: ";
+    cout << "one per core) and the images buffered in between (default ";
+    cout << "16).\n";
+    cout << "\t--cache reuses the word maps cached in <dir> (see ./train), ";
+    cout << "holding at most --cache-size MB (default 1024).\n";
+    cout << "\t--profile writes per-stage latency percentiles and ";
+    cout << "throughput to <f> (JSON); --trace writes a per-image timeline ";
+    cout << "of every stage in the Chrome trace format.\n";
+    cout << "\t--max-side, --pyramid and --stride trade accuracy for ";
+    cout << "latency: images are scaled down to at most <n> pixels on the ";
+    cout << "longer side, filters with a large sigma run on up to <levels> ";
+    cout << "halvings of the image, and words are assigned every <n> ";
+    cout << "pixels.\n";
+    cout << "\t--resolution-sweep measures accuracy and per-image latency ";
+    cout << "of a range of these settings against native resolution.\n";
+    cout << "\t--cascade classifies every image at the --coarse ";
+    cout << "resolution first (default 320,1,2) and keeps that answer when ";
+    cout << "the kNN vote margin, (winner - runner-up) / k, is at least ";
+    cout << "<margin>; the others go through the full resolution. Reports ";
+    cout << "the acceptance rate and accuracy of each stage.\n";
+    cout << "\t--check-precision compares the float32 pipeline against the ";
+    cout << "float64 one on <image_set> and fails if they disagree.\n";
+}
+
+/*
+ * Classifies the test set once per setting of a fixed ladder of reduced
+ * resolutions, from native to the cheapest, and prints for each the
+ * accuracy, the agreement with the native predictions and the latency of
+ * one image (word map, histogram and kNN; reading and decoding excluded).
+ * Run with --threads 1 for latencies free of contention.
+ */
+void sweepResolutions(vector<string>& testImagesPath, vector<int>& realLabels,
+        string& imageDir, FilterBank& filterbank, Dictionary& dict,
+        KnnClassifier& knn, const PipelineParams& pipelineParams)
+{
+    // maxSide, pyramidLevels, stride
+    const int settings[][3] = {
+        {0, 0, 1}, {0, 1, 1}, {0, 2, 1}, {0, 0, 2}, {0, 2, 2},
+        {1024, 0, 1}, {1024, 2, 2}, {640, 0, 1}, {640, 2, 2}, {480, 1, 4}
+    };
+    int numSettings = sizeof(settings) / sizeof(settings[0]);
+    int numTests = min(testImagesPath.size(), realLabels.size());
+    testImagesPath.resize(numTests);
+
+    vector<int> native;
+    cout << "max_side pyramid stride accuracy agreement p50_ms p95_ms "
+         << "images/s\n";
+    for (int s = 0; s < numSettings; s++)
+    {
+        ResolutionParams resolution;
+        resolution.maxSide = settings[s][0];
+        resolution.pyramidLevels = settings[s][1];
+        resolution.stride = settings[s][2];
+        filterbank.setResolution(resolution);
+
+        vector<int> predicted(numTests, 0);
+        vector<double> latency(numTests, 0);
+        double start = omp_get_wtime();
+        runPipeline(testImagesPath, imageDir, pipelineParams,
+                    [&](PipelineItem& item) {
+            if (item.image.empty())
+                return;
+            double t0 = omp_get_wtime();
+            item.wordmap = dict.getWordmap(item.image, filterbank);
+            computeHistogram(item.wordmap, item.histogram,
+                             dict.getWordsNum());
+            predicted[item.index] = knn.classify(item.histogram, 5);
+            latency[item.index] = omp_get_wtime() - t0;
+        });
+        double seconds = omp_get_wtime() - start;
+        // Buffers sized for this resolution would outlive it.
+        releaseWorkspaces();
+        if (s == 0)
+            native = predicted;
+
+        int read = 0, correct = 0, agree = 0;
+        vector<double> times;
+        for (int i = 0; i < numTests; i++)
+        {
+            if (predicted[i] == 0)
+                continue;
+            read++;
+            correct += predicted[i] == realLabels[i];
+            agree += predicted[i] == native[i];
+            times.push_back(latency[i]);
+        }
+        if (read == 0)
+        {
+            cout << "No test image could be read\n";
+            break;
+        }
+        sort(times.begin(), times.end());
+        cout << resolution.maxSide << " " << resolution.pyramidLevels << " "
+             << resolution.stride << " " << (double)correct / read << " "
+             << (double)agree / read << " "
+             << times[times.size() / 2] * 1000 << " "
+             << times[min(times.size() - 1, times.size() * 95 / 100)] * 1000
+             << " " << numTests / seconds << endl;
+    }
+    filterbank.setResolution(ResolutionParams());
+}
+
+/*
+ * Per-stage figures of a cascade run: images answered by each stage and
+ * their accuracy, and how often escalating changed the coarse answer.
+ */
+void reportCascade(const vector<CascadeResult>& stages,
+        const vector<int>& predicted, const vector<int>& realLabels,
+        const CascadeParams& params)
+{
+    int read = 0, answered[2] = {0, 0}, correct[2] = {0, 0}, changed = 0;
+    for (size_t i = 0; i < stages.size(); i++)
+    {
+        if (predicted[i] == 0)
+            continue;
+        const CascadeResult& r = stages[i];
+        read++;
+        answered[r.stage]++;
+        correct[r.stage] += r.label == realLabels[i];
+        changed += r.stage == 1 && r.label != r.coarseLabel;
+    }
+    if (read == 0)
+        return;
+
+    const ResolutionParams& c = params.coarse;
+    cout << "Cascade (coarse " << c.maxSide << "," << c.pyramidLevels << ","
+         << c.stride << ", margin >= " << params.minMargin << "):\n";
+    const char* names[2] = {"coarse", "full"};
+    for (int s = 0; s < 2; s++)
+    {
+        cout << "  stage " << s << " (" << names[s] << "): " << answered[s]
+             << " images, acceptance " << (double)answered[s] / read;
+        if (answered[s] > 0)
+            cout << ", accuracy " << (double)correct[s] / answered[s];
+        cout << endl;
+    }
+    cout << "  escalations that changed the coarse answer: " << changed
+         << endl;
 }
 
 void readTestImagePaths(vector<string>& testImagesPath, const char *filename)
@@ -127,31 +522,76 @@ void readTrainingLabels(vector<int>& trainingLabels, const char *filename)
     in.close();
 }
 
-void readHistograms(Mat& H, const char *filename)
+bool readHistograms(Mat& H, const char *filename)
 {
-    FileStorage fs(filename, FileStorage::READ);
-    fs["histograms"] >> H;
+    return readHistogramFile(filename, H);
 }
 
-int knnClassify(Mat& testH, Mat& histograms, vector<int>& trainingLabels,
-        int K)
+/*
+ * Accuracy regression check of the float32 pipeline. Every image in the
+ * list is processed in both precisions with the same dictionary, and the
+ * responses, word maps and histograms are compared. Returns non-zero if
+ * any image exceeds the tolerances below.
+ */
+int checkPrecision(const char *filename)
 {
-    Mat dist = distance(testH, histograms);
-    // Sorts the distance array and gets the indices of the observations
-    // that is closest to sample.
-    Mat indices;
-    cv::sortIdx(dist, indices, CV_SORT_EVERY_ROW + CV_SORT_DESCENDING);
-
-    Mat counter = Mat::zeros(1, 9, CV_32S);
-    for (int i = 0; i < K; i++)
-    {
-        // index of the i-th closest observations in histograms
-        int idx = indices.at<int>(0,i);
-        int labelId = trainingLabels[idx];
-        counter.at<int>(0,labelId) = counter.at<int>(0,labelId) + 1;
-    }
-    
-    Point maxLoc;
-    cv::minMaxLoc(counter, NULL, NULL, NULL, &maxLoc);
-    return maxLoc.x;
+    const double maxResponseError = 1e-4; // relative to the largest response
+    const double minWordAgreement = 0.99; // fraction of identical words
+    const double maxHistogramL1 = 0.02;
+
+    string imageDir = "images/";
+    vector<string> imagesPath;
+    readTestImagePaths(imagesPath, filename);
+
+    FilterBank fb32(CV_32F), fb64(CV_64F);
+    Dictionary dict32, dict64;
+    if (!dict32.load("dictionary/dictionary.xml", CV_32F)
+        || !dict64.load("dictionary/dictionary.xml", CV_64F))
+        return -1;
+
+    int failures = 0, unreadable = 0;
+    for (size_t i = 0; i < imagesPath.size(); i++)
+    {
+        Mat image = imread(imageDir + imagesPath[i]);
+        if (image.empty())
+        {
+            cout << "Error reading " << imagesPath[i] << endl;
+            unreadable++;
+            continue;
+        }
+
+        Mat r32, r64, r32as64;
+        fb32.filter(image, r32);
+        fb64.filter(image, r64);
+        r32.convertTo(r32as64, CV_64F);
+        double responseError = norm(r32as64, r64, NORM_INF)
+                               / std::max(norm(r64, NORM_INF), 1e-12);
+
+        Mat w32 = dict32.getWordmap(image, fb32);
+        Mat w64 = dict64.getWordmap(image, fb64);
+        double agreement = 1.0 - (double)countNonZero(w32 != w64)
+                                 / w64.total();
+
+        Mat h32, h64;
+        computeHistogram(w32, h32, dict32.getWordsNum());
+        computeHistogram(w64, h64, dict64.getWordsNum());
+        double histogramL1 = norm(h32, h64, NORM_L1);
+
+        bool ok = responseError <= maxResponseError
+                  && agreement >= minWordAgreement
+                  && histogramL1 <= maxHistogramL1;
+        if (!ok)
+            failures++;
+        cout << imagesPath[i] << ": response error " << responseError
+             << ", word agreement " << agreement
+             << ", histogram L1 " << histogramL1
+             << (ok ? "" : "  FAILED") << endl;
+    }
+
+    cout << failures << " of " << imagesPath.size() - unreadable
+         << " images outside tolerance";
+    if (unreadable > 0)
+        cout << ", " << unreadable << " could not be read";
+    cout << endl;
+    return failures == 0 ? 0 : 1;
 }
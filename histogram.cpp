@@ -1,26 +1,33 @@
 #include "histogram.hpp"
+#include "bow.hpp"
+#include "profile.hpp"
+#include <algorithm>
+#include <fstream>
+#include <iostream>
 
 /*
  * Extracts the histogram of visual words within the given image.
  * The resulting histogram h is L1 normalized.
  * h[i]: the occurence of the i-th visual word.
+ * h is filled in place when it already has the right size and type, so a
+ * caller reusing it allocates nothing.
  */
 void computeHistogram(cv::Mat& wordMap, cv::Mat& h, int dictionarySize)
 {
-    h = cv::Mat::zeros(1, dictionarySize, CV_64F);
+    ProfileTimer timer(PROFILE_HISTOGRAM, (double)wordMap.total());
+    h.create(1, dictionarySize, CV_64F);
+    h.setTo(0);
     double* h_ptr = h.ptr<double>(0);
     for (int i = 0; i < wordMap.rows; i++)
     {
+        const int* words = wordMap.ptr<int>(i);
         for (int j = 0; j < wordMap.cols; j++)
-        {
-            int word = wordMap.at<int>(i,j);
-            h_ptr[word] = h_ptr[word] + 1.0;
-        }
+            h_ptr[words[j]] += 1.0;
     }
 
     // L1 normalize histogram h.
     double sumh = cv::sum(h)[0];
-    h = h / sumh;
+    h *= 1.0 / sumh;
 }
 
 /*
@@ -30,12 +37,65 @@ void computeHistogram(cv::Mat& wordMap, cv::Mat& h, int dictionarySize)
  */
 cv::Mat distance(cv::Mat& sample, cv::Mat& observations)
 {
+    CV_Assert(sample.total() == (size_t)observations.cols);
+    if (sample.type() != CV_64F || observations.type() != CV_64F)
+    {
+        cv::Mat s64, o64;
+        sample.convertTo(s64, CV_64F);
+        observations.convertTo(o64, CV_64F);
+        return distance(s64, o64);
+    }
     cv::Mat dist(1, observations.rows, CV_64F);
+    cv::Mat s = sample.isContinuous() ? sample : sample.clone();
+    const double* a = s.ptr<double>(0);
     for (int i = 0; i < observations.rows; i++)
     {
-        cv::Mat intersect = cv::min(sample, observations.row(i));
-        double sumv = cv::sum(intersect)[0];
+        // sum of the elementwise minimum, without a temporary row
+        const double* b = observations.ptr<double>(i);
+        double sumv = 0;
+        for (int j = 0; j < observations.cols; j++)
+            sumv += std::min(a[j], b[j]);
         dist.at<double>(0, i) = sumv;
     }
     return dist;
 }
+
+bool writeHistogramFile(const std::string& path, const cv::Mat& histograms)
+{
+    cv::FileStorage fs(path, cv::FileStorage::WRITE);
+    if (!fs.isOpened())
+        return false;
+    fs << "histograms" << histograms;
+    fs << "responses" << RESPONSE_VERSION;
+    return true;
+}
+
+bool readHistogramFile(const std::string& path, cv::Mat& histograms)
+{
+    histograms.release();
+    cv::FileStorage fs(path, cv::FileStorage::READ);
+    if (!fs.isOpened())
+    {
+        std::cout << "Error reading " << path << std::endl;
+        return false;
+    }
+    // Absent from histograms of 8-bit responses, see RESPONSE_VERSION.
+    int version = 1;
+    if (!fs["responses"].isNone())
+        fs["responses"] >> version;
+    if (version != RESPONSE_VERSION)
+    {
+        std::cout << path << " was computed from filter responses of "
+                  << "version " << version << ", not " << RESPONSE_VERSION
+                  << "; train again" << std::endl;
+        return false;
+    }
+    fs["histograms"] >> histograms;
+    return true;
+}
+
+std::string histogramLabelsPath()
+{
+    std::ifstream in(HISTOGRAM_LABELS);
+    return in.is_open() ? HISTOGRAM_LABELS : "training_label.txt";
+}
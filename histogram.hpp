@@ -2,9 +2,31 @@
 #define HISTOGRAM_H_
 
 #include <opencv2/opencv.hpp>
+#include <string>
 
 void computeHistogram(cv::Mat& wordMap, cv::Mat& h, int dictionarySize);
 
 cv::Mat distance(cv::Mat& sample, cv::Mat& observations);
 
+/*
+ * histograms.xml, tagged with the RESPONSE_VERSION (bow.hpp) of the word
+ * maps the histograms were computed from. readHistogramFile prints the
+ * problem and returns false if the file is missing or of another version.
+ */
+bool writeHistogramFile(const std::string& path, const cv::Mat& histograms);
+bool readHistogramFile(const std::string& path, cv::Mat& histograms);
+
+/*
+ * Labels of the rows of histograms.xml, one per line. ./train writes them
+ * next to it, without the images it had to drop; training_label.txt, its
+ * input, is never modified.
+ */
+const char* const HISTOGRAM_LABELS = "histogram_labels.txt";
+
+/*
+ * HISTOGRAM_LABELS, or training_label.txt for histograms written before
+ * it existed.
+ */
+std::string histogramLabelsPath();
+
 #endif
@@ -0,0 +1,345 @@
+#include "kmeans.hpp"
+#include "nearest.hpp"
+#include <algorithm>
+#include <limits>
+
+// Rows handed to assignNearest by one parallel work item.
+static const int ASSIGN_CHUNK = 4096;
+
+KMeans::KMeans(int K, const KMeansParams& params) : K(K), params(params)
+{
+}
+
+/*
+ * Rows of an in-memory CV_32F matrix.
+ */
+class MatSource : public SampleSource
+{
+private:
+    const cv::Mat& samples;
+
+public:
+    explicit MatSource(const cv::Mat& samples) : samples(samples) {}
+
+    int rows() const { return samples.rows; }
+    int cols() const { return samples.cols; }
+
+    bool read(int i, float* out)
+    {
+        const float* row = samples.ptr<float>(i);
+        std::copy(row, row + samples.cols, out);
+        return true;
+    }
+};
+
+static uint64 seedOf(const KMeansParams& params)
+{
+    return params.seed ? params.seed : (uint64)cv::getTickCount();
+}
+
+bool drawSamples(SampleSource& samples, int n, cv::RNG& rng, cv::Mat& out)
+{
+    out.create(n, samples.cols(), CV_32F);
+    for (int i = 0; i < n; i++)
+        if (!samples.read(rng.uniform(0, samples.rows()), out.ptr<float>(i)))
+            return false;
+    return true;
+}
+
+static double squaredDistance(const float* a, const float* b, int n)
+{
+    double d = 0;
+    for (int j = 0; j < n; j++)
+    {
+        double diff = (double)a[j] - b[j];
+        d += diff*diff;
+    }
+    return d;
+}
+
+double assignParallel(const cv::Mat& samples, const cv::Mat& centers,
+                      int* labels, double* distances)
+{
+    cv::Mat norms;
+    computeCenterNorms(centers, norms);
+
+    int N = samples.rows;
+    int numChunks = (N + ASSIGN_CHUNK - 1) / ASSIGN_CHUNK;
+    // Per-chunk totals added in chunk order: the sum does not depend on
+    // the number of threads or the order they finish in.
+    std::vector<double> chunkTotals(numChunks, 0);
+
+    #pragma omp parallel for schedule(dynamic)
+    for (int c = 0; c < numChunks; c++)
+    {
+        int r0 = c * ASSIGN_CHUNK;
+        int r1 = std::min(r0 + ASSIGN_CHUNK, N);
+        assignNearest(samples.rowRange(r0, r1), centers, norms,
+                      labels + r0, distances + r0);
+        for (int i = r0; i < r1; i++)
+            chunkTotals[c] += distances[i];
+    }
+
+    double total = 0;
+    for (int c = 0; c < numChunks; c++)
+        total += chunkTotals[c];
+    return total;
+}
+
+/*
+ * k-means++ seeding: every new center is drawn with probability
+ * proportional to the squared distance to the nearest chosen center.
+ */
+void KMeans::seedCenters(const cv::Mat& samples, cv::Mat& centers,
+                         cv::RNG& rng)
+{
+    int N = samples.rows;
+    int D = samples.cols;
+    std::vector<double> minDist(N, std::numeric_limits<double>::max());
+
+    centers.create(K, D, CV_32F);
+    samples.row(rng.uniform(0, N)).copyTo(centers.row(0));
+
+    for (int k = 1; k < K; k++)
+    {
+        const float* newest = centers.ptr<float>(k - 1);
+
+        #pragma omp parallel for
+        for (int i = 0; i < N; i++)
+        {
+            double d = squaredDistance(samples.ptr<float>(i), newest, D);
+            if (d < minDist[i])
+                minDist[i] = d;
+        }
+        // Summed serially, so the draw is the same with any thread count.
+        double total = 0;
+        for (int i = 0; i < N; i++)
+            total += minDist[i];
+
+        // Picks the sample where the running sum crosses r.
+        double r = rng.uniform(0., total);
+        int chosen = N - 1;
+        for (int i = 0; i < N; i++)
+        {
+            r -= minDist[i];
+            if (r < 0)
+            {
+                chosen = i;
+                break;
+            }
+        }
+        samples.row(chosen).copyTo(centers.row(k));
+    }
+}
+
+/*
+ * Lloyd iterations from the current centers. Returns the compactness.
+ */
+double KMeans::lloyd(const cv::Mat& samples, cv::Mat& centers,
+                     std::vector<int>& labels)
+{
+    int N = samples.rows;
+    int D = samples.cols;
+    std::vector<double> dist(N);
+    double eps2 = params.epsilon * params.epsilon;
+
+    labels.resize(N);
+    for (int iter = 0; iter < params.maxIterations; iter++)
+    {
+        assignParallel(samples, centers, &labels[0], &dist[0]);
+
+        // Members of every cluster in sample order (counting sort), then
+        // one sum per cluster in parallel: each sum adds its samples in
+        // index order, so the centers are bitwise the same for any number
+        // of threads.
+        std::vector<int> counts(K, 0);
+        for (int i = 0; i < N; i++)
+            counts[labels[i]]++;
+        std::vector<int> start(K + 1, 0);
+        for (int k = 0; k < K; k++)
+            start[k + 1] = start[k] + counts[k];
+        std::vector<int> members(N);
+        std::vector<int> fill(start.begin(), start.end() - 1);
+        for (int i = 0; i < N; i++)
+            members[fill[labels[i]]++] = i;
+
+        cv::Mat sums = cv::Mat::zeros(K, D, CV_64F);
+        #pragma omp parallel for schedule(dynamic)
+        for (int k = 0; k < K; k++)
+        {
+            double* s = sums.ptr<double>(k);
+            for (int m = start[k]; m < start[k + 1]; m++)
+            {
+                const float* x = samples.ptr<float>(members[m]);
+                for (int j = 0; j < D; j++)
+                    s[j] += x[j];
+            }
+        }
+
+        double maxShift = 0;
+        for (int k = 0; k < K; k++)
+        {
+            float* c = centers.ptr<float>(k);
+            if (counts[k] == 0)
+            {
+                // Re-seeds an empty cluster with the worst-fitting sample.
+                int far = (int)(std::max_element(dist.begin(), dist.end())
+                                - dist.begin());
+                samples.row(far).copyTo(centers.row(k));
+                dist[far] = 0;
+                maxShift = std::numeric_limits<double>::max();
+                continue;
+            }
+
+            const double* s = sums.ptr<double>(k);
+            double shift = 0;
+            for (int j = 0; j < D; j++)
+            {
+                float v = (float)(s[j] / counts[k]);
+                shift += (double)(v - c[j]) * (v - c[j]);
+                c[j] = v;
+            }
+            maxShift = std::max(maxShift, shift);
+        }
+
+        if (maxShift <= eps2)
+            break;
+    }
+
+    return assignParallel(samples, centers, &labels[0], &dist[0]);
+}
+
+/*
+ * Mini-batch k-means (Sculley, 2010) from the current centers.
+ */
+bool KMeans::miniBatch(SampleSource& samples, cv::Mat& centers,
+                       cv::RNG& rng)
+{
+    int D = samples.cols();
+    int B = std::min(params.miniBatch, samples.rows());
+    double eps2 = params.epsilon * params.epsilon;
+
+    cv::Mat batch;
+    std::vector<int> batchLabels(B);
+    std::vector<double> batchDist(B);
+    std::vector<int> counts(K, 0);
+
+    for (int iter = 0; iter < params.maxIterations; iter++)
+    {
+        if (!drawSamples(samples, B, rng, batch))
+            return false;
+        assignParallel(batch, centers, &batchLabels[0], &batchDist[0]);
+
+        cv::Mat old = centers.clone();
+        for (int b = 0; b < B; b++)
+        {
+            int k = batchLabels[b];
+            float eta = 1.0f / ++counts[k];
+            float* c = centers.ptr<float>(k);
+            const float* x = batch.ptr<float>(b);
+            for (int j = 0; j < D; j++)
+                c[j] += eta * (x[j] - c[j]);
+        }
+
+        double maxShift = 0;
+        for (int k = 0; k < K; k++)
+            maxShift = std::max(maxShift,
+                squaredDistance(centers.ptr<float>(k), old.ptr<float>(k), D));
+        if (maxShift <= eps2)
+            break;
+    }
+    return true;
+}
+
+/*
+ * Mini-batch attempts; none reads all samples. Seeding uses a subsample,
+ * and the attempts are compared on one fixed probe subsample, scaled to
+ * the whole set.
+ */
+double KMeans::fitMiniBatch(SampleSource& samples, cv::Mat& centers,
+                            cv::RNG& rng)
+{
+    int N = samples.rows();
+    int numProbe = std::min(N, std::max(10 * params.miniBatch, 100 * K));
+    cv::Mat probe;
+    if (!drawSamples(samples, numProbe, rng, probe))
+        return -1;
+    std::vector<int> probeLabels(numProbe);
+    std::vector<double> probeDist(numProbe);
+    double best = std::numeric_limits<double>::max();
+
+    for (int a = 0; a < std::max(params.attempts, 1); a++)
+    {
+        int n = std::min(N, std::max(params.miniBatch, 10 * K));
+        cv::Mat subset, c;
+        if (!drawSamples(samples, n, rng, subset))
+            return -1;
+        seedCenters(subset, c, rng);
+        if (!miniBatch(samples, c, rng))
+            return -1;
+
+        double compactness = assignParallel(probe, c, &probeLabels[0],
+                                            &probeDist[0])
+                             * N / numProbe;
+        if (compactness < best)
+        {
+            best = compactness;
+            centers = c;
+        }
+    }
+    return best;
+}
+
+double KMeans::fit(SampleSource& samples, cv::Mat& centers)
+{
+    CV_Assert(params.miniBatch > 0);
+    CV_Assert(K > 0 && samples.rows() >= K);
+
+    cv::RNG rng(seedOf(params));
+    return fitMiniBatch(samples, centers, rng);
+}
+
+double KMeans::fit(const cv::Mat& samples, cv::Mat& centers,
+                   std::vector<int>* labels)
+{
+    CV_Assert(samples.type() == CV_32F && samples.isContinuous());
+    CV_Assert(K > 0 && samples.rows >= K);
+
+    cv::RNG rng(seedOf(params));
+
+    if (params.miniBatch > 0)
+    {
+        MatSource source(samples);
+        double compactness = fitMiniBatch(source, centers, rng);
+        if (labels)
+        {
+            // Exact, since the assignment reads all samples anyway.
+            std::vector<double> dist(samples.rows);
+            labels->resize(samples.rows);
+            compactness = assignParallel(samples, centers, &(*labels)[0],
+                                         &dist[0]);
+        }
+        return compactness;
+    }
+
+    std::vector<int> bestLabels, attemptLabels;
+    double best = std::numeric_limits<double>::max();
+
+    for (int a = 0; a < std::max(params.attempts, 1); a++)
+    {
+        cv::Mat c;
+        seedCenters(samples, c, rng);
+        double compactness = lloyd(samples, c, attemptLabels);
+
+        if (compactness < best)
+        {
+            best = compactness;
+            centers = c;
+            bestLabels.swap(attemptLabels);
+        }
+    }
+
+    if (labels)
+        labels->swap(bestLabels);
+    return best;
+}
@@ -0,0 +1,105 @@
+#ifndef KMEANS_H_
+#define KMEANS_H_
+
+#include <opencv2/opencv.hpp>
+#include <vector>
+
+/*
+ * Parameters of the k-means trainer.
+ */
+struct KMeansParams
+{
+    int maxIterations;  // Lloyd iterations, or mini-batch steps
+    double epsilon;     // stop when no center moves more than this
+    int attempts;       // restarts, the most compact result is kept
+    uint64 seed;        // 0: seeded from the clock
+    int miniBatch;      // 0: full Lloyd; otherwise samples per step
+
+    KMeansParams()
+        : maxIterations(100), epsilon(0.01), attempts(3), seed(0),
+          miniBatch(0) {}
+};
+
+/*
+ * Samples read one row at a time, for sample sets that need not fit in
+ * memory: mini-batch k-means only reads random rows.
+ */
+class SampleSource
+{
+public:
+    virtual ~SampleSource() {}
+
+    virtual int rows() const = 0;
+    virtual int cols() const = 0;
+
+    /*
+     * Copies row i to out (cols() floats). Returns false on a read error.
+     */
+    virtual bool read(int i, float* out) = 0;
+};
+
+/*
+ * Copies n rows of samples drawn at random, with replacement, to out
+ * (n x cols, CV_32F). Returns false on a read error.
+ */
+bool drawSamples(SampleSource& samples, int n, cv::RNG& rng, cv::Mat& out);
+
+/*
+ * k-means clustering of CV_32F samples (one sample per row).
+ *
+ * Centers are seeded with k-means++, where the distances to every new
+ * center are updated in parallel. Lloyd iterations assign the samples
+ * with the batched distance kernel (assignNearest, in parallel chunks)
+ * and sum every cluster over its members in sample order. Empty clusters
+ * are re-seeded with the sample farthest from its center. Every sum is
+ * taken in a fixed order, so a fixed seed gives bitwise the same centers
+ * whatever the number of threads.
+ *
+ * In mini-batch mode each step assigns miniBatch random samples and moves
+ * their centers with a per-center learning rate of 1/count, so a step
+ * costs O(miniBatch * K) whatever the number of samples. Seeding and the
+ * compactness of every attempt use random subsamples too, so the samples
+ * can stay on disk (SampleSource).
+ */
+class KMeans
+{
+private:
+    int K;
+    KMeansParams params;
+
+    void seedCenters(const cv::Mat& samples, cv::Mat& centers,
+                     cv::RNG& rng);
+    double lloyd(const cv::Mat& samples, cv::Mat& centers,
+                 std::vector<int>& labels);
+    bool miniBatch(SampleSource& samples, cv::Mat& centers, cv::RNG& rng);
+    double fitMiniBatch(SampleSource& samples, cv::Mat& centers,
+                        cv::RNG& rng);
+
+public:
+    KMeans(int K, const KMeansParams& params = KMeansParams());
+
+    /*
+     * Clusters samples into K centers (K x samples.cols, CV_32F).
+     * labels, if not NULL, receives the center of every sample.
+     * Returns the compactness: sum of squared distances to the centers;
+     * in mini-batch mode without labels, an estimate from a subsample.
+     */
+    double fit(const cv::Mat& samples, cv::Mat& centers,
+               std::vector<int>* labels = NULL);
+
+    /*
+     * Mini-batch clustering (params.miniBatch > 0) of samples that are
+     * read as needed. Returns the estimated compactness, or -1 if the
+     * samples cannot be read.
+     */
+    double fit(SampleSource& samples, cv::Mat& centers);
+};
+
+/*
+ * Assigns samples to centers in parallel chunks of assignNearest.
+ * Returns the sum of the squared distances.
+ */
+double assignParallel(const cv::Mat& samples, const cv::Mat& centers,
+                      int* labels, double* distances);
+
+#endif
@@ -0,0 +1,548 @@
+#include "knn.hpp"
+#include "nearest.hpp"
+#include "profile.hpp"
+#include <algorithm>
+#include <functional>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define KNN_X86 1
+#endif
+
+// Training rows scored against every query of a chunk before moving on;
+// 256 rows of a 150-word histogram are 300 KB, which stays in L2.
+static const int TRAIN_BLOCK = 256;
+// Queries handed to one parallel work item by nearestBatch.
+static const int QUERY_CHUNK = 32;
+// Largest fraction of non-zero training bins buildIndex indexes: a
+// scattered posting update costs several times one lane of the SIMD
+// intersection, so denser postings are slower than a scan.
+static const double MAX_INDEX_DENSITY = 0.25;
+
+/* ------------------------- histogram intersection ------------------------ */
+
+static double intersectScalar(const double* a, const double* b, int n)
+{
+    double s = 0;
+    for (int j = 0; j < n; j++)
+        s += std::min(a[j], b[j]);
+    return s;
+}
+
+#ifdef KNN_X86
+__attribute__((target("avx2")))
+static double intersectAVX2(const double* a, const double* b, int n)
+{
+    // Two accumulators hide the latency of the adds.
+    __m256d acc0 = _mm256_setzero_pd();
+    __m256d acc1 = _mm256_setzero_pd();
+    int j = 0;
+    for (; j + 8 <= n; j += 8)
+    {
+        acc0 = _mm256_add_pd(acc0, _mm256_min_pd(_mm256_loadu_pd(a + j),
+                                                 _mm256_loadu_pd(b + j)));
+        acc1 = _mm256_add_pd(acc1, _mm256_min_pd(_mm256_loadu_pd(a + j + 4),
+                                                 _mm256_loadu_pd(b + j + 4)));
+    }
+    for (; j + 4 <= n; j += 4)
+        acc0 = _mm256_add_pd(acc0, _mm256_min_pd(_mm256_loadu_pd(a + j),
+                                                 _mm256_loadu_pd(b + j)));
+    alignas(32) double lanes[4];
+    _mm256_store_pd(lanes, _mm256_add_pd(acc0, acc1));
+    double s = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    for (; j < n; j++)
+        s += std::min(a[j], b[j]);
+    return s;
+}
+
+__attribute__((target("avx512f")))
+static double intersectAVX512(const double* a, const double* b, int n)
+{
+    __m512d acc0 = _mm512_setzero_pd();
+    __m512d acc1 = _mm512_setzero_pd();
+    int j = 0;
+    for (; j + 16 <= n; j += 16)
+    {
+        acc0 = _mm512_add_pd(acc0, _mm512_min_pd(_mm512_loadu_pd(a + j),
+                                                 _mm512_loadu_pd(b + j)));
+        acc1 = _mm512_add_pd(acc1, _mm512_min_pd(_mm512_loadu_pd(a + j + 8),
+                                                 _mm512_loadu_pd(b + j + 8)));
+    }
+    if (j < n)
+    {
+        // The remaining 1..15 elements, with masked loads.
+        __mmask8 m = n - j >= 8 ? 0xFF : (__mmask8)((1u << (n - j)) - 1);
+        acc0 = _mm512_add_pd(acc0, _mm512_min_pd(
+                   _mm512_maskz_loadu_pd(m, a + j),
+                   _mm512_maskz_loadu_pd(m, b + j)));
+        j += 8;
+        if (j < n)
+        {
+            m = (__mmask8)((1u << (n - j)) - 1);
+            acc1 = _mm512_add_pd(acc1, _mm512_min_pd(
+                       _mm512_maskz_loadu_pd(m, a + j),
+                       _mm512_maskz_loadu_pd(m, b + j)));
+        }
+    }
+    return _mm512_reduce_add_pd(_mm512_add_pd(acc0, acc1));
+}
+#endif
+
+typedef double (*IntersectFn)(const double*, const double*, int);
+
+static IntersectFn selectIntersect()
+{
+#ifdef KNN_X86
+    SimdLevel level = detectSimd();
+    if (level == SIMD_AVX512)
+        return intersectAVX512;
+    if (level == SIMD_AVX2)
+        return intersectAVX2;
+#endif
+    return intersectScalar;
+}
+
+/* ------------------------------ top-k heap ------------------------------- */
+
+struct Neighbor
+{
+    double similarity;
+    int index;
+};
+
+// True if a ranks before b.
+static inline bool closer(const Neighbor& a, const Neighbor& b)
+{
+    return a.similarity > b.similarity
+           || (a.similarity == b.similarity && a.index < b.index);
+}
+
+/*
+ * The k closest neighbours seen so far. With closer() as the ordering the
+ * heap front is the worst one kept, so a candidate only costs a comparison
+ * unless it displaces it.
+ */
+class TopK
+{
+private:
+    int k;
+    std::vector<Neighbor> heap;
+
+public:
+    explicit TopK(int k) : k(k)
+    {
+        heap.reserve(k);
+    }
+
+    void push(double similarity, int index)
+    {
+        Neighbor n = {similarity, index};
+        if ((int)heap.size() < k)
+        {
+            heap.push_back(n);
+            std::push_heap(heap.begin(), heap.end(), closer);
+        }
+        else if (k > 0 && closer(n, heap.front()))
+        {
+            std::pop_heap(heap.begin(), heap.end(), closer);
+            heap.back() = n;
+            std::push_heap(heap.begin(), heap.end(), closer);
+        }
+    }
+
+    void sorted(std::vector<int>& indices, std::vector<double>* similarities)
+    {
+        std::sort_heap(heap.begin(), heap.end(), closer);
+        indices.resize(heap.size());
+        for (size_t i = 0; i < heap.size(); i++)
+            indices[i] = heap[i].index;
+        if (similarities)
+        {
+            similarities->resize(heap.size());
+            for (size_t i = 0; i < heap.size(); i++)
+                (*similarities)[i] = heap[i].similarity;
+        }
+    }
+};
+
+/* ----------------------------- KnnClassifier ----------------------------- */
+
+KnnClassifier::KnnClassifier() : numClasses(0), indexed(false)
+{
+}
+
+bool KnnClassifier::setTrainingSet(const cv::Mat& histograms,
+                                   const std::vector<int>& labels)
+{
+    training.release();
+    this->labels.clear();
+    numClasses = 0;
+    indexed = false;
+    postingStart.clear();
+    postingRows.clear();
+    postingValues.clear();
+    if (histograms.rows != (int)labels.size()
+        || std::find_if(labels.begin(), labels.end(),
+                        [](int label) { return label < 1; }) != labels.end())
+        return false;
+
+    if (histograms.type() == CV_64F && histograms.isContinuous())
+        training = histograms;
+    else
+        histograms.convertTo(training, CV_64F);
+    this->labels = labels;
+
+    for (size_t i = 0; i < labels.size(); i++)
+        numClasses = std::max(numClasses, labels[i]);
+    return true;
+}
+
+bool KnnClassifier::buildIndex(const KnnIndexParams& params)
+{
+    int N = training.rows;
+    int dims = training.cols;
+    indexed = false;
+
+    // Counts the postings of every word, then fills them in row order, so
+    // every list is sorted by training index.
+    postingStart.assign(dims + 1, 0);
+    for (int i = 0; i < N; i++)
+    {
+        const double* x = training.ptr<double>(i);
+        for (int j = 0; j < dims; j++)
+            if (x[j] > 0)
+                postingStart[j + 1]++;
+    }
+    for (int j = 0; j < dims; j++)
+        postingStart[j + 1] += postingStart[j];
+    if (postingStart[dims] > MAX_INDEX_DENSITY * N * dims)
+    {
+        postingStart.clear();
+        return false;
+    }
+
+    postingRows.resize(postingStart[dims]);
+    postingValues.resize(postingStart[dims]);
+    std::vector<int> next(postingStart.begin(), postingStart.end() - 1);
+    for (int i = 0; i < N; i++)
+    {
+        const double* x = training.ptr<double>(i);
+        for (int j = 0; j < dims; j++)
+        {
+            if (x[j] > 0)
+            {
+                postingRows[next[j]] = i;
+                postingValues[next[j]] = x[j];
+                next[j]++;
+            }
+        }
+    }
+
+    indexParams = params;
+    indexed = true;
+    return true;
+}
+
+bool KnnClassifier::hasIndex() const
+{
+    return indexed;
+}
+
+int KnnClassifier::size() const
+{
+    return training.rows;
+}
+
+int KnnClassifier::getNumClasses() const
+{
+    return numClasses;
+}
+
+// Query rows as CV_64F, shared when they already are.
+static cv::Mat asDouble(const cv::Mat& m)
+{
+    if (m.depth() == CV_64F)
+        return m;
+    cv::Mat converted;
+    m.convertTo(converted, CV_64F);
+    return converted;
+}
+
+void KnnClassifier::nearest(const cv::Mat& h, int k, std::vector<int>& indices,
+                            std::vector<double>* similarities) const
+{
+    if (!indexed)
+    {
+        bruteForce(h, k, indices, similarities);
+        return;
+    }
+    CV_Assert(h.total() == (size_t)training.cols);
+    cv::Mat q = asDouble(h.isContinuous() ? h : h.clone());
+    searchIndex(q.ptr<double>(0), k, indices, similarities);
+}
+
+void KnnClassifier::bruteForce(const cv::Mat& h, int k,
+                               std::vector<int>& indices,
+                               std::vector<double>* similarities) const
+{
+    CV_Assert(h.total() == (size_t)training.cols);
+
+    static const IntersectFn intersect = selectIntersect();
+    cv::Mat q = asDouble(h.isContinuous() ? h : h.clone());
+    const double* x = q.ptr<double>(0);
+    int dims = training.cols;
+
+    TopK top(std::min(k, training.rows));
+    for (int i = 0; i < training.rows; i++)
+        top.push(intersect(x, training.ptr<double>(i), dims), i);
+    top.sorted(indices, similarities);
+}
+
+/*
+ * Index search. Postings of the query bins are accumulated largest bin
+ * first until queryMass of the query has been scanned; since
+ * min(q_j, x_j) <= q_j, a row can gain at most the unscanned mass. The
+ * rerank rows with the best partial scores are then rescored with the
+ * dense kernel, which makes the exact mode return the brute-force result.
+ *
+ * The same bound ends the scan early: once the k-th best partial score
+ * of the shortlist exceeds the best partial score outside it plus the
+ * unscanned mass, no further bin can bring another row into the k best.
+ * The check costs O(touched rows), so it runs each time the unscanned
+ * mass halves.
+ */
+void KnnClassifier::searchIndex(const double* x, int k,
+                                std::vector<int>& indices,
+                                std::vector<double>* similarities) const
+{
+    static const IntersectFn intersect = selectIntersect();
+    // Per-thread accumulators, kept at zero between queries so that only
+    // the touched rows are reset.
+    static thread_local std::vector<double> scores;
+    static thread_local std::vector<int> touched;
+
+    int N = training.rows;
+    int dims = training.cols;
+    if ((int)scores.size() < N)
+        scores.assign(N, 0);
+
+    std::vector<std::pair<double, int> > bins;
+    double total = 0;
+    for (int j = 0; j < dims; j++)
+    {
+        if (x[j] > 0)
+        {
+            bins.push_back(std::make_pair(x[j], j));
+            total += x[j];
+        }
+    }
+    std::sort(bins.begin(), bins.end(),
+              std::greater<std::pair<double, int> >());
+
+    k = std::min(k, N);
+    size_t shortlist = std::max(k, indexParams.rerank);
+    std::vector<double>& s = scores;
+    auto better = [&s](int a, int b) {
+        return s[a] > s[b] || (s[a] == s[b] && a < b);
+    };
+
+    bool exact = indexParams.queryMass >= 1;
+    double budget = indexParams.queryMass * total;
+    double scanned = 0;
+    double nextCheck = total / 2;
+    // Slack for the rounding of the partial sums.
+    double eps = 1e-12 * total;
+    for (size_t b = 0; b < bins.size(); b++)
+    {
+        if (!exact && scanned >= budget)
+            break;
+        double q = bins[b].first;
+        int j = bins[b].second;
+        for (int p = postingStart[j]; p < postingStart[j + 1]; p++)
+        {
+            int i = postingRows[p];
+            if (scores[i] == 0)
+                touched.push_back(i);
+            scores[i] += std::min(q, postingValues[p]);
+        }
+        scanned += q;
+
+        double unscanned = total - scanned;
+        if (unscanned > nextCheck || b + 1 == bins.size()
+            || touched.size() < (size_t)k)
+            continue;
+        nextCheck = unscanned / 2;
+        // Best partial score outside the shortlist; untouched rows are 0.
+        double outside = 0;
+        size_t inside = std::min(shortlist, touched.size());
+        if (touched.size() > shortlist)
+        {
+            std::nth_element(touched.begin(), touched.begin() + shortlist,
+                             touched.end(), better);
+            outside = scores[touched[shortlist]];
+        }
+        std::nth_element(touched.begin(), touched.begin() + (k - 1),
+                         touched.begin() + inside, better);
+        if (scores[touched[k - 1]] > outside + unscanned + eps)
+            break;
+    }
+
+    if (touched.size() > shortlist)
+        std::nth_element(touched.begin(), touched.begin() + shortlist,
+                         touched.end(), better);
+
+    TopK top(k);
+    for (size_t t = 0; t < std::min(shortlist, touched.size()); t++)
+    {
+        int i = touched[t];
+        top.push(intersect(x, training.ptr<double>(i), dims), i);
+    }
+    // Fewer than k rows share a bin with the query: the rest of the
+    // neighbours have similarity 0, lowest index first.
+    int missing = k - (int)std::min(shortlist, touched.size());
+    for (int i = 0; i < N && missing > 0; i++)
+    {
+        if (scores[i] == 0)
+        {
+            top.push(0, i);
+            missing--;
+        }
+    }
+
+    for (size_t t = 0; t < touched.size(); t++)
+        scores[touched[t]] = 0;
+    touched.clear();
+
+    top.sorted(indices, similarities);
+}
+
+double KnnClassifier::recall(const cv::Mat& queries, int k) const
+{
+    double found = 0;
+    int total = 0;
+
+    #pragma omp parallel for schedule(dynamic) reduction(+:found, total)
+    for (int r = 0; r < queries.rows; r++)
+    {
+        std::vector<int> truth, result;
+        bruteForce(queries.row(r), k, truth);
+        nearest(queries.row(r), k, result);
+        std::sort(result.begin(), result.end());
+        for (size_t i = 0; i < truth.size(); i++)
+            if (std::binary_search(result.begin(), result.end(), truth[i]))
+                found++;
+        total += (int)truth.size();
+    }
+    return total > 0 ? found / total : 1.0;
+}
+
+void KnnClassifier::nearestBatch(const cv::Mat& queries, int k,
+                                 std::vector<std::vector<int> >& indices) const
+{
+    CV_Assert(queries.cols == training.cols);
+
+    static const IntersectFn intersect = selectIntersect();
+    cv::Mat q = asDouble(queries);
+    int N = training.rows;
+    int dims = training.cols;
+    int numChunks = (q.rows + QUERY_CHUNK - 1) / QUERY_CHUNK;
+    k = std::min(k, N);
+    indices.assign(q.rows, std::vector<int>());
+
+    if (indexed)
+    {
+        // The index has no training blocks to share: queries are
+        // independent.
+        #pragma omp parallel for schedule(dynamic)
+        for (int r = 0; r < q.rows; r++)
+            searchIndex(q.ptr<double>(r), k, indices[r], NULL);
+        return;
+    }
+
+    #pragma omp parallel for schedule(dynamic)
+    for (int c = 0; c < numChunks; c++)
+    {
+        int q0 = c * QUERY_CHUNK;
+        int q1 = std::min(q0 + QUERY_CHUNK, q.rows);
+        std::vector<TopK> top(q1 - q0, TopK(k));
+
+        for (int t0 = 0; t0 < N; t0 += TRAIN_BLOCK)
+        {
+            int t1 = std::min(t0 + TRAIN_BLOCK, N);
+            for (int r = q0; r < q1; r++)
+            {
+                const double* x = q.ptr<double>(r);
+                TopK& best = top[r - q0];
+                for (int i = t0; i < t1; i++)
+                    best.push(intersect(x, training.ptr<double>(i), dims), i);
+            }
+        }
+
+        for (int r = q0; r < q1; r++)
+            top[r - q0].sorted(indices[r], NULL);
+    }
+}
+
+int KnnClassifier::vote(const std::vector<int>& indices,
+                        std::vector<int>* votes) const
+{
+    // No neighbour: an empty training set or k < 1. There is no label to
+    // return, and 0 would index the confusion matrix of callers at -1.
+    CV_Assert(!indices.empty());
+    // Labels are within [1, numClasses] (setTrainingSet).
+    std::vector<int> counter(numClasses + 1, 0);
+    for (size_t i = 0; i < indices.size(); i++)
+        counter[labels[indices[i]]]++;
+
+    int best = 0;
+    for (int label = 1; label <= numClasses; label++)
+        if (counter[label] > counter[best])
+            best = label;
+
+    if (votes)
+        votes->swap(counter);
+    return best;
+}
+
+double voteMargin(const std::vector<int>& votes)
+{
+    int first = 0, second = 0, total = 0;
+    for (size_t label = 0; label < votes.size(); label++)
+    {
+        total += votes[label];
+        if (votes[label] > first)
+        {
+            second = first;
+            first = votes[label];
+        }
+        else if (votes[label] > second)
+        {
+            second = votes[label];
+        }
+    }
+    return total > 0 ? (double)(first - second) / total : 0;
+}
+
+int KnnClassifier::classify(const cv::Mat& h, int k,
+                            std::vector<int>* votes) const
+{
+    ProfileTimer timer(PROFILE_KNN, 1);
+    std::vector<int> indices;
+    nearest(h, k, indices);
+    return vote(indices, votes);
+}
+
+void KnnClassifier::classifyBatch(const cv::Mat& queries, int k,
+                                  std::vector<int>& predicted,
+                                  std::vector<std::vector<int> >* votes) const
+{
+    ProfileTimer timer(PROFILE_KNN, queries.rows);
+    std::vector<std::vector<int> > indices;
+    nearestBatch(queries, k, indices);
+
+    predicted.resize(indices.size());
+    if (votes)
+        votes->resize(indices.size());
+    for (size_t i = 0; i < indices.size(); i++)
+        predicted[i] = vote(indices[i], votes ? &(*votes)[i] : NULL);
+}
@@ -0,0 +1,132 @@
+#ifndef KNN_H_
+#define KNN_H_
+
+#include <opencv2/opencv.hpp>
+#include <vector>
+
+/*
+ * Parameters of the inverted index of KnnClassifier.
+ */
+struct KnnIndexParams
+{
+    double queryMass; // fraction of the query mass whose bins are scanned;
+                      // 1 (default) is exact, smaller is approximate
+    int rerank;       // candidates rescored exactly, at least k
+
+    KnnIndexParams() : queryMass(1.0), rerank(64) {}
+};
+
+/*
+ * k-nearest-neighbour search under histogram intersection
+ * (sum_j min(a_j, b_j), larger is closer).
+ *
+ * The training histograms are kept as one contiguous CV_64F matrix, one
+ * histogram per row. Every similarity is a single SIMD min/add pass over
+ * two rows, and the k best are kept in a bounded heap, so a query costs
+ * O(N * dims + N log k) with no allocation per training row.
+ *
+ * Neighbours are ordered by decreasing similarity; equal similarities go
+ * to the lower training index.
+ *
+ * buildIndex() adds an inverted file over the visual words: for every word,
+ * the training rows with a non-zero bin and its value. A query then only
+ * touches the postings of its own non-zero bins, largest bins first,
+ * until the unscanned query mass can no longer change the k best, and
+ * the best partial scores are rescored with the dense kernel. This pays
+ * off on sparse histograms (vocabulary trees, large dictionaries); the
+ * histograms of a flat dictionary of a few hundred words have nearly all
+ * bins set, and get no index.
+ */
+class KnnClassifier
+{
+private:
+    cv::Mat training;        // N x dims, CV_64F, continuous
+    std::vector<int> labels; // label of every training row
+    int numClasses;          // largest label
+
+    // Inverted file: the postings of word j are the entries
+    // [postingStart[j], postingStart[j+1]) of postingRows/postingValues.
+    bool indexed;
+    KnnIndexParams indexParams;
+    std::vector<int> postingStart;
+    std::vector<int> postingRows;
+    std::vector<double> postingValues;
+
+public:
+    KnnClassifier();
+
+    /*
+     * Uses histograms (N x dims) with their labels, within [1, numClasses],
+     * as the training set. A continuous CV_64F matrix is shared (e.g. a
+     * memory-mapped model); anything else is converted. Returns false,
+     * leaving the training set empty, if there is not one label per row
+     * or a label is below 1: labels index the vote counters.
+     */
+    bool setTrainingSet(const cv::Mat& histograms,
+                        const std::vector<int>& labels);
+
+    /*
+     * Builds the inverted index; nearest() and everything built on it use
+     * the index from then on. setTrainingSet() drops it. Returns false,
+     * without an index, when more than a quarter of the training bins
+     * are non-zero: the postings would be slower than the scan.
+     */
+    bool buildIndex(const KnnIndexParams& params = KnnIndexParams());
+    bool hasIndex() const;
+
+    int size() const;
+    int getNumClasses() const;
+
+    /*
+     * Indices of the k training histograms most similar to h (1 x dims),
+     * most similar first. similarities, if not NULL, receives their
+     * intersections.
+     */
+    void nearest(const cv::Mat& h, int k, std::vector<int>& indices,
+                 std::vector<double>* similarities = NULL) const;
+
+    /*
+     * nearest() by a scan of every training row, ignoring the index.
+     */
+    void bruteForce(const cv::Mat& h, int k, std::vector<int>& indices,
+                    std::vector<double>* similarities = NULL) const;
+
+    /*
+     * Mean fraction of the brute-force k nearest neighbours of every row
+     * of queries that nearest() also returns.
+     */
+    double recall(const cv::Mat& queries, int k) const;
+
+    /*
+     * nearest() for every row of queries in one pass. The training set is
+     * scanned in blocks that stay in cache while every query of a chunk is
+     * scored against them; chunks of queries run in parallel.
+     */
+    void nearestBatch(const cv::Mat& queries, int k,
+                      std::vector<std::vector<int> >& indices) const;
+
+    /*
+     * Majority vote of the k nearest neighbours; ties go to the smallest
+     * label. votes, if not NULL, receives the count of every label
+     * (numClasses+1 entries, index 0 unused). k must be at least 1 and
+     * the training set non-empty (asserted).
+     */
+    int classify(const cv::Mat& h, int k, std::vector<int>* votes = NULL) const;
+    void classifyBatch(const cv::Mat& queries, int k,
+                       std::vector<int>& predicted,
+                       std::vector<std::vector<int> >* votes = NULL) const;
+
+private:
+    void searchIndex(const double* x, int k, std::vector<int>& indices,
+                     std::vector<double>* similarities) const;
+    int vote(const std::vector<int>& indices, std::vector<int>* votes) const;
+};
+
+/*
+ * Confidence of a vote, as returned by classify: (votes of the winner -
+ * votes of the runner-up) / all votes, within [0, 1]. With k = 5, a 5-0
+ * vote scores 1, 4-1 0.6, 3-1-1 0.4 and 3-2 0.2.
+ */
+double voteMargin(const std::vector<int>& votes);
+
+#endif
@@ -0,0 +1,342 @@
+#include "model.hpp"
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char MAGIC[4] = {'B', 'O', 'W', 'M'};
+static const unsigned VERSION = 1;
+static const size_t ALIGN = 64;
+
+struct ModelHeader
+{
+    char magic[4];
+    unsigned version;
+    unsigned numSections;
+    unsigned reserved;
+};
+
+struct SectionEntry
+{
+    unsigned id;
+    int type;
+    unsigned rows;
+    unsigned cols;
+    unsigned long long offset;
+    unsigned long long bytes;
+};
+
+/*
+ * Whether type is the one section id is written with: the dictionary and
+ * the tree centers in the depth of the filterbank, histograms in either
+ * floating point depth, labels and tree nodes as CV_32S, the filterbank
+ * parameters as CV_64F. All single-channel.
+ */
+static bool validType(unsigned id, int type)
+{
+    switch (id)
+    {
+    case Model::LABELS:
+    case Model::TREE_NODES:
+        return type == CV_32S;
+    case Model::SCALES:
+    case Model::GAUSSIAN_SIGMAS:
+    case Model::LOG_SIGMAS:
+    case Model::DGAUSSIAN_SIGMAS:
+        return type == CV_64F;
+    default:
+        return type == CV_32F || type == CV_64F;
+    }
+}
+
+// Largest filter sigma accepted from a file, after scaling (the kernels
+// are 6 sigmas wide).
+static const double MAX_FILTER_SIGMA = 256;
+
+/*
+ * Whether the filterbank parameter sections build filters with positive,
+ * finite sigmas of bounded size, and 3 responses per filter for every
+ * one of numResponses dictionary dimensions (see FilterBank::initialize).
+ */
+static bool validFilterBank(const cv::Mat& scales, const cv::Mat& gaussians,
+                            const cv::Mat& logs, const cv::Mat& dGaussians,
+                            int numResponses)
+{
+    const cv::Mat* sigmas[3] = {&gaussians, &logs, &dGaussians};
+    double maxSigma = 0;
+    for (int i = 0; i < 3; i++)
+    {
+        const cv::Mat& m = *sigmas[i];
+        for (size_t j = 0; j < m.total(); j++)
+        {
+            double s = m.ptr<double>(0)[j];
+            if (!(s > 0) || !std::isfinite(s))
+                return false;
+            maxSigma = std::max(maxSigma, s);
+        }
+    }
+    for (size_t j = 0; j < scales.total(); j++)
+    {
+        double scale = scales.ptr<double>(0)[j];
+        if (!std::isfinite(scale)
+            || maxSigma * pow(sqrt(2.), scale) > MAX_FILTER_SIGMA)
+            return false;
+    }
+
+    // Sections are bounded by the mapping, so perScale does not overflow;
+    // the product is checked before it is taken.
+    size_t perScale = gaussians.total() + logs.total()
+                      + 2 * dGaussians.total();
+    if (perScale == 0 || scales.total() > (size_t)INT_MAX / perScale)
+        return false;
+    return 3 * perScale * scales.total() == (size_t)numResponses;
+}
+
+/*
+ * Words of a valid tree, as the dictionary must count them.
+ */
+static int treeWords(const cv::Mat& centers, const cv::Mat& nodes)
+{
+    VocabularyTree tree;
+    tree.set(centers, nodes, centers.depth()); // shares the mapping
+    return tree.getNumWords();
+}
+
+static size_t alignUp(size_t n)
+{
+    return (n + ALIGN - 1) / ALIGN * ALIGN;
+}
+
+/*
+ * Copies a vector into a 1 x n matrix (empty if the vector is).
+ */
+template <typename T>
+static cv::Mat rowMat(const std::vector<T>& v)
+{
+    if (v.empty())
+        return cv::Mat();
+    return cv::Mat(v, true).reshape(1, 1);
+}
+
+Model::Model() : mapping(NULL), mappingSize(0), sections(NUM_SECTIONS)
+{
+}
+
+Model::~Model()
+{
+    close();
+}
+
+void Model::close()
+{
+    sections.assign(NUM_SECTIONS, cv::Mat());
+    if (mapping)
+        munmap(mapping, mappingSize);
+    mapping = NULL;
+    mappingSize = 0;
+}
+
+void Model::swap(Model& other)
+{
+    std::swap(mapping, other.mapping);
+    std::swap(mappingSize, other.mappingSize);
+    sections.swap(other.sections);
+}
+
+bool Model::open(const std::string& path)
+{
+    close();
+
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(ModelHeader))
+    {
+        ::close(fd);
+        return false;
+    }
+    mappingSize = st.st_size;
+    mapping = mmap(NULL, mappingSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (mapping == MAP_FAILED)
+    {
+        mapping = NULL;
+        return false;
+    }
+
+    const char* base = (const char*)mapping;
+    const ModelHeader* header = (const ModelHeader*)base;
+    size_t tableEnd = sizeof(ModelHeader)
+                      + (size_t)header->numSections * sizeof(SectionEntry);
+    if (memcmp(header->magic, MAGIC, 4) != 0 || header->version != VERSION
+        || tableEnd > mappingSize)
+    {
+        close();
+        return false;
+    }
+
+    const SectionEntry* table = (const SectionEntry*)(base
+                                                      + sizeof(ModelHeader));
+    for (unsigned i = 0; i < header->numSections; i++)
+    {
+        const SectionEntry& e = table[i];
+        if (e.id >= NUM_SECTIONS)
+            continue; // written by a newer version
+        // Empty sections (e.g. the tree of a flat dictionary) carry the
+        // type of an empty Mat.
+        bool empty = e.rows == 0 || e.cols == 0;
+        if ((!empty && !validType(e.id, e.type))
+            || e.rows > INT_MAX || e.cols > INT_MAX)
+        {
+            close();
+            return false;
+        }
+        // bytes == rows * cols * elemSize, checked without overflow: the
+        // file is not trusted.
+        unsigned long long rowBytes = (unsigned long long)e.rows
+                                      * CV_ELEM_SIZE(e.type);
+        bool sized = empty ? e.bytes == 0
+                           : e.bytes % rowBytes == 0
+                             && e.bytes / rowBytes == e.cols;
+        if (!sized || e.offset % ALIGN != 0 || e.offset > mappingSize
+            || e.bytes > mappingSize - e.offset)
+        {
+            close();
+            return false;
+        }
+        if (e.rows > 0 && e.cols > 0)
+            sections[e.id] = cv::Mat(e.rows, e.cols, e.type,
+                                     (void*)(base + e.offset));
+    }
+
+    const cv::Mat& words = sections[DICTIONARY];
+    const cv::Mat& norms = sections[CENTER_NORMS];
+    const cv::Mat& treeNodes = sections[TREE_NODES];
+    if (words.empty() || sections[HISTOGRAMS].empty()
+        || sections[LABELS].total() != (size_t)sections[HISTOGRAMS].rows
+        || sections[HISTOGRAMS].cols != words.rows
+        || (!norms.empty() && norms.total() != (size_t)words.rows)
+        || (!treeNodes.empty()
+            && (treeNodes.cols != 3 // first child, children, word
+                || sections[TREE_CENTERS].rows != treeNodes.rows
+                || sections[TREE_CENTERS].cols != words.cols
+                || !VocabularyTree::isValid(sections[TREE_CENTERS],
+                                            treeNodes)
+                || treeWords(sections[TREE_CENTERS], treeNodes)
+                   != words.rows))
+        || !validFilterBank(sections[SCALES], sections[GAUSSIAN_SIGMAS],
+                            sections[LOG_SIGMAS], sections[DGAUSSIAN_SIGMAS],
+                            words.cols))
+    {
+        close();
+        return false;
+    }
+    return true;
+}
+
+bool Model::save(const std::string& path, const FilterBank& filterbank,
+                 const Dictionary& dictionary,
+                 const cv::Mat& histograms,
+                 const std::vector<int>& labels)
+{
+    std::vector<double> params[4];
+    filterbank.getParams(params[0], params[1], params[2], params[3]);
+
+    std::vector<cv::Mat> mats(NUM_SECTIONS);
+    mats[DICTIONARY] = dictionary.getWords();
+    mats[CENTER_NORMS] = dictionary.getCenterNorms();
+    mats[HISTOGRAMS] = histograms;
+    mats[LABELS] = rowMat(labels);
+    mats[SCALES] = rowMat(params[0]);
+    mats[GAUSSIAN_SIGMAS] = rowMat(params[1]);
+    mats[LOG_SIGMAS] = rowMat(params[2]);
+    mats[DGAUSSIAN_SIGMAS] = rowMat(params[3]);
+    mats[TREE_CENTERS] = dictionary.getTree().getCenters();
+    mats[TREE_NODES] = dictionary.getTree().getNodes();
+
+    ModelHeader header;
+    memcpy(header.magic, MAGIC, 4);
+    header.version = VERSION;
+    header.numSections = NUM_SECTIONS;
+    header.reserved = 0;
+
+    std::vector<SectionEntry> table(NUM_SECTIONS);
+    size_t offset = alignUp(sizeof(ModelHeader)
+                            + NUM_SECTIONS * sizeof(SectionEntry));
+    for (int i = 0; i < NUM_SECTIONS; i++)
+    {
+        if (!mats[i].isContinuous())
+            mats[i] = mats[i].clone();
+        table[i].id = i;
+        table[i].type = mats[i].type();
+        table[i].rows = mats[i].rows;
+        table[i].cols = mats[i].cols;
+        table[i].offset = offset;
+        table[i].bytes = mats[i].total() * mats[i].elemSize();
+        offset = alignUp(offset + table[i].bytes);
+    }
+
+    std::ofstream out(path.c_str(), std::ios::binary);
+    if (!out.is_open())
+        return false;
+    out.write((const char*)&header, sizeof(header));
+    out.write((const char*)&table[0], NUM_SECTIONS * sizeof(SectionEntry));
+
+    static const char zeros[ALIGN] = {0};
+    size_t written = sizeof(header) + NUM_SECTIONS * sizeof(SectionEntry);
+    for (int i = 0; i < NUM_SECTIONS; i++)
+    {
+        out.write(zeros, table[i].offset - written);
+        if (table[i].bytes > 0)
+            out.write((const char*)mats[i].ptr(), table[i].bytes);
+        written = table[i].offset + table[i].bytes;
+    }
+    return out.good();
+}
+
+const cv::Mat& Model::get(Section id) const
+{
+    return sections[id];
+}
+
+static std::vector<double> toVector(const cv::Mat& m)
+{
+    if (m.empty())
+        return std::vector<double>();
+    const double* p = m.ptr<double>(0);
+    return std::vector<double>(p, p + m.total());
+}
+
+FilterBank Model::getFilterBank(int depth) const
+{
+    std::vector<double> scales = toVector(sections[SCALES]);
+    std::vector<double> gaussianSigmas = toVector(sections[GAUSSIAN_SIGMAS]);
+    std::vector<double> logSigmas = toVector(sections[LOG_SIGMAS]);
+    std::vector<double> dGaussianSigmas = toVector(sections[DGAUSSIAN_SIGMAS]);
+    return FilterBank(scales, gaussianSigmas, logSigmas, dGaussianSigmas,
+                      depth);
+}
+
+void Model::loadDictionary(Dictionary& dictionary, int depth) const
+{
+    dictionary.setWords(sections[DICTIONARY], sections[CENTER_NORMS], depth);
+    if (!sections[TREE_NODES].empty())
+    {
+        VocabularyTree tree;
+        tree.set(sections[TREE_CENTERS], sections[TREE_NODES], depth);
+        dictionary.setTree(tree);
+    }
+}
+
+void Model::getLabels(std::vector<int>& labels) const
+{
+    const int* p = sections[LABELS].ptr<int>(0);
+    labels.assign(p, p + sections[LABELS].total());
+}
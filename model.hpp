@@ -0,0 +1,94 @@
+#ifndef MODEL_H_
+#define MODEL_H_
+
+#include <opencv2/opencv.hpp>
+#include <string>
+#include <vector>
+
+#include "bow.hpp"
+
+/*
+ * Single-file binary model: the dictionary, its precomputed centroid
+ * norms and vocabulary tree, the training histograms and labels, and the
+ * filterbank parameters.
+ *
+ * File layout (native byte order, little endian on every supported host):
+ *     header      magic "BOWM", uint32 version, uint32 numSections,
+ *                 uint32 reserved
+ *     sections    numSections entries of
+ *                 { uint32 id, int32 type, uint32 rows, uint32 cols,
+ *                   uint64 offset, uint64 bytes }
+ *     data        the matrices, each starting on a 64-byte boundary
+ *
+ * open() maps the file with mmap and the matrices point straight into the
+ * mapping, so loading copies nothing and pages are read on first use.
+ * The mapped matrices are read-only.
+ */
+class Model
+{
+private:
+    void* mapping;
+    size_t mappingSize;
+    std::vector<cv::Mat> sections;
+
+    Model(const Model&);            // not copyable: owns the mapping
+    Model& operator=(const Model&);
+
+public:
+    enum Section
+    {
+        DICTIONARY = 0,
+        CENTER_NORMS,
+        HISTOGRAMS,
+        LABELS,
+        SCALES,
+        GAUSSIAN_SIGMAS,
+        LOG_SIGMAS,
+        DGAUSSIAN_SIGMAS,
+        TREE_CENTERS,   // vocabulary tree, empty for a flat dictionary
+        TREE_NODES,
+        NUM_SECTIONS
+    };
+
+    Model();
+    ~Model();
+
+    /*
+     * Maps a model file. Returns false if it is missing or malformed.
+     */
+    bool open(const std::string& path);
+    void close();
+
+    /*
+     * Exchanges the mappings of two models, e.g. to replace a model only
+     * once its successor has been opened and checked.
+     */
+    void swap(Model& other);
+
+    /*
+     * Writes a model file. labels holds one label per histogram row.
+     */
+    static bool save(const std::string& path, const FilterBank& filterbank,
+                     const Dictionary& dictionary,
+                     const cv::Mat& histograms,
+                     const std::vector<int>& labels);
+
+    const cv::Mat& get(Section id) const;
+
+    /*
+     * Builds the filterbank stored in the model, with responses of the
+     * given depth.
+     */
+    FilterBank getFilterBank(int depth = CV_32F) const;
+
+    /*
+     * Points dictionary at the mapped words, norms and tree (they are only
+     * copied if depth differs from the stored one).
+     */
+    void loadDictionary(Dictionary& dictionary, int depth = CV_32F) const;
+
+    const cv::Mat& getHistograms() const { return get(HISTOGRAMS); }
+    void getLabels(std::vector<int>& labels) const;
+};
+
+#endif
@@ -0,0 +1,396 @@
+#include "nearest.hpp"
+#include "workspace.hpp"
+#include <algorithm>
+#include <limits>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define NEAREST_X86 1
+#endif
+
+void computeCenterNorms(const cv::Mat& centers, cv::Mat& norms)
+{
+    cv::Mat sq = centers.mul(centers);
+    cv::reduce(sq, norms, 1, cv::REDUCE_SUM);
+    norms = norms.reshape(1, 1);
+}
+
+/*
+ * labels[i] = argmin_k (scores(i,k) + norms[k]). If distances is not NULL,
+ * it receives ||x_i||^2 + the minimum, clamped at 0.
+ */
+template <typename T>
+static void argminRows(const cv::Mat& scores, const cv::Mat& norms,
+                       const cv::Mat& samples, int* labels,
+                       double* distances)
+{
+    const T* cn = norms.ptr<T>(0);
+    int K = scores.cols;
+    for (int i = 0; i < scores.rows; i++)
+    {
+        const T* s = scores.ptr<T>(i);
+        T best = s[0] + cn[0];
+        int word = 0;
+        for (int k = 1; k < K; k++)
+        {
+            T d = s[k] + cn[k];
+            if (d < best)
+            {
+                best = d;
+                word = k;
+            }
+        }
+        labels[i] = word;
+
+        if (distances)
+        {
+            const T* x = samples.ptr<T>(i);
+            double xx = 0;
+            for (int j = 0; j < samples.cols; j++)
+                xx += (double)x[j] * x[j];
+            distances[i] = std::max(xx + best, 0.0);
+        }
+    }
+}
+
+void assignNearest(const cv::Mat& samples, const cv::Mat& centers,
+                   const cv::Mat& centerNorms, int* labels,
+                   double* distances, int tileRows)
+{
+    CV_Assert(samples.cols == centers.cols);
+    CV_Assert(samples.depth() == centers.depth());
+    CV_Assert(centerNorms.total() == (size_t)centers.rows);
+
+    // Scores of one tile: -2 * x.c for every sample/center pair. The
+    // buffer is the thread's (this never forks tasks), reused by every
+    // tile and every call.
+    Workspace& scratch = threadWorkspace();
+    for (int r0 = 0; r0 < samples.rows; r0 += tileRows)
+    {
+        int r1 = std::min(r0 + tileRows, samples.rows);
+        cv::Mat tile = samples.rowRange(r0, r1);
+        cv::Mat scores = scratch.buffer(WS_SCORES, r1 - r0, centers.rows,
+                                        samples.depth());
+        cv::gemm(tile, centers, -2.0, cv::noArray(), 0, scores, cv::GEMM_2_T);
+
+        double* tileDistances = distances ? distances + r0 : NULL;
+        if (samples.depth() == CV_32F)
+            argminRows<float>(scores, centerNorms, tile, labels + r0,
+                              tileDistances);
+        else
+            argminRows<double>(scores, centerNorms, tile, labels + r0,
+                               tileDistances);
+    }
+}
+
+/* ----------------------- per-sample nearest center ----------------------- */
+
+// Dimensions processed between two early-exit tests.
+static const int EXIT_CHECK = 8;
+
+static SimdLevel queryCpu()
+{
+#ifdef NEAREST_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        return SIMD_AVX512;
+    if (__builtin_cpu_supports("avx2"))
+        return SIMD_AVX2;
+#endif
+    return SIMD_SCALAR;
+}
+
+SimdLevel detectSimd()
+{
+    static const SimdLevel level = queryCpu();
+    return level;
+}
+
+/*
+ * Lane scan at the end of a block: same strict comparison as the scalar
+ * loop, so the lowest index wins a tie.
+ */
+template <typename T>
+static inline void scanLanes(const T* dist, int base, int lanes, T& best,
+                             int& word)
+{
+    for (int l = 0; l < lanes; l++)
+    {
+        if (dist[l] < best)
+        {
+            best = dist[l];
+            word = base + l;
+        }
+    }
+}
+
+template <typename T>
+static int nearestScalar(const T* x, const T* blocks, int numBlocks,
+                         int dims, int W)
+{
+    T best = std::numeric_limits<T>::infinity();
+    int word = 0;
+    T acc[16];
+    for (int b = 0; b < numBlocks; b++)
+    {
+        const T* c = blocks + (size_t)b*dims*W;
+        for (int l = 0; l < W; l++)
+            acc[l] = 0;
+
+        bool alive = true;
+        for (int j = 0; j < dims && alive; )
+        {
+            int end = std::min(j + EXIT_CHECK, dims);
+            for (; j < end; j++)
+            {
+                for (int l = 0; l < W; l++)
+                {
+                    T diff = x[j] - c[j*W + l];
+                    acc[l] += diff*diff;
+                }
+            }
+            alive = false;
+            for (int l = 0; l < W; l++)
+                alive = alive || acc[l] <= best;
+        }
+        if (alive)
+            scanLanes(acc, b*W, W, best, word);
+    }
+    return word;
+}
+
+#ifdef NEAREST_X86
+__attribute__((target("avx2")))
+static int nearestAVX2(const float* x, const float* blocks, int numBlocks,
+                       int dims)
+{
+    const int W = 8;
+    float best = std::numeric_limits<float>::infinity();
+    int word = 0;
+    alignas(32) float dist[W];
+    for (int b = 0; b < numBlocks; b++)
+    {
+        const float* c = blocks + (size_t)b*dims*W;
+        __m256 acc = _mm256_setzero_ps();
+        __m256 vbest = _mm256_set1_ps(best);
+        bool alive = true;
+        for (int j = 0; j < dims && alive; )
+        {
+            int end = std::min(j + EXIT_CHECK, dims);
+            for (; j < end; j++)
+            {
+                __m256 d = _mm256_sub_ps(_mm256_set1_ps(x[j]),
+                                         _mm256_load_ps(c + j*W));
+                acc = _mm256_add_ps(acc, _mm256_mul_ps(d, d));
+            }
+            alive = _mm256_movemask_ps(
+                        _mm256_cmp_ps(acc, vbest, _CMP_LE_OQ)) != 0;
+        }
+        if (alive)
+        {
+            _mm256_store_ps(dist, acc);
+            scanLanes(dist, b*W, W, best, word);
+        }
+    }
+    return word;
+}
+
+__attribute__((target("avx2")))
+static int nearestAVX2(const double* x, const double* blocks, int numBlocks,
+                       int dims)
+{
+    const int W = 4;
+    double best = std::numeric_limits<double>::infinity();
+    int word = 0;
+    alignas(32) double dist[W];
+    for (int b = 0; b < numBlocks; b++)
+    {
+        const double* c = blocks + (size_t)b*dims*W;
+        __m256d acc = _mm256_setzero_pd();
+        __m256d vbest = _mm256_set1_pd(best);
+        bool alive = true;
+        for (int j = 0; j < dims && alive; )
+        {
+            int end = std::min(j + EXIT_CHECK, dims);
+            for (; j < end; j++)
+            {
+                __m256d d = _mm256_sub_pd(_mm256_set1_pd(x[j]),
+                                          _mm256_load_pd(c + j*W));
+                acc = _mm256_add_pd(acc, _mm256_mul_pd(d, d));
+            }
+            alive = _mm256_movemask_pd(
+                        _mm256_cmp_pd(acc, vbest, _CMP_LE_OQ)) != 0;
+        }
+        if (alive)
+        {
+            _mm256_store_pd(dist, acc);
+            scanLanes(dist, b*W, W, best, word);
+        }
+    }
+    return word;
+}
+
+__attribute__((target("avx512f")))
+static int nearestAVX512(const float* x, const float* blocks, int numBlocks,
+                         int dims)
+{
+    const int W = 16;
+    float best = std::numeric_limits<float>::infinity();
+    int word = 0;
+    alignas(64) float dist[W];
+    for (int b = 0; b < numBlocks; b++)
+    {
+        const float* c = blocks + (size_t)b*dims*W;
+        __m512 acc = _mm512_setzero_ps();
+        __m512 vbest = _mm512_set1_ps(best);
+        bool alive = true;
+        for (int j = 0; j < dims && alive; )
+        {
+            int end = std::min(j + EXIT_CHECK, dims);
+            for (; j < end; j++)
+            {
+                __m512 d = _mm512_sub_ps(_mm512_set1_ps(x[j]),
+                                         _mm512_load_ps(c + j*W));
+                acc = _mm512_add_ps(acc, _mm512_mul_ps(d, d));
+            }
+            alive = _mm512_cmp_ps_mask(acc, vbest, _CMP_LE_OQ) != 0;
+        }
+        if (alive)
+        {
+            _mm512_store_ps(dist, acc);
+            scanLanes(dist, b*W, W, best, word);
+        }
+    }
+    return word;
+}
+
+__attribute__((target("avx512f")))
+static int nearestAVX512(const double* x, const double* blocks,
+                         int numBlocks, int dims)
+{
+    const int W = 8;
+    double best = std::numeric_limits<double>::infinity();
+    int word = 0;
+    alignas(64) double dist[W];
+    for (int b = 0; b < numBlocks; b++)
+    {
+        const double* c = blocks + (size_t)b*dims*W;
+        __m512d acc = _mm512_setzero_pd();
+        __m512d vbest = _mm512_set1_pd(best);
+        bool alive = true;
+        for (int j = 0; j < dims && alive; )
+        {
+            int end = std::min(j + EXIT_CHECK, dims);
+            for (; j < end; j++)
+            {
+                __m512d d = _mm512_sub_pd(_mm512_set1_pd(x[j]),
+                                          _mm512_load_pd(c + j*W));
+                acc = _mm512_add_pd(acc, _mm512_mul_pd(d, d));
+            }
+            alive = _mm512_cmp_pd_mask(acc, vbest, _CMP_LE_OQ) != 0;
+        }
+        if (alive)
+        {
+            _mm512_store_pd(dist, acc);
+            scanLanes(dist, b*W, W, best, word);
+        }
+    }
+    return word;
+}
+#endif
+
+TransposedCenters::TransposedCenters()
+    : offset(0), K(0), dims(0), depth(CV_32F), isa(SIMD_SCALAR), lanes(1)
+{
+}
+
+template <typename T>
+static void transposeBlocks(const cv::Mat& centers, T* dst, int lanes)
+{
+    int K = centers.rows;
+    int dims = centers.cols;
+    int numBlocks = (K + lanes - 1) / lanes;
+    for (int b = 0; b < numBlocks; b++)
+    {
+        for (int l = 0; l < lanes; l++)
+        {
+            // Padding lanes repeat the last center; they can never win
+            // because the real one has a lower index.
+            const T* c = centers.ptr<T>(std::min(b*lanes + l, K - 1));
+            for (int j = 0; j < dims; j++)
+                dst[((size_t)b*dims + j)*lanes + l] = c[j];
+        }
+    }
+}
+
+void TransposedCenters::create(const cv::Mat& centers)
+{
+    CV_Assert(centers.depth() == CV_32F || centers.depth() == CV_64F);
+    // nearest() clamps the padding lanes to K - 1.
+    CV_Assert(centers.rows > 0);
+
+    K = centers.rows;
+    dims = centers.cols;
+    depth = centers.depth();
+    isa = detectSimd();
+    bool isFloat = depth == CV_32F;
+    if (isa == SIMD_AVX512)
+        lanes = isFloat ? 16 : 8;
+    else
+        lanes = isFloat ? 8 : 4;
+
+    const size_t ALIGN = 64;
+    size_t elemSize = isFloat ? sizeof(float) : sizeof(double);
+    int numBlocks = (K + lanes - 1) / lanes;
+    size_t bytes = (size_t)numBlocks * dims * lanes * elemSize;
+    buffer.create(1, (int)(bytes + ALIGN), CV_8U);
+    offset = (ALIGN - (size_t)buffer.ptr() % ALIGN) % ALIGN;
+
+    if (isFloat)
+        transposeBlocks(centers, (float*)data(), lanes);
+    else
+        transposeBlocks(centers, (double*)data(), lanes);
+}
+
+const char* TransposedCenters::kernelName() const
+{
+    if (isa == SIMD_AVX512)
+        return "avx512";
+    if (isa == SIMD_AVX2)
+        return "avx2";
+    return "scalar";
+}
+
+int TransposedCenters::nearest(const float* x) const
+{
+    CV_Assert(depth == CV_32F);
+    const float* blocks = (const float*)data();
+    int numBlocks = (K + lanes - 1) / lanes;
+    int word;
+#ifdef NEAREST_X86
+    if (isa == SIMD_AVX512)
+        word = nearestAVX512(x, blocks, numBlocks, dims);
+    else if (isa == SIMD_AVX2)
+        word = nearestAVX2(x, blocks, numBlocks, dims);
+    else
+#endif
+        word = nearestScalar(x, blocks, numBlocks, dims, lanes);
+    return std::min(word, K - 1);
+}
+
+int TransposedCenters::nearest(const double* x) const
+{
+    CV_Assert(depth == CV_64F);
+    const double* blocks = (const double*)data();
+    int numBlocks = (K + lanes - 1) / lanes;
+    int word;
+#ifdef NEAREST_X86
+    if (isa == SIMD_AVX512)
+        word = nearestAVX512(x, blocks, numBlocks, dims);
+    else if (isa == SIMD_AVX2)
+        word = nearestAVX2(x, blocks, numBlocks, dims);
+    else
+#endif
+        word = nearestScalar(x, blocks, numBlocks, dims, lanes);
+    return std::min(word, K - 1);
+}
@@ -0,0 +1,92 @@
+#ifndef NEAREST_H_
+#define NEAREST_H_
+
+#include <opencv2/opencv.hpp>
+
+/*
+ * Computes ||c||^2 for every row c of centers.
+ * norms is a 1 x centers.rows matrix of the same depth as centers.
+ */
+void computeCenterNorms(const cv::Mat& centers, cv::Mat& norms);
+
+/*
+ * Assigns every row of samples to its nearest center (squared L2).
+ *
+ * Distances are expanded as ||x||^2 - 2 x.c + ||c||^2. The samples are
+ * processed in tiles of tileRows rows; for each tile the cross terms come
+ * from one matrix multiply (cv::gemm) against the centers, and the argmin
+ * only needs the precomputed centerNorms since ||x||^2 is constant along
+ * a row. Ties go to the center with the lowest index.
+ *
+ * samples and centers must share their depth (CV_32F or CV_64F).
+ * labels must hold samples.rows ints. If distances is not NULL, it
+ * receives the squared distance of every sample to its center.
+ */
+void assignNearest(const cv::Mat& samples, const cv::Mat& centers,
+                   const cv::Mat& centerNorms, int* labels,
+                   double* distances = NULL, int tileRows = 256);
+
+/*
+ * Widest SIMD instruction set supported by the CPU, detected once at
+ * runtime. Kernels compiled for AVX2/AVX-512 are only called when the
+ * corresponding level is available.
+ */
+enum SimdLevel { SIMD_SCALAR = 0, SIMD_AVX2 = 1, SIMD_AVX512 = 2 };
+SimdLevel detectSimd();
+
+/*
+ * Centers rearranged for the per-sample nearest-center kernel.
+ *
+ * The centers are split into blocks of lanes() centers (the SIMD width of
+ * the selected kernel) and each block is stored dimension-major:
+ *     data[(b*dims + j)*lanes + l] = centers(b*lanes + l, j)
+ * so one aligned vector load fetches dimension j of a whole block. The
+ * last block is padded with copies of the last center. Storage is 64-byte
+ * aligned.
+ *
+ * The kernel (AVX-512, AVX2 or scalar) is chosen at runtime from the CPU
+ * features. Every kernel accumulates (x_j - c_j)^2 in the same order and
+ * precision as the plain scalar loop, without FMA, and abandons a block as
+ * soon as the partial distance of all its centers exceeds the best one.
+ * The result is therefore the same label as the scalar loop, including
+ * ties (lowest index wins).
+ */
+class TransposedCenters
+{
+private:
+    cv::Mat buffer;     // raw storage, data starts at offset
+    size_t offset;
+    int K;
+    int dims;
+    int depth;          // CV_32F or CV_64F
+    int isa;            // kernel selected at runtime
+    int lanes;
+
+    const void* data() const { return buffer.ptr() + offset; }
+
+public:
+    TransposedCenters();
+
+    /*
+     * Builds the layout from a K x dims matrix of CV_32F or CV_64F,
+     * K > 0. A default-constructed instance is empty().
+     */
+    void create(const cv::Mat& centers);
+
+    bool empty() const { return K == 0; }
+    int getLanes() const { return lanes; }
+
+    /*
+     * Name of the selected kernel: "avx512", "avx2" or "scalar".
+     */
+    const char* kernelName() const;
+
+    /*
+     * Index of the nearest center to x, which holds dims values of the
+     * same depth as the centers.
+     */
+    int nearest(const float* x) const;
+    int nearest(const double* x) const;
+};
+
+#endif
@@ -0,0 +1,116 @@
+#include "pipeline.hpp"
+#include "cache.hpp"
+#include "profile.hpp"
+#include "scheduler.hpp"
+#include <atomic>
+#include <fstream>
+#include <memory>
+#include <thread>
+
+/*
+ * Whole file into bytes. Returns false if it cannot be read.
+ */
+static bool readFile(const std::string& path, std::vector<uchar>& bytes)
+{
+    std::ifstream in(path.c_str(), std::ios::binary | std::ios::ate);
+    if (!in.is_open())
+        return false;
+    std::streamsize size = in.tellg();
+    ProfileTimer timer(PROFILE_READ, (double)size);
+    in.seekg(0);
+    bytes.resize(size);
+    return size == 0 || in.read((char*)&bytes[0], size).good();
+}
+
+void runPipeline(const std::vector<std::string>& paths,
+                 const std::string& dir, const PipelineParams& params,
+                 const PipelineStage& compute, const PipelineStage& output)
+{
+    int numItems = (int)paths.size();
+    int numReaders = std::max(params.readers, 1);
+    int numWriters = output ? std::max(params.writers, 1) : 0;
+
+    TaskScheduler scheduler(params.workers);
+    TaskGroup images(scheduler);
+    BoundedQueue<PipelineItem> computed(params.queueSize);
+    std::atomic<int> next(0);
+
+    // Images decoded but not computed yet: readers wait while every
+    // worker is busy and queueSize more are ready.
+    std::mutex flightLock;
+    std::condition_variable flightDone;
+    int inFlight = 0;
+    int maxInFlight = scheduler.getNumThreads()
+                      + std::max(params.queueSize, 1);
+
+    // One task per image; the filtering and assignment inside fork finer
+    // tasks, which workers left without an image steal.
+    auto computeTask = [&](std::shared_ptr<PipelineItem> item) {
+        setProfileThreadName("worker");
+        setProfileImage(item->index);
+        compute(*item);
+        item->image.release();
+        if (output)
+            computed.push(std::move(*item));
+        std::lock_guard<std::mutex> guard(flightLock);
+        inFlight--;
+        flightDone.notify_one();
+    };
+
+    std::vector<std::thread> readers, writers;
+    for (int t = 0; t < numReaders; t++)
+    {
+        readers.push_back(std::thread([&] {
+            setProfileThreadName("reader");
+            std::vector<uchar> bytes;
+            for (int i = next++; i < numItems; i = next++)
+            {
+                setProfileImage(i);
+                PipelineItem item;
+                item.index = i;
+                item.contentHash = 0;
+                if (readFile(dir + paths[i], bytes) && !bytes.empty())
+                {
+                    if (params.hashContent)
+                        item.contentHash = hashBytes(&bytes[0],
+                                                     bytes.size());
+                    ProfileTimer timer(PROFILE_DECODE);
+                    item.image = cv::imdecode(bytes, cv::IMREAD_COLOR);
+                    timer.setWork(item.image.total());
+                }
+                if (item.image.empty())
+                    profileCount("unreadable images");
+                {
+                    std::unique_lock<std::mutex> guard(flightLock);
+                    flightDone.wait(guard, [&] {
+                        return inFlight < maxInFlight;
+                    });
+                    inFlight++;
+                }
+                std::shared_ptr<PipelineItem> task =
+                    std::make_shared<PipelineItem>(std::move(item));
+                images.run([&computeTask, task] { computeTask(task); });
+            }
+        }));
+    }
+    for (int t = 0; t < numWriters; t++)
+    {
+        writers.push_back(std::thread([&] {
+            setProfileThreadName("writer");
+            PipelineItem item;
+            while (computed.pop(item))
+            {
+                setProfileImage(item.index);
+                output(item);
+            }
+        }));
+    }
+
+    // Each stage is closed once every thread feeding it has finished.
+    for (size_t t = 0; t < readers.size(); t++)
+        readers[t].join();
+    images.wait();
+    computed.close();
+    for (size_t t = 0; t < writers.size(); t++)
+        writers[t].join();
+}
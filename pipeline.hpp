@@ -0,0 +1,133 @@
+#ifndef PIPELINE_H_
+#define PIPELINE_H_
+
+#include <opencv2/opencv.hpp>
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/*
+ * FIFO shared by the threads of two stages. push() blocks while the queue
+ * is full, so a fast stage cannot run ahead of a slow one by more than
+ * capacity items.
+ */
+template <typename T>
+class BoundedQueue
+{
+private:
+    std::mutex lock;
+    std::condition_variable notEmpty;
+    std::condition_variable notFull;
+    std::deque<T> items;
+    size_t capacity;
+    bool closed;
+
+public:
+    explicit BoundedQueue(size_t capacity)
+        : capacity(std::max(capacity, (size_t)1)), closed(false) {}
+
+    /*
+     * Returns false, dropping item, if the queue has been closed.
+     */
+    bool push(T item)
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        notFull.wait(guard, [this] {
+            return items.size() < capacity || closed;
+        });
+        if (closed)
+            return false;
+        items.push_back(std::move(item));
+        notEmpty.notify_one();
+        return true;
+    }
+
+    /*
+     * Blocks until an item is available. Returns false once the queue is
+     * closed and drained.
+     */
+    bool pop(T& item)
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        notEmpty.wait(guard, [this] { return !items.empty() || closed; });
+        if (items.empty())
+            return false;
+        item = std::move(items.front());
+        items.pop_front();
+        notFull.notify_one();
+        return true;
+    }
+
+    /*
+     * No more pushes; pop() drains what is left.
+     */
+    void close()
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        closed = true;
+        notEmpty.notify_all();
+        notFull.notify_all();
+    }
+};
+
+/*
+ * Concurrency of every stage of runPipeline.
+ */
+struct PipelineParams
+{
+    int readers;      // threads reading and decoding images
+    int workers;      // threads of the compute stage's TaskScheduler,
+                      //   0: one per core
+    int writers;      // threads of the output stage
+    int queueSize;    // capacity of the queues between stages
+    bool hashContent; // fill PipelineItem::contentHash (see cache.hpp)
+
+    PipelineParams()
+        : readers(2), workers(0), writers(1), queueSize(16),
+          hashContent(false) {}
+};
+
+/*
+ * One image travelling through the pipeline.
+ */
+struct PipelineItem
+{
+    int index;          // position in the path list
+    uint64 contentHash; // hash of the image file, see hashContent
+    cv::Mat image;      // decoded BGR image, empty if it could not be read
+    cv::Mat wordmap;    // filled by the compute stage, as needed
+    cv::Mat histogram;
+};
+
+typedef std::function<void(PipelineItem&)> PipelineStage;
+
+/*
+ * Processes the images dir + paths[i] in three stages:
+ *
+ *     read      `readers` threads load and decode the images
+ *     compute   a work-stealing pool of `workers` threads runs
+ *               compute(item) as one task per image
+ *     output    `writers` threads call output(item), if given
+ *
+ * so disk or network reads overlap with the filtering and assignment.
+ * Readers stay at most queueSize images ahead of the pool, and the
+ * output stage is fed through a bounded queue. compute() may fork tasks
+ * of its own with parallelFor (see scheduler.hpp), as the filterbank and
+ * the word assignment do: workers without an image then take over parts
+ * of the images still running, so a few large images at the end of a
+ * list, or a list shorter than the pool, still use every worker.
+ * Items reach compute and output in no particular order; item.index says
+ * which image they are. The image is released between compute and
+ * output. Readers hash the encoded file when hashContent is set. Returns
+ * once every item has left the last stage.
+ */
+void runPipeline(const std::vector<std::string>& paths,
+                 const std::string& dir, const PipelineParams& params,
+                 const PipelineStage& compute,
+                 const PipelineStage& output = PipelineStage());
+
+#endif
@@ -0,0 +1,293 @@
+#include "profile.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Trace events kept per thread; 32 bytes each.
+static const size_t MAX_TRACE_EVENTS = 1 << 20;
+// Latency histogram: 16 buckets per power of two of nanoseconds.
+static const int SUB_BUCKETS = 16;
+static const int NUM_BUCKETS = 64 * SUB_BUCKETS;
+
+static const char* STAGE_NAMES[NUM_PROFILE_STAGES] = {
+    "read", "decode", "lab", "filter", "spectra", "kernel", "assign",
+    "histogram", "knn", "cache get", "cache put", "write"
+};
+static const char* STAGE_UNITS[NUM_PROFILE_STAGES] = {
+    "bytes", "pixels", "pixels", "pixels", "pixels", "pixels", "pixels",
+    "pixels", "queries", "hits", "bytes", "word maps"
+};
+
+/* Latencies of one (stage, detail) on one thread. */
+struct StageStats
+{
+    long long count;
+    long long totalNs;
+    long long maxNs;
+    double work;
+    std::vector<long long> buckets;
+
+    StageStats()
+        : count(0), totalNs(0), maxNs(0), work(0), buckets(NUM_BUCKETS, 0) {}
+};
+
+struct TraceEvent
+{
+    long long start; // ns since the profiler started
+    long long duration;
+    int stage;
+    int detail;
+    int image;
+};
+
+/* Everything one thread recorded; only that thread writes to it. */
+struct ThreadProfile
+{
+    int tid;
+    std::string name;
+    std::map<std::pair<int, int>, StageStats> stages;
+    std::vector<std::pair<const char*, double> > counters;
+    std::vector<TraceEvent> events;
+};
+
+static std::atomic<bool> enabled(false);
+static std::atomic<bool> tracing(false);
+static std::mutex registryLock;
+static std::vector<std::unique_ptr<ThreadProfile> > registry;
+static thread_local ThreadProfile* current = NULL;
+static thread_local int currentImage = -1;
+
+static long long now()
+{
+    static const std::chrono::steady_clock::time_point origin =
+        std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now() - origin).count();
+}
+
+/*
+ * Buffers of the calling thread, registered on first use. The registry
+ * owns them, so they outlive the thread until the profile is written.
+ */
+static ThreadProfile& threadProfile()
+{
+    if (current == NULL)
+    {
+        std::lock_guard<std::mutex> guard(registryLock);
+        registry.push_back(std::unique_ptr<ThreadProfile>(new ThreadProfile));
+        current = registry.back().get();
+        current->tid = (int)registry.size();
+    }
+    return *current;
+}
+
+static int bucketOf(long long ns)
+{
+    if (ns < SUB_BUCKETS)
+        return (int)std::max(ns, 0LL);
+    int e = 63 - __builtin_clzll((unsigned long long)ns); // >= 4
+    int m = (int)(ns >> (e - 4)) & (SUB_BUCKETS - 1);
+    return std::min((e - 3) * SUB_BUCKETS + m, NUM_BUCKETS - 1);
+}
+
+// Midpoint of the values falling into bucket b.
+static double bucketValue(int b)
+{
+    if (b < SUB_BUCKETS)
+        return b;
+    int e = b / SUB_BUCKETS + 3;
+    double low = (double)(SUB_BUCKETS + b % SUB_BUCKETS) * (1LL << (e - 4));
+    return low + (1LL << (e - 4)) / 2.0;
+}
+
+void enableProfiling(bool trace)
+{
+    now(); // fixes the origin of the trace
+    tracing = trace;
+    enabled = true;
+}
+
+bool profilingEnabled()
+{
+    return enabled.load(std::memory_order_relaxed);
+}
+
+ProfileTimer::ProfileTimer(ProfileStage stage, double work, int detail)
+    : stage(stage), detail(detail), work(work),
+      start(profilingEnabled() ? now() : -1)
+{
+}
+
+ProfileTimer::~ProfileTimer()
+{
+    if (start < 0)
+        return;
+    long long duration = now() - start;
+    ThreadProfile& p = threadProfile();
+
+    StageStats& s = p.stages[std::make_pair((int)stage, detail)];
+    s.count++;
+    s.totalNs += duration;
+    s.maxNs = std::max(s.maxNs, duration);
+    s.work += work;
+    s.buckets[bucketOf(duration)]++;
+
+    if (tracing.load(std::memory_order_relaxed)
+        && p.events.size() < MAX_TRACE_EVENTS)
+    {
+        TraceEvent e = {start, duration, stage, detail, currentImage};
+        p.events.push_back(e);
+    }
+}
+
+void profileCount(const char* name, double n)
+{
+    if (!profilingEnabled())
+        return;
+    std::vector<std::pair<const char*, double> >& counters =
+        threadProfile().counters;
+    for (size_t i = 0; i < counters.size(); i++)
+    {
+        if (strcmp(counters[i].first, name) == 0)
+        {
+            counters[i].second += n;
+            return;
+        }
+    }
+    counters.push_back(std::make_pair(name, n));
+}
+
+void setProfileImage(int index)
+{
+    currentImage = index;
+}
+
+int profileImage()
+{
+    return currentImage;
+}
+
+void setProfileThreadName(const std::string& name)
+{
+    if (profilingEnabled())
+        threadProfile().name = name;
+}
+
+// Value below which a fraction q of the events fall.
+static double percentile(const StageStats& s, double q)
+{
+    long long rank = (long long)(q * (s.count - 1)) + 1;
+    long long seen = 0;
+    for (int b = 0; b < NUM_BUCKETS; b++)
+    {
+        seen += s.buckets[b];
+        if (seen >= rank)
+            return std::min(bucketValue(b), (double)s.maxNs);
+    }
+    return (double)s.maxNs;
+}
+
+bool writeProfile(const std::string& path)
+{
+    FILE* out = fopen(path.c_str(), "w");
+    if (out == NULL)
+        return false;
+
+    std::lock_guard<std::mutex> guard(registryLock);
+    std::map<std::pair<int, int>, StageStats> merged;
+    std::map<std::string, double> counters;
+    for (size_t t = 0; t < registry.size(); t++)
+    {
+        const ThreadProfile& p = *registry[t];
+        for (std::map<std::pair<int, int>, StageStats>::const_iterator it =
+                 p.stages.begin(); it != p.stages.end(); ++it)
+        {
+            StageStats& m = merged[it->first];
+            const StageStats& s = it->second;
+            m.count += s.count;
+            m.totalNs += s.totalNs;
+            m.maxNs = std::max(m.maxNs, s.maxNs);
+            m.work += s.work;
+            for (int b = 0; b < NUM_BUCKETS; b++)
+                m.buckets[b] += s.buckets[b];
+        }
+        for (size_t i = 0; i < p.counters.size(); i++)
+            counters[p.counters[i].first] += p.counters[i].second;
+    }
+
+    fprintf(out, "{\"threads\": %d,\n \"stages\": [", (int)registry.size());
+    const char* sep = "\n";
+    for (std::map<std::pair<int, int>, StageStats>::const_iterator it =
+             merged.begin(); it != merged.end(); ++it)
+    {
+        const StageStats& s = it->second;
+        int stage = it->first.first;
+        fprintf(out, "%s  {\"stage\": \"%s\"", sep, STAGE_NAMES[stage]);
+        if (it->first.second >= 0)
+            fprintf(out, ", \"detail\": %d", it->first.second);
+        fprintf(out, ", \"count\": %lld, \"total_ms\": %.3f, "
+                "\"mean_us\": %.3f, \"p50_us\": %.3f, \"p95_us\": %.3f, "
+                "\"p99_us\": %.3f, \"max_us\": %.3f, \"work\": %.0f, "
+                "\"unit\": \"%s\", \"work_per_s\": %.6g}",
+                s.count, s.totalNs * 1e-6, s.totalNs * 1e-3 / s.count,
+                percentile(s, 0.50) * 1e-3, percentile(s, 0.95) * 1e-3,
+                percentile(s, 0.99) * 1e-3, s.maxNs * 1e-3, s.work,
+                STAGE_UNITS[stage],
+                s.totalNs > 0 ? s.work / (s.totalNs * 1e-9) : 0.0);
+        sep = ",\n";
+    }
+    fprintf(out, "\n ],\n \"counters\": {");
+    sep = "";
+    for (std::map<std::string, double>::const_iterator it = counters.begin();
+         it != counters.end(); ++it)
+    {
+        fprintf(out, "%s\"%s\": %.0f", sep, it->first.c_str(), it->second);
+        sep = ", ";
+    }
+    fprintf(out, "}}\n");
+    return fclose(out) == 0;
+}
+
+bool writeTrace(const std::string& path)
+{
+    FILE* out = fopen(path.c_str(), "w");
+    if (out == NULL)
+        return false;
+
+    std::lock_guard<std::mutex> guard(registryLock);
+    fprintf(out, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+    const char* sep = "\n";
+    for (size_t t = 0; t < registry.size(); t++)
+    {
+        const ThreadProfile& p = *registry[t];
+        if (!p.name.empty())
+        {
+            fprintf(out, "%s{\"name\": \"thread_name\", \"ph\": \"M\", "
+                    "\"pid\": 0, \"tid\": %d, \"args\": {\"name\": \"%s %d\"}}",
+                    sep, p.tid, p.name.c_str(), p.tid);
+            sep = ",\n";
+        }
+        for (size_t i = 0; i < p.events.size(); i++)
+        {
+            const TraceEvent& e = p.events[i];
+            fprintf(out, "%s{\"name\": \"%s", sep, STAGE_NAMES[e.stage]);
+            if (e.detail >= 0)
+                fprintf(out, " %d", e.detail);
+            fprintf(out, "\", \"ph\": \"X\", \"pid\": 0, \"tid\": %d, "
+                    "\"ts\": %.3f, \"dur\": %.3f", p.tid, e.start * 1e-3,
+                    e.duration * 1e-3);
+            if (e.image >= 0)
+                fprintf(out, ", \"args\": {\"image\": %d}", e.image);
+            fprintf(out, "}");
+            sep = ",\n";
+        }
+    }
+    fprintf(out, "\n]}\n");
+    return fclose(out) == 0;
+}
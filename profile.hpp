@@ -0,0 +1,99 @@
+#ifndef PROFILE_H_
+#define PROFILE_H_
+
+#include <string>
+
+/*
+ * Instrumented stages of the pipeline. Every timer belongs to one; the
+ * work it records is counted in the stage's unit.
+ */
+enum ProfileStage
+{
+    PROFILE_READ,       // reading an image file (bytes)
+    PROFILE_DECODE,     // decoding it (pixels)
+    PROFILE_LAB,        // BGR to Lab conversion (pixels)
+    PROFILE_FILTER,     // the whole filterbank (pixels)
+    PROFILE_SPECTRA,    // image spectra shared by the FFT kernels (pixels)
+    PROFILE_KERNEL,     // one kernel, detail: its index (pixels)
+    PROFILE_ASSIGN,     // word assignment (pixels)
+    PROFILE_HISTOGRAM,  // histogram of a word map (pixels)
+    PROFILE_KNN,        // kNN classification (queries)
+    PROFILE_CACHE_GET,  // word map cache lookups (hits)
+    PROFILE_CACHE_PUT,  // word map cache stores (bytes)
+    PROFILE_WRITE,      // writing results (word maps)
+    NUM_PROFILE_STAGES
+};
+
+/*
+ * Starts recording. Until then timers cost one relaxed atomic load. With
+ * trace, every timed interval is also kept for writeTrace() (at most
+ * 2^20 events per thread; later ones only reach the statistics).
+ */
+void enableProfiling(bool trace = false);
+bool profilingEnabled();
+
+/*
+ * Times the enclosing scope as one event of stage. work is the amount
+ * processed, in the unit of the stage; detail tells apart the instances
+ * of a stage (the kernel index of PROFILE_KERNEL), -1 if none.
+ *
+ * Each thread aggregates into its own buffers, so timers never take a
+ * lock once the thread's first event has registered them.
+ */
+class ProfileTimer
+{
+private:
+    ProfileStage stage;
+    int detail;
+    double work;
+    long long start; // ns, -1 when profiling is off
+
+public:
+    explicit ProfileTimer(ProfileStage stage, double work = 0,
+                          int detail = -1);
+    ~ProfileTimer();
+
+    void setWork(double work) { this->work = work; }
+
+    ProfileTimer(const ProfileTimer&) = delete;
+    ProfileTimer& operator=(const ProfileTimer&) = delete;
+};
+
+/*
+ * Adds n to the named counter of this thread (cache hits, unreadable
+ * images, ...). name must be a string literal or otherwise outlive the
+ * profile.
+ */
+void profileCount(const char* name, double n = 1);
+
+/*
+ * Image the calling thread is working on, attached to its trace events
+ * so one image can be followed across threads. -1: none.
+ */
+void setProfileImage(int index);
+int profileImage();
+
+/*
+ * Name of the calling thread in the trace ("reader", "worker", ...).
+ */
+void setProfileThreadName(const std::string& name);
+
+/*
+ * Per-stage statistics as JSON: number of events, total time, mean and
+ * p50/p95/p99/max latency (percentiles within 1/16 of an octave), work
+ * and throughput, then the counters. Returns false if path cannot be
+ * written.
+ *
+ * Both writers read the buffers of every thread, so they must only be
+ * called while no timer is running, e.g. once the pipeline has returned.
+ */
+bool writeProfile(const std::string& path);
+
+/*
+ * The recorded events in the Chrome trace event format, for
+ * chrome://tracing or Perfetto: one row per thread, one slice per timer,
+ * tagged with its image.
+ */
+bool writeTrace(const std::string& path);
+
+#endif
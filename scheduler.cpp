@@ -0,0 +1,247 @@
+#include "scheduler.hpp"
+#include "profile.hpp"
+#include <opencv2/opencv.hpp>
+#include <omp.h>
+#include <algorithm>
+#include <chrono>
+
+// Pool and slot of the calling thread, when it is a worker.
+static thread_local TaskScheduler* currentScheduler = NULL;
+static thread_local int currentWorker = -1;
+
+TaskScheduler::TaskScheduler(int numThreads)
+    : queued(0), stopping(false)
+{
+    if (numThreads <= 0)
+        numThreads = omp_get_num_procs();
+    for (int i = 0; i < numThreads; i++)
+        workers.push_back(std::unique_ptr<Worker>(new Worker));
+    for (int i = 0; i < numThreads; i++)
+        threads.push_back(std::thread(&TaskScheduler::workerLoop, this, i));
+}
+
+TaskScheduler::~TaskScheduler()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (size_t i = 0; i < threads.size(); i++)
+        threads[i].join();
+}
+
+int TaskScheduler::getNumThreads() const
+{
+    return (int)workers.size();
+}
+
+TaskScheduler* TaskScheduler::current()
+{
+    return currentScheduler;
+}
+
+TaskScheduler& TaskScheduler::global()
+{
+    static TaskScheduler scheduler;
+    return scheduler;
+}
+
+int TaskScheduler::workerIndex() const
+{
+    return currentScheduler == this ? currentWorker : -1;
+}
+
+void TaskScheduler::push(const Item& item)
+{
+    int self = workerIndex();
+    queued++;
+    if (self >= 0)
+    {
+        std::lock_guard<std::mutex> guard(workers[self]->lock);
+        workers[self]->tasks.push_back(item);
+    }
+    {
+        // Under the lock, so a worker between its check of queued and its
+        // wait cannot miss the notification.
+        std::lock_guard<std::mutex> guard(lock);
+        if (self < 0)
+            injected.push_back(item);
+    }
+    wake.notify_one();
+}
+
+/*
+ * Own deque from the back, then the shared queue unless !shared, then the
+ * other deques from the front. self is -1 for threads outside the pool,
+ * which only take from the shared queue.
+ */
+bool TaskScheduler::take(int self, Item& item, bool shared)
+{
+    if (queued.load() == 0)
+        return false;
+    if (self >= 0)
+    {
+        Worker& own = *workers[self];
+        std::lock_guard<std::mutex> guard(own.lock);
+        if (!own.tasks.empty())
+        {
+            item = own.tasks.back();
+            own.tasks.pop_back();
+            queued--;
+            return true;
+        }
+    }
+    if (shared)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (!injected.empty())
+        {
+            item = injected.front();
+            injected.pop_front();
+            queued--;
+            return true;
+        }
+    }
+    if (self < 0)
+        return false;
+    int n = (int)workers.size();
+    for (int k = 1; k < n; k++)
+    {
+        Worker& victim = *workers[(self + k) % n];
+        std::lock_guard<std::mutex> guard(victim.lock);
+        if (!victim.tasks.empty())
+        {
+            item = victim.tasks.front();
+            victim.tasks.pop_front();
+            queued--;
+            return true;
+        }
+    }
+    return false;
+}
+
+void TaskScheduler::run(Item& item)
+{
+    item.task();
+    item.task = std::function<void()>(); // release captures before finishing
+    item.group->finish();
+}
+
+void TaskScheduler::workerLoop(int self)
+{
+    currentScheduler = this;
+    currentWorker = self;
+    // Parallelism comes from the pool; OpenMP regions inside tasks (kNN
+    // batches, k-means assignment) would multiply the threads.
+    omp_set_num_threads(1);
+
+    for (;;)
+    {
+        Item item;
+        if (take(self, item))
+        {
+            run(item);
+            continue;
+        }
+        std::unique_lock<std::mutex> guard(lock);
+        wake.wait(guard, [this] { return stopping || queued.load() > 0; });
+        if (stopping && queued.load() == 0)
+            return;
+    }
+}
+
+TaskGroup::TaskGroup(TaskScheduler& scheduler)
+    : scheduler(scheduler), pending(0)
+{
+}
+
+TaskGroup::~TaskGroup()
+{
+    wait();
+}
+
+void TaskGroup::run(const std::function<void()>& task)
+{
+    pending++;
+    TaskScheduler::Item item = {task, this};
+    scheduler.push(item);
+}
+
+void TaskGroup::finish()
+{
+    // Under the lock: a waiter that saw pending reach zero may destroy the
+    // group as soon as it can take the lock.
+    std::lock_guard<std::mutex> guard(lock);
+    if (--pending == 0)
+        done.notify_all();
+}
+
+void TaskGroup::wait()
+{
+    int self = scheduler.workerIndex();
+    if (self < 0)
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        done.wait(guard, [this] { return pending.load() == 0; });
+        return;
+    }
+    // A worker keeps running subtasks, its own group's first since they
+    // sit at the back of its deque. New top-level tasks stay in the shared
+    // queue: one of them could keep the worker, and so this wait, busy for
+    // a whole image. It only naps when the tasks it waits for have all
+    // been stolen and are still running elsewhere.
+    while (pending.load() > 0)
+    {
+        TaskScheduler::Item item;
+        if (scheduler.take(self, item, false))
+        {
+            scheduler.run(item);
+            continue;
+        }
+        std::unique_lock<std::mutex> guard(lock);
+        done.wait_for(guard, std::chrono::microseconds(200),
+                      [this] { return pending.load() == 0; });
+    }
+    std::lock_guard<std::mutex> guard(lock); // the last finish() has returned
+}
+
+OpenCvThreadsOff::OpenCvThreadsOff()
+    : previous(cv::getNumThreads())
+{
+    cv::setNumThreads(1);
+}
+
+OpenCvThreadsOff::~OpenCvThreadsOff()
+{
+    cv::setNumThreads(previous);
+}
+
+void parallelFor(int begin, int end, int grain,
+                 const std::function<void(int, int)>& body)
+{
+    grain = std::max(grain, 1);
+    TaskScheduler* scheduler = TaskScheduler::current();
+    if (scheduler == NULL)
+        scheduler = &TaskScheduler::global();
+    if (end - begin <= grain || scheduler->getNumThreads() <= 1)
+    {
+        if (begin < end)
+            body(begin, end);
+        return;
+    }
+
+    int image = profileImage(); // stolen chunks still belong to this image
+    TaskGroup group(*scheduler);
+    for (int i = begin; i < end; i += grain)
+    {
+        int j = std::min(i + grain, end);
+        group.run([&body, i, j, image] {
+            int previous = profileImage();
+            setProfileImage(image);
+            body(i, j);
+            setProfileImage(previous);
+        });
+    }
+    group.wait();
+}
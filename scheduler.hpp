@@ -0,0 +1,142 @@
+#ifndef SCHEDULER_H_
+#define SCHEDULER_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class TaskGroup;
+
+/*
+ * Work-stealing thread pool. Every worker owns a deque: tasks forked by
+ * a worker go to the back of its own deque and it runs them newest first,
+ * while idle workers steal the oldest tasks of the others. Coarse tasks
+ * (whole images) thus spread over the pool, and the finer tasks they fork
+ * (kernels, row tiles) are picked up by whichever workers run dry, so one
+ * large image still keeps every core busy.
+ *
+ * Threads outside the pool submit through a shared queue and block while
+ * their tasks run. A worker waiting for its own tasks only runs subtasks
+ * (its own or stolen ones), never a new task from the shared queue, so a
+ * wait is not held up by a whole unrelated image. Workers run OpenMP
+ * regions single-threaded: the pool owns the cores, so nested parallel
+ * code must not start threads of its own. OpenCV's threading can only be
+ * set process-wide, which is left to the program (see OpenCvThreadsOff).
+ */
+class TaskScheduler
+{
+private:
+    struct Item
+    {
+        std::function<void()> task;
+        TaskGroup* group;
+    };
+    struct Worker
+    {
+        std::mutex lock;
+        std::deque<Item> tasks;
+    };
+
+    std::vector<std::unique_ptr<Worker> > workers;
+    std::vector<std::thread> threads;
+    std::mutex lock;               // guards injected, sleeping workers
+    std::condition_variable wake;
+    std::deque<Item> injected;     // from threads outside the pool
+    std::atomic<int> queued;       // tasks in all queues
+    bool stopping;
+
+    void push(const Item& item);
+    bool take(int self, Item& item, bool shared = true);
+    void run(Item& item);
+    void workerLoop(int self);
+    int workerIndex() const;
+
+    friend class TaskGroup;
+
+    TaskScheduler(const TaskScheduler&);
+    TaskScheduler& operator=(const TaskScheduler&);
+
+public:
+    /*
+     * Starts numThreads workers, 0: one per core.
+     */
+    explicit TaskScheduler(int numThreads = 0);
+    ~TaskScheduler();
+
+    int getNumThreads() const;
+
+    /*
+     * The pool the calling thread is a worker of, NULL outside any pool.
+     */
+    static TaskScheduler* current();
+
+    /*
+     * Process-wide pool (one worker per core), started on first use, for
+     * parallel work requested from outside any pool.
+     */
+    static TaskScheduler& global();
+};
+
+/*
+ * Tasks forked together on one scheduler. wait() returns once all of
+ * them have run; a worker of the pool runs queued tasks meanwhile instead
+ * of sleeping.
+ */
+class TaskGroup
+{
+private:
+    TaskScheduler& scheduler;
+    std::atomic<int> pending;
+    std::mutex lock;
+    std::condition_variable done;
+
+    void finish();
+
+    friend class TaskScheduler;
+
+    TaskGroup(const TaskGroup&);
+    TaskGroup& operator=(const TaskGroup&);
+
+public:
+    explicit TaskGroup(TaskScheduler& scheduler);
+    ~TaskGroup();
+
+    void run(const std::function<void()>& task);
+    void wait();
+};
+
+/*
+ * Turns OpenCV's own threading off (cv::setNumThreads(1)) for its
+ * lifetime and then restores the previous setting. The setting is
+ * process-wide, so the library never changes it: programs that run
+ * OpenCV inside pool tasks hold one in main, and an application
+ * embedding the library decides for itself.
+ */
+class OpenCvThreadsOff
+{
+private:
+    int previous;
+
+    OpenCvThreadsOff(const OpenCvThreadsOff&);
+    OpenCvThreadsOff& operator=(const OpenCvThreadsOff&);
+
+public:
+    OpenCvThreadsOff();
+    ~OpenCvThreadsOff();
+};
+
+/*
+ * Calls body(i0, i1) on the chunks [i0, i1) of [begin, end), at most
+ * grain long, in parallel on the pool of the calling thread (the global
+ * one outside any pool), and returns when all are done. Chunks must be
+ * independent.
+ */
+void parallelFor(int begin, int end, int grain,
+                 const std::function<void(int, int)>& body);
+
+#endif
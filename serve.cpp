@@ -0,0 +1,698 @@
+#include "classifier.hpp"
+#include "histogram.hpp"
+#include "profile.hpp"
+#include "scheduler.hpp"
+#include "workspace.hpp"
+
+#include <iostream>
+#include <fstream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <csignal>
+#include <omp.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+/*
+ * Long-running classifier. The model is loaded once; requests arrive on
+ * stdin or on a Unix domain socket, one per line:
+ *
+ *     path <file>        classify the image at <file>
+ *     bytes <n>          classify the encoded image (jpg, png, ...) in the
+ *                        n bytes that follow the newline
+ *
+ * Every request gets one response line, tagged with its position on the
+ * connection (0 for the first request) since workers may answer out of
+ * order:
+ *
+ *     <id> <label> <votes of label 1> ... <votes of label numClasses>
+ *     <id> error <message>
+ *
+ * Requests from all connections go to one queue. Each worker takes up to
+ * --batch of them at once (waiting at most --batch-wait ms for the batch
+ * to fill), computes their histograms and scores the whole batch against
+ * the training set in one kNN pass. With --cascade the batch is first
+ * scored from the coarse stage's histograms; only the requests whose
+ * vote margin falls below the threshold get full histograms, scored as a
+ * second, smaller batch.
+ *
+ * SIGINT or SIGTERM stops the server: it stops accepting, stops reading
+ * requests, answers the ones already queued, writes --profile and --trace
+ * and exits. A second signal kills it at once.
+ */
+
+/* One client: stdin/stdout, or both directions of a socket. */
+struct Connection
+{
+    int in;
+    int out;
+    std::mutex writeLock;
+    // Read buffer of the reader thread.
+    std::vector<char> buffer;
+    size_t begin;
+
+    Connection(int in, int out) : in(in), out(out), begin(0) {}
+    ~Connection()
+    {
+        if (in == out)
+            close(in);
+    }
+
+    bool readLine(string& line);
+    bool readBytes(size_t n, vector<uchar>& bytes);
+    void send(const string& line);
+
+private:
+    bool fill();
+};
+
+struct Request
+{
+    std::shared_ptr<Connection> connection;
+    long id;
+    string path;        // set for "path" requests
+    vector<uchar> data; // set for "bytes" requests
+};
+
+/* Requests waiting for a worker. */
+class RequestQueue
+{
+private:
+    std::mutex lock;
+    std::condition_variable ready;
+    std::deque<Request> requests;
+    bool closed;
+
+public:
+    RequestQueue() : closed(false) {}
+    void push(Request& request);
+    bool popBatch(vector<Request>& batch, int maxBatch, int waitMs);
+    void close();
+};
+
+/* Reader threads of the socket clients, joined before shutting down. */
+class Readers
+{
+private:
+    struct Reader
+    {
+        std::thread thread;
+        std::shared_ptr<std::atomic<bool> > done;
+    };
+    std::list<Reader> readers;
+
+public:
+    void start(std::shared_ptr<Connection> connection, RequestQueue& queue,
+               long maxBytes);
+    void reap();    // joins the readers of closed connections
+    void joinAll();
+};
+
+// Becomes readable when a stop signal arrives (self-pipe): readers and
+// the accept loop poll it along with their descriptor.
+static int stopPipe[2] = {-1, -1};
+
+/* Declaration of functions */
+void help();
+bool catchStopSignals();
+bool loadClassifier(BowClassifier& classifier, const char *modelPath);
+void readRequests(std::shared_ptr<Connection> connection,
+        RequestQueue& queue, long maxBytes);
+void worker(const BowClassifier& classifier, RequestQueue& queue,
+        int maxBatch, int waitMs);
+int listenOn(const char *socketPath);
+
+int main(int argc, char **argv)
+{
+    // The task pool owns the cores (see scheduler.hpp).
+    OpenCvThreadsOff openCvThreadsOff;
+
+    const char *modelPath = NULL;
+    const char *socketPath = NULL;
+    int numWorkers = omp_get_num_procs();
+    int maxBatch = 16;
+    int waitMs = 2;
+    int stripRows = 0;
+    const char *profilePath = NULL;
+    const char *tracePath = NULL;
+    ResolutionParams resolution;
+    bool cascade = false;
+    CascadeParams cascadeParams;
+    size_t workspaceMB = 0;
+    long maxBytes = 64L << 20;
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        if (arg == "--model" && i+1 < argc)
+            modelPath = argv[++i];
+        else if (arg == "--socket" && i+1 < argc)
+            socketPath = argv[++i];
+        else if (arg == "--workers" && i+1 < argc)
+            numWorkers = atoi(argv[++i]);
+        else if (arg == "--batch" && i+1 < argc)
+            maxBatch = atoi(argv[++i]);
+        else if (arg == "--batch-wait" && i+1 < argc)
+            waitMs = atoi(argv[++i]);
+        else if (arg == "--strip-rows" && i+1 < argc)
+            stripRows = atoi(argv[++i]);
+        else if (arg == "--profile" && i+1 < argc)
+            profilePath = argv[++i];
+        else if (arg == "--trace" && i+1 < argc)
+            tracePath = argv[++i];
+        else if (arg == "--max-side" && i+1 < argc)
+            resolution.maxSide = atoi(argv[++i]);
+        else if (arg == "--pyramid" && i+1 < argc)
+            resolution.pyramidLevels = atoi(argv[++i]);
+        else if (arg == "--stride" && i+1 < argc)
+            resolution.stride = atoi(argv[++i]);
+        else if (arg == "--max-bytes" && i+1 < argc)
+            maxBytes = atol(argv[++i]);
+        else if (arg == "--workspace-mb" && i+1 < argc)
+            workspaceMB = strtoull(argv[++i], NULL, 10);
+        else if (arg == "--cascade" && i+1 < argc)
+        {
+            cascade = true;
+            cascadeParams.minMargin = atof(argv[++i]);
+        }
+        else if (arg == "--coarse" && i+1 < argc)
+        {
+            ResolutionParams& c = cascadeParams.coarse;
+            if (sscanf(argv[++i], "%d,%d,%d", &c.maxSide, &c.pyramidLevels,
+                       &c.stride) != 3)
+            {
+                help();
+                return -1;
+            }
+        }
+        else
+        {
+            help();
+            return -1;
+        }
+    }
+    if (numWorkers < 1 || maxBatch < 1 || maxBytes < 1)
+    {
+        help();
+        return -1;
+    }
+    if (profilePath || tracePath)
+        enableProfiling(tracePath != NULL);
+
+    // Loaded once and shared by every worker.
+    BowClassifier classifier;
+    if (!loadClassifier(classifier, modelPath))
+        return -1;
+    classifier.setStripRows(stripRows);
+    classifier.setResolution(resolution);
+    if (cascade)
+        classifier.setCascade(cascadeParams);
+    setWorkspaceLimit(workspaceMB << 20);
+    // A client closing its socket early must not kill the server.
+    signal(SIGPIPE, SIG_IGN);
+    if (!catchStopSignals())
+    {
+        cerr << "Error installing the signal handlers" << endl;
+        return -1;
+    }
+
+    RequestQueue queue;
+    vector<std::thread> workers;
+    for (int i = 0; i < numWorkers; i++)
+        workers.push_back(std::thread(worker, std::cref(classifier),
+                                      std::ref(queue), maxBatch, waitMs));
+    cerr << "Serving with " << numWorkers << " workers, batches of up to "
+         << maxBatch << endl;
+
+    if (socketPath == NULL)
+    {
+        // stdin mode: serves until end of input.
+        readRequests(std::make_shared<Connection>(0, 1), queue, maxBytes);
+    }
+    else
+    {
+        int server = listenOn(socketPath);
+        if (server < 0)
+        {
+            cerr << "Error listening on " << socketPath << endl;
+            queue.close();
+            for (size_t i = 0; i < workers.size(); i++)
+                workers[i].join();
+            return -1;
+        }
+        Readers readers;
+        while (true)
+        {
+            struct pollfd fds[2] = {{server, POLLIN, 0},
+                                    {stopPipe[0], POLLIN, 0}};
+            if (poll(fds, 2, -1) < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                break;
+            }
+            if (fds[1].revents != 0)
+                break;
+            int client = accept(server, NULL, NULL);
+            if (client < 0)
+            {
+                if (errno == EINTR || errno == ECONNABORTED)
+                    continue;
+                break;
+            }
+            readers.reap();
+            readers.start(std::make_shared<Connection>(client, client),
+                          queue, maxBytes);
+        }
+        close(server);
+        unlink(socketPath);
+        // No reader may queue requests, or record profile samples, once
+        // the queue is closed.
+        readers.joinAll();
+    }
+
+    queue.close();
+    for (size_t i = 0; i < workers.size(); i++)
+        workers[i].join();
+    if (profilePath && !writeProfile(profilePath))
+        cerr << "Error writing " << profilePath << endl;
+    if (tracePath && !writeTrace(tracePath))
+        cerr << "Error writing " << tracePath << endl;
+    return 0;
+}
+
+void help()
+{
+    cout << "Usage: ./serve [--model <file>] [--socket <path>] ";
+    cout << "[--workers <n>] [--batch <n>] [--batch-wait <ms>] ";
+    cout << "[--strip-rows <n>] [--profile <f>] [--trace <f>] ";
+    cout << "[--max-side <n>] [--pyramid <levels>] [--stride <n>] ";
+    cout << "[--cascade <margin> [--coarse <side>,<levels>,<stride>]] ";
+    cout << "[--workspace-mb <n>] [--max-bytes <n>]\n";
+    cout << "\tReads requests from stdin, or from clients of the Unix ";
+    cout << "socket <path>. Each request is a line \"path <file>\" or ";
+    cout << "\"bytes <n>\" followed by n bytes of an encoded image; each ";
+    cout << "response is \"<id> <label> <votes per label>\".\n";
+    cout << "\t--model loads a binary model written by ./bundle instead of ";
+    cout << "the XML files.\n";
+    cout << "\t--workers classifying threads (default: one per core).\n";
+    cout << "\t--batch requests classified together (default 16), waiting ";
+    cout << "at most --batch-wait ms (default 2) for them.\n";
+    cout << "\t--max-side, --pyramid and --stride bound the cost of large ";
+    cout << "images (see ./evaluate --resolution-sweep).\n";
+    cout << "\t--cascade scores every batch at the --coarse resolution ";
+    cout << "first (default 320,1,2) and recomputes at the full one only ";
+    cout << "the requests whose vote margin is below <margin> (see ";
+    cout << "./evaluate --cascade).\n";
+    cout << "\t--max-bytes largest \"bytes\" payload accepted (default ";
+    cout << "64 MB); a larger one is answered \"<id> error bad length\" ";
+    cout << "and ends the connection.\n";
+    cout << "\t--workspace-mb frees the scratch buffers of a request above ";
+    cout << "n MB once it is answered, instead of keeping them for the next ";
+    cout << "ones (default: no limit).\n";
+    cout << "\t--profile and --trace write per-stage latency percentiles ";
+    cout << "(JSON) and a Chrome trace of every request to <f> when the ";
+    cout << "server stops: at the end of stdin, or on SIGINT or SIGTERM.\n";
+}
+
+static void requestStop(int sig)
+{
+    char c = 0;
+    ssize_t n = write(stopPipe[1], &c, 1);
+    (void)n;
+    signal(sig, SIG_DFL); // a second signal stops the server at once
+}
+
+/*
+ * Turns SIGINT and SIGTERM into a readable stopPipe.
+ */
+bool catchStopSignals()
+{
+    if (pipe(stopPipe) != 0
+        || fcntl(stopPipe[1], F_SETFL, O_NONBLOCK) != 0)
+        return false;
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = requestStop;
+    sigemptyset(&action.sa_mask);
+    return sigaction(SIGINT, &action, NULL) == 0
+           && sigaction(SIGTERM, &action, NULL) == 0;
+}
+
+/*
+ * Loads the classifier from a binary model, or from the files written by
+ * ./train.
+ */
+bool loadClassifier(BowClassifier& classifier, const char *modelPath)
+{
+    bool ok = modelPath
+              ? classifier.loadModel(modelPath)
+              : classifier.load("dictionary/dictionary.xml",
+                                "histograms.xml", histogramLabelsPath());
+    if (!ok)
+        cerr << "Error loading " << (modelPath ? modelPath : "the model")
+             << endl;
+    return ok;
+}
+
+/* ------------------------------ connections ------------------------------ */
+
+bool Connection::fill()
+{
+    if (begin > 0)
+    {
+        buffer.erase(buffer.begin(), buffer.begin() + begin);
+        begin = 0;
+    }
+    char chunk[65536];
+    ssize_t n;
+    while (true)
+    {
+        // Waits for data or for a stop signal, whichever comes first.
+        struct pollfd fds[2] = {{in, POLLIN, 0}, {stopPipe[0], POLLIN, 0}};
+        if (poll(fds, 2, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        if (fds[1].revents != 0)
+            return false;
+        n = read(in, chunk, sizeof(chunk));
+        if (n < 0 && errno == EINTR)
+            continue;
+        break;
+    }
+    if (n <= 0)
+        return false;
+    buffer.insert(buffer.end(), chunk, chunk + n);
+    return true;
+}
+
+bool Connection::readLine(string& line)
+{
+    while (true)
+    {
+        vector<char>::iterator first = buffer.begin() + begin;
+        vector<char>::iterator eol = std::find(first, buffer.end(), '\n');
+        if (eol != buffer.end())
+        {
+            line.assign(first, eol);
+            begin = eol - buffer.begin() + 1;
+            return true;
+        }
+        if (!fill())
+            return false;
+    }
+}
+
+bool Connection::readBytes(size_t n, vector<uchar>& bytes)
+{
+    while (buffer.size() - begin < n)
+        if (!fill())
+            return false;
+    bytes.assign(buffer.begin() + begin, buffer.begin() + begin + n);
+    begin += n;
+    return true;
+}
+
+void Connection::send(const string& line)
+{
+    std::lock_guard<std::mutex> guard(writeLock);
+    const char* p = line.data();
+    size_t left = line.size();
+    while (left > 0)
+    {
+        ssize_t n = write(out, p, left);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return; // the client is gone
+        p += n;
+        left -= n;
+    }
+}
+
+/*
+ * Parses the requests of one connection until it is closed. Requests
+ * still queued keep the connection alive until they are answered.
+ */
+/*
+ * Queues the requests of connection until it closes. A "bytes" request
+ * over maxBytes is answered with an error and ends the connection: its
+ * payload is never buffered, and what follows it cannot be parsed.
+ */
+void readRequests(std::shared_ptr<Connection> connection,
+                  RequestQueue& queue, long maxBytes)
+{
+    string line;
+    for (long id = 0; connection->readLine(line); id++)
+    {
+        Request request;
+        request.connection = connection;
+        request.id = id;
+        if (line.compare(0, 5, "path ") == 0)
+            request.path = line.substr(5);
+        else if (line.compare(0, 6, "bytes ") == 0)
+        {
+            char *end;
+            errno = 0;
+            long n = strtol(line.c_str() + 6, &end, 10);
+            if (errno != 0 || end == line.c_str() + 6 || n <= 0
+                || n > maxBytes || !connection->readBytes(n, request.data))
+            {
+                connection->send(to_string(id) + " error bad length\n");
+                return;
+            }
+        }
+        else
+        {
+            connection->send(to_string(id) + " error unknown request\n");
+            continue;
+        }
+        queue.push(request);
+    }
+}
+
+void Readers::start(std::shared_ptr<Connection> connection,
+                    RequestQueue& queue, long maxBytes)
+{
+    std::shared_ptr<std::atomic<bool> > done =
+        std::make_shared<std::atomic<bool> >(false);
+    readers.push_back(Reader());
+    readers.back().done = done;
+    readers.back().thread = std::thread([connection, &queue, maxBytes,
+                                         done] {
+        readRequests(connection, queue, maxBytes);
+        *done = true;
+    });
+}
+
+void Readers::reap()
+{
+    for (std::list<Reader>::iterator r = readers.begin(); r != readers.end();)
+    {
+        if (*r->done)
+        {
+            r->thread.join();
+            r = readers.erase(r);
+        }
+        else
+            ++r;
+    }
+}
+
+void Readers::joinAll()
+{
+    for (std::list<Reader>::iterator r = readers.begin(); r != readers.end();
+         ++r)
+        r->thread.join();
+    readers.clear();
+}
+
+int listenOn(const char *socketPath)
+{
+    struct sockaddr_un addr;
+    if (strlen(socketPath) >= sizeof(addr.sun_path))
+        return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socketPath);
+    unlink(socketPath);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0
+        || listen(fd, SOMAXCONN) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* ----------------------------- request queue ----------------------------- */
+
+void RequestQueue::push(Request& request)
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        requests.push_back(std::move(request));
+    }
+    ready.notify_one();
+}
+
+/*
+ * Blocks for one request, then gathers up to maxBatch, waiting at most
+ * waitMs for more to arrive. Returns false once the queue is closed and
+ * drained.
+ */
+bool RequestQueue::popBatch(vector<Request>& batch, int maxBatch, int waitMs)
+{
+    batch.clear();
+    std::unique_lock<std::mutex> guard(lock);
+    ready.wait(guard, [this] { return !requests.empty() || closed; });
+    if (requests.empty())
+        return false;
+
+    std::chrono::steady_clock::time_point deadline =
+        std::chrono::steady_clock::now() + std::chrono::milliseconds(waitMs);
+    while ((int)batch.size() < maxBatch)
+    {
+        if (requests.empty()
+            && !ready.wait_until(guard, deadline, [this] {
+                   return !requests.empty() || closed;
+               }))
+            break;
+        if (requests.empty())
+            break;
+        batch.push_back(std::move(requests.front()));
+        requests.pop_front();
+    }
+    return true;
+}
+
+void RequestQueue::close()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        closed = true;
+    }
+    ready.notify_all();
+}
+
+/* -------------------------------- workers -------------------------------- */
+
+void worker(const BowClassifier& classifier, RequestQueue& queue,
+            int maxBatch, int waitMs)
+{
+    // Requests are the unit of parallelism; kNN batches stay on this
+    // thread.
+    omp_set_num_threads(1);
+    setProfileThreadName("worker");
+
+    int numWords = classifier.getNumWords();
+    bool cascade = classifier.hasCascade();
+    double minMargin = classifier.getCascade().minMargin;
+    vector<Request> batch;
+    while (queue.popBatch(batch, maxBatch, waitMs))
+    {
+        Mat histograms(batch.size(), numWords, CV_64F);
+        vector<int> rows(batch.size(), -1); // row of histograms, -1: failed
+        vector<Mat> images; // per row, kept for the full stage of the cascade
+        vector<size_t> requestOf; // per row
+        int numRows = 0;
+        for (size_t i = 0; i < batch.size(); i++)
+        {
+            Request& r = batch[i];
+            setProfileImage((int)r.id);
+            Mat image;
+            {
+                ProfileTimer timer(PROFILE_DECODE);
+                image = r.data.empty() ? imread(r.path)
+                                       : imdecode(r.data, IMREAD_COLOR);
+                timer.setWork(image.total());
+            }
+            if (image.empty())
+            {
+                r.connection->send(to_string(r.id)
+                                   + " error cannot read image\n");
+                continue;
+            }
+            Mat h;
+            classifier.histogram(image, h, 0);
+            h.copyTo(histograms.row(numRows));
+            rows[i] = numRows++;
+            if (cascade)
+            {
+                images.push_back(image);
+                requestOf.push_back(i);
+            }
+        }
+        if (numRows == 0)
+            continue;
+
+        vector<int> labels;
+        vector<vector<int> > votes;
+        classifier.classifyHistograms(histograms.rowRange(0, numRows),
+                                      labels, &votes);
+        if (cascade)
+        {
+            // Full stage, per request: only the ambiguous rows, scored
+            // together.
+            vector<int> ambiguous;
+            for (int r = 0; r < numRows; r++)
+                if (voteMargin(votes[r]) < minMargin)
+                    ambiguous.push_back(r);
+            if (!ambiguous.empty())
+            {
+                Mat fine((int)ambiguous.size(), numWords, CV_64F);
+                for (size_t a = 0; a < ambiguous.size(); a++)
+                {
+                    int r = ambiguous[a];
+                    setProfileImage((int)batch[requestOf[r]].id);
+                    Mat h;
+                    classifier.histogram(images[r], h);
+                    h.copyTo(fine.row((int)a));
+                }
+                vector<int> fineLabels;
+                vector<vector<int> > fineVotes;
+                classifier.classifyHistograms(fine, fineLabels, &fineVotes);
+                for (size_t a = 0; a < ambiguous.size(); a++)
+                {
+                    labels[ambiguous[a]] = fineLabels[a];
+                    votes[ambiguous[a]].swap(fineVotes[a]);
+                }
+            }
+        }
+        for (size_t i = 0; i < batch.size(); i++)
+        {
+            if (rows[i] < 0)
+                continue;
+            const vector<int>& v = votes[rows[i]];
+            string response = to_string(batch[i].id) + " "
+                              + to_string(labels[rows[i]]);
+            for (size_t c = 1; c < v.size(); c++)
+                response += " " + to_string(v[c]);
+            batch[i].connection->send(response + "\n");
+        }
+        // Same bound as the pooled workspaces (see setWorkspaceLimit).
+        size_t limit = getWorkspaceLimit();
+        if (limit > 0 && threadWorkspace().capacity() > limit)
+            threadWorkspace().release();
+    }
+}
@@ -0,0 +1,328 @@
+#include "shard.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <climits>
+#include <iostream>
+
+static const char MAGIC[4] = {'B', 'O', 'W', 'P'};
+static const unsigned VERSION = 1;
+static const char* KIND_NAMES[] = {"samples", "histograms"};
+
+// Fields of the header in file order, after magic and version.
+struct FileHeader
+{
+    unsigned kind, shard, numShards, firstImage, numImages, totalImages;
+    uint64 context;
+    int type;
+    unsigned rows, cols, reserved;
+};
+
+// Offset of the first element.
+static const size_t DATA_OFFSET = sizeof(MAGIC) + sizeof(unsigned)
+                                  + sizeof(FileHeader);
+
+void shardRange(int shard, int numShards, int total, int& first, int& count)
+{
+    first = (int)((long long)total * shard / numShards);
+    count = (int)((long long)total * (shard + 1) / numShards) - first;
+}
+
+std::string partialPath(const std::string& dir, int kind, int shard)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "%s-%04d.part", KIND_NAMES[kind], shard);
+    if (dir.empty() || dir[dir.size() - 1] == '/')
+        return dir + name;
+    return dir + "/" + name;
+}
+
+bool savePartial(const std::string& path, const PartialHeader& header,
+                 const cv::Mat& data)
+{
+    FileHeader h = {(unsigned)header.kind, (unsigned)header.shard,
+                    (unsigned)header.numShards, (unsigned)header.firstImage,
+                    (unsigned)header.numImages, (unsigned)header.totalImages,
+                    header.context, data.type(), (unsigned)data.rows,
+                    (unsigned)data.cols, 0};
+
+    std::string tmp = path + ".tmp";
+    {
+        std::ofstream out(tmp.c_str(), std::ios::binary);
+        if (!out.is_open())
+            return false;
+        out.write(MAGIC, sizeof(MAGIC));
+        out.write((const char*)&VERSION, sizeof(VERSION));
+        out.write((const char*)&h, sizeof(h));
+        for (int i = 0; i < data.rows; i++)
+            out.write((const char*)data.ptr(i), data.cols * data.elemSize());
+        if (!out.good())
+        {
+            out.close();
+            remove(tmp.c_str());
+            return false;
+        }
+    }
+    return rename(tmp.c_str(), path.c_str()) == 0;
+}
+
+/*
+ * Reads and validates the header: partials come from other processes and
+ * possibly other machines, so nothing in them is trusted. The payload
+ * must fit the file exactly.
+ */
+static bool readHeader(std::ifstream& in, PartialHeader& header)
+{
+    char magic[4];
+    unsigned version;
+    FileHeader h;
+    in.read(magic, sizeof(magic));
+    in.read((char*)&version, sizeof(version));
+    in.read((char*)&h, sizeof(h));
+    if (!in.good() || !std::equal(MAGIC, MAGIC + 4, magic)
+        || version != VERSION || h.kind > PARTIAL_HISTOGRAMS)
+        return false;
+
+    // Slice of the list, and a single-channel floating point matrix with
+    // int dimensions (an empty one, of a slice without readable images,
+    // has the type of an empty Mat).
+    if (h.numShards == 0 || h.numShards > INT_MAX || h.shard >= h.numShards
+        || h.totalImages > INT_MAX || h.firstImage > h.totalImages
+        || h.numImages > h.totalImages - h.firstImage)
+        return false;
+    if ((h.rows > 0 && h.type != CV_32F && h.type != CV_64F)
+        || h.rows > INT_MAX || h.cols > INT_MAX)
+        return false;
+    std::streamoff payload = h.rows == 0 ? 0
+                             : (std::streamoff)h.rows * h.cols
+                               * CV_ELEM_SIZE(h.type);
+    in.seekg(0, std::ios::end);
+    std::streamoff size = in.tellg();
+    in.seekg(DATA_OFFSET);
+    if (!in.good() || size - (std::streamoff)DATA_OFFSET != payload)
+        return false;
+
+    header.kind = h.kind;
+    header.shard = h.shard;
+    header.numShards = h.numShards;
+    header.firstImage = h.firstImage;
+    header.numImages = h.numImages;
+    header.totalImages = h.totalImages;
+    header.context = h.context;
+    header.type = h.type;
+    header.rows = h.rows;
+    header.cols = h.cols;
+    return true;
+}
+
+bool readPartialHeader(const std::string& path, PartialHeader& header)
+{
+    std::ifstream in(path.c_str(), std::ios::binary);
+    return in.is_open() && readHeader(in, header);
+}
+
+bool loadPartial(const std::string& path, PartialHeader& header,
+                 cv::Mat& data)
+{
+    std::ifstream in(path.c_str(), std::ios::binary);
+    if (!in.is_open() || !readHeader(in, header))
+        return false;
+    if (header.rows == 0)
+    {
+        data.release();
+        return true;
+    }
+    data.create(header.rows, header.cols, header.type);
+    in.read((char*)data.data, data.total() * data.elemSize());
+    return in.good();
+}
+
+/*
+ * Reads the headers of the partials of one run and checks their
+ * coverage and consistency. type and cols are those of the first
+ * non-empty partial, -1 and 0 if all are empty.
+ */
+static bool checkPartials(const std::string& dir, int kind, int numShards,
+                          uint64 context, std::vector<PartialHeader>& headers,
+                          int& type, int& cols)
+{
+    headers.resize(numShards);
+    int covered = 0;
+    type = -1;
+    cols = 0;
+    for (int s = 0; s < numShards; s++)
+    {
+        std::string path = partialPath(dir, kind, s);
+        PartialHeader& h = headers[s];
+        if (!readPartialHeader(path, h))
+        {
+            std::cout << "Missing or damaged partial " << path << std::endl;
+            return false;
+        }
+        if (h.kind != kind || h.shard != s || h.numShards != numShards
+            || h.firstImage != covered
+            || h.totalImages != headers[0].totalImages
+            || (h.rows > 0 && type >= 0 && (h.type != type || h.cols != cols)))
+        {
+            std::cout << path << " belongs to another run or split"
+                      << std::endl;
+            return false;
+        }
+        if (h.rows > 0 && type < 0)
+        {
+            type = h.type;
+            cols = h.cols;
+        }
+        if (h.context != context)
+        {
+            std::cout << path << " was computed with another filterbank or "
+                      << "dictionary" << std::endl;
+            return false;
+        }
+        covered += h.numImages;
+    }
+    if (covered != headers[0].totalImages)
+    {
+        std::cout << "The partials cover " << covered << " of "
+                  << headers[0].totalImages << " images" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool mergePartials(const std::string& dir, int kind, int numShards,
+                   uint64 context, cv::Mat& merged, size_t maxRows,
+                   uint64 seed)
+{
+    // Headers first: coverage, consistency and the size of the result.
+    std::vector<PartialHeader> headers;
+    int type, cols;
+    if (!checkPartials(dir, kind, numShards, context, headers, type, cols))
+        return false;
+    size_t totalRows = 0;
+    for (int s = 0; s < numShards; s++)
+        totalRows += headers[s].rows;
+
+    double keep = maxRows > 0 && totalRows > maxRows
+                  ? (double)maxRows / totalRows : 1;
+    std::vector<int> kept(numShards);
+    size_t numRows = 0;
+    for (int s = 0; s < numShards; s++)
+    {
+        kept[s] = keep < 1 ? (int)(headers[s].rows * keep + 0.5)
+                           : headers[s].rows;
+        numRows += kept[s];
+    }
+
+    if (numRows > INT_MAX)
+    {
+        std::cout << "Too many rows to merge (" << numRows
+                  << "); use --merge-samples" << std::endl;
+        return false;
+    }
+    merged.create((int)numRows, cols, type < 0 ? CV_32F : type);
+    int row = 0;
+    for (int s = 0; s < numShards; s++)
+    {
+        PartialHeader h;
+        cv::Mat data;
+        if (!loadPartial(partialPath(dir, kind, s), h, data))
+        {
+            std::cout << "Error reading " << partialPath(dir, kind, s)
+                      << std::endl;
+            return false;
+        }
+        if (kept[s] == data.rows)
+        {
+            if (!data.empty())
+                data.copyTo(merged.rowRange(row, row + data.rows));
+        }
+        else
+        {
+            // Partial Fisher-Yates shuffle: the first kept[s] of a random
+            // permutation, in their original order.
+            std::vector<int> order(data.rows);
+            for (int i = 0; i < data.rows; i++)
+                order[i] = i;
+            cv::RNG rng(seed + s);
+            for (int i = 0; i < kept[s]; i++)
+                std::swap(order[i], order[i + rng.uniform(0, data.rows - i)]);
+            std::sort(order.begin(), order.begin() + kept[s]);
+            for (int i = 0; i < kept[s]; i++)
+                data.row(order[i]).copyTo(merged.row(row + i));
+        }
+        row += kept[s];
+    }
+    return true;
+}
+
+PartialSamples::PartialSamples()
+    : type(CV_32F), numCols(0)
+{
+}
+
+bool PartialSamples::open(const std::string& dir, int numShards,
+                          uint64 context)
+{
+    std::vector<PartialHeader> headers;
+    if (!checkPartials(dir, PARTIAL_SAMPLES, numShards, context, headers,
+                       type, numCols))
+        return false;
+    if (type < 0)
+        type = CV_32F;
+
+    files.clear();
+    firstRows.assign(1, 0);
+    for (int s = 0; s < numShards; s++)
+    {
+        if ((long long)firstRows.back() + headers[s].rows > INT_MAX)
+        {
+            std::cout << "Too many samples to cluster" << std::endl;
+            return false;
+        }
+        std::string path = partialPath(dir, PARTIAL_SAMPLES, s);
+        files.push_back(std::unique_ptr<std::ifstream>(
+            new std::ifstream(path.c_str(), std::ios::binary)));
+        if (!files.back()->is_open())
+        {
+            std::cout << "Error reading " << path << std::endl;
+            return false;
+        }
+        firstRows.push_back(firstRows.back() + headers[s].rows);
+    }
+    row.resize((size_t)numCols * CV_ELEM_SIZE(type));
+    return true;
+}
+
+int PartialSamples::rows() const
+{
+    return firstRows.empty() ? 0 : firstRows.back();
+}
+
+int PartialSamples::cols() const
+{
+    return numCols;
+}
+
+int PartialSamples::depth() const
+{
+    return CV_MAT_DEPTH(type);
+}
+
+bool PartialSamples::read(int i, float* out)
+{
+    // Shard s holds rows [firstRows[s], firstRows[s + 1]).
+    int s = (int)(std::upper_bound(firstRows.begin(), firstRows.end(), i)
+                  - firstRows.begin()) - 1;
+    std::ifstream& in = *files[s];
+    in.seekg(DATA_OFFSET + (size_t)(i - firstRows[s]) * row.size());
+    in.read(&row[0], row.size());
+    if (!in.good())
+    {
+        in.clear();
+        return false;
+    }
+    cv::Mat stored(1, numCols, type, &row[0]);
+    cv::Mat converted(1, numCols, CV_32F, out);
+    stored.convertTo(converted, CV_32F);
+    return true;
+}
@@ -0,0 +1,129 @@
+#ifndef SHARD_H_
+#define SHARD_H_
+
+#include "kmeans.hpp"
+#include <opencv2/opencv.hpp>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+/*
+ * Sharded training: ./train --shard i/n processes the i-th of n
+ * contiguous slices of the training list and writes a partial result;
+ * a merge step stacks the partials of all shards. Shards are separate
+ * processes, on one machine or on batch nodes sharing a filesystem, and
+ * need no communication with each other.
+ *
+ * Training takes two rounds, since histograms need the final dictionary:
+ *
+ *     samples      responses at the sampled pixels of every image of the
+ *                  slice; merged and clustered into the dictionary
+ *     histograms   one histogram per image of the slice (zero if it
+ *                  could not be read), against that dictionary; merged
+ *                  into the histogram matrix, in list order
+ *
+ * With ./train:
+ *
+ *     ./train --shard i/n <list>            for every i, in parallel
+ *     ./train --merge-dictionary n
+ *     ./train --shard i/n --dictionary dictionary/dictionary.xml <list>
+ *     ./train --merge-histograms n
+ *
+ * Pixels are drawn per image from seed + its index in the whole list, so
+ * with a fixed --seed the merged samples equal those of a single-process
+ * run.
+ *
+ * Partial file (native byte order, little endian on every supported
+ * host):
+ *     char[4] magic "BOWP", uint32 version
+ *     uint32  kind, shard, numShards, firstImage, numImages, totalImages
+ *     uint64  context (see featureContext in cache.hpp)
+ *     int32   type, uint32 rows, uint32 cols, uint32 reserved
+ *     rows * cols elements, row-major
+ */
+enum PartialKind { PARTIAL_SAMPLES = 0, PARTIAL_HISTOGRAMS = 1 };
+
+struct PartialHeader
+{
+    int kind;
+    int shard;
+    int numShards;
+    int firstImage;   // slice of the training list: [firstImage,
+    int numImages;    //   firstImage + numImages)
+    int totalImages;  // length of the whole list
+    uint64 context;   // what the rows depend on; equal in all shards
+    int type;         // of the matrix
+    int rows;
+    int cols;
+};
+
+/*
+ * Slice [first, first + count) of total images handled by shard.
+ */
+void shardRange(int shard, int numShards, int total, int& first, int& count);
+
+/*
+ * <dir>/<kind>-<shard>.part
+ */
+std::string partialPath(const std::string& dir, int kind, int shard);
+
+/*
+ * Writes a partial (header.type/rows/cols are taken from data) through a
+ * temporary file, so an interrupted shard leaves no partial behind.
+ * Returns false if it cannot be written.
+ */
+bool savePartial(const std::string& path, const PartialHeader& header,
+                 const cv::Mat& data);
+
+/*
+ * Reads the header only, or the whole partial. Return false if the file
+ * is missing or malformed.
+ */
+bool readPartialHeader(const std::string& path, PartialHeader& header);
+bool loadPartial(const std::string& path, PartialHeader& header,
+                 cv::Mat& data);
+
+/*
+ * Stacks the partials of kind written by shards 0..numShards-1 of one
+ * run, in shard order. Checks that they all exist, share the context and
+ * cover the whole list exactly; prints the problem and returns false
+ * otherwise.
+ *
+ * maxRows > 0 bounds the memory of the merge: when the partials hold
+ * more rows, every shard contributes a uniform random subset of its
+ * rows, in proportion to its size (seed fixes the choice). Partials are
+ * read one at a time.
+ */
+bool mergePartials(const std::string& dir, int kind, int numShards,
+                   uint64 context, cv::Mat& merged, size_t maxRows = 0,
+                   uint64 seed = 1);
+
+/*
+ * The samples partials of shards 0..numShards-1 read in place, row by
+ * row, so that mini-batch k-means (KMeans::fit(SampleSource&)) can
+ * cluster more samples than fit in memory. open() makes the checks of
+ * mergePartials, printing the problem and returning false; rows are
+ * numbered in shard order.
+ */
+class PartialSamples : public SampleSource
+{
+private:
+    std::vector<std::unique_ptr<std::ifstream> > files;
+    std::vector<int> firstRows; // of every shard, then the total
+    int type;
+    int numCols;
+    std::vector<char> row;      // one row as stored
+
+public:
+    PartialSamples();
+
+    bool open(const std::string& dir, int numShards, uint64 context);
+
+    int rows() const;
+    int cols() const;
+    int depth() const;
+    bool read(int i, float* out);
+};
+
+#endif
@@ -1,35 +1,229 @@
 #include "bow.hpp"
 #include "histogram.hpp"
+#include "wordmap.hpp"
+#include "pipeline.hpp"
+#include "cache.hpp"
+#include "profile.hpp"
+#include "shard.hpp"
+#include "scheduler.hpp"
 
 #include <iostream>
 #include <fstream>
-#include <sys/time.h>
+#include <cstdio>
+#include <cstdlib>
 #include <omp.h>
 
 
-/* Global variables. */
-struct timeval tStart, cTime;
+/* How word maps are kept: not at all (default), XML or binary (.wmap). */
+enum WordmapFormat { WORDMAP_NONE, WORDMAP_XML, WORDMAP_BINARY };
 
 /* Declaration of functions. */
 void help();
 
-void tic();
-time_t toc();
-
 void computeWordmaps(vector<string>& trainingImagesPath, string& imageDir,
-        string& targetDir, Dictionary& dictionary, FilterBank& filterbank);
-void createHistograms(vector<string>& trainingImagesPath, int dictionarySize,
-        string& targetDir);
+        string& targetDir, Dictionary& dictionary, FilterBank& filterbank,
+        Mat& histograms, WordmapFormat format, bool compress,
+        PipelineParams pipelineParams, FeatureCache* cache);
+bool readLabels(vector<int>& labels, const char *filename);
+int dropUnreadable(Mat& histograms, vector<int>& labels);
+bool writeHistograms(const Mat& histograms, const vector<int>& labels);
+bool saveHistograms(Mat& histograms);
+bool openCache(FeatureCache& cache, const char *cacheDir, size_t cacheMB,
+        const FilterBank& filterbank, const Dictionary& dictionary);
+uint64 samplesContext(const FilterBank& filterbank, const Dictionary& dict);
+int trainShard(int shard, int numShards, const string& shardDir,
+        vector<string>& trainingImagesPath, string& imageDir,
+        string& targetDir, FilterBank& filterbank, Dictionary& dict,
+        const char *dictionaryPath, int stripRows,
+        WordmapFormat wordmapFormat, bool compress,
+        const PipelineParams& pipelineParams, const char *cacheDir,
+        size_t cacheMB);
+double measureDrift(vector<string>& imagesPath, string& imageDir,
+        Dictionary& dictionary, FilterBank& filterbank,
+        const PipelineParams& pipelineParams);
+
+// Drift ratio above which add mode recommends a new dictionary.
+const double DRIFT_THRESHOLD = 1.2;
+// Pixels sampled per training image, and words of a flat dictionary.
+const int ALPHA = 50;
+const int NUM_WORDS = 150;
 
 int main(int argc, char **argv)
 {
-    if (argc != 2)
+    // The task pool owns the cores (see scheduler.hpp).
+    OpenCvThreadsOff openCvThreadsOff;
+
+    const char *trainingSet = NULL;
+    int stripRows = 0;
+    bool sparseSampling = false;
+    KMeansParams kmeansParams;
+    WordmapFormat wordmapFormat = WORDMAP_NONE;
+    bool compress = false;
+    int treeBranching = 0, treeLevels = 0;
+    PipelineParams pipelineParams;
+    const char *cacheDir = NULL;
+    size_t cacheMB = 1024;
+    const char *dictionaryPath = NULL;
+    const char *addLabels = NULL;
+    bool driftCheck = false;
+    const char *profilePath = NULL;
+    const char *tracePath = NULL;
+    int shard = 0, numShards = 0; // 0: not sharded
+    string shardDir = "shards/";
+    int mergeDictionary = 0, mergeHistograms = 0; // shards to merge
+    size_t mergeSamples = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        if (arg == "--strip-rows" && i+1 < argc)
+            stripRows = atoi(argv[++i]);
+        else if (arg == "--wordmaps" && i+1 < argc)
+        {
+            string format = argv[++i];
+            if (format == "xml")
+                wordmapFormat = WORDMAP_XML;
+            else if (format == "bin")
+                wordmapFormat = WORDMAP_BINARY;
+            else if (format != "none")
+            {
+                help();
+                return -1;
+            }
+        }
+        else if (arg == "--compress")
+            compress = true;
+        else if (arg == "--seed" && i+1 < argc)
+            kmeansParams.seed = strtoull(argv[++i], NULL, 10);
+        else if (arg == "--kmeans-iters" && i+1 < argc)
+            kmeansParams.maxIterations = atoi(argv[++i]);
+        else if (arg == "--mini-batch" && i+1 < argc)
+            kmeansParams.miniBatch = atoi(argv[++i]);
+        else if (arg == "--tree" && i+2 < argc)
+        {
+            treeBranching = atoi(argv[++i]);
+            treeLevels = atoi(argv[++i]);
+        }
+        else if (arg == "--readers" && i+1 < argc)
+            pipelineParams.readers = atoi(argv[++i]);
+        else if (arg == "--threads" && i+1 < argc)
+            pipelineParams.workers = atoi(argv[++i]);
+        else if (arg == "--writers" && i+1 < argc)
+            pipelineParams.writers = atoi(argv[++i]);
+        else if (arg == "--queue" && i+1 < argc)
+            pipelineParams.queueSize = atoi(argv[++i]);
+        else if (arg == "--cache" && i+1 < argc)
+            cacheDir = argv[++i];
+        else if (arg == "--cache-size" && i+1 < argc)
+            cacheMB = strtoull(argv[++i], NULL, 10);
+        else if (arg == "--dictionary" && i+1 < argc)
+            dictionaryPath = argv[++i];
+        else if (arg == "--add" && i+1 < argc)
+            addLabels = argv[++i];
+        else if (arg == "--drift-check")
+            driftCheck = true;
+        else if (arg == "--profile" && i+1 < argc)
+            profilePath = argv[++i];
+        else if (arg == "--trace" && i+1 < argc)
+            tracePath = argv[++i];
+        else if (arg == "--shard" && i+1 < argc)
+        {
+            if (sscanf(argv[++i], "%d/%d", &shard, &numShards) != 2
+                || numShards < 1 || shard < 0 || shard >= numShards)
+            {
+                help();
+                return -1;
+            }
+        }
+        else if (arg == "--shard-dir" && i+1 < argc)
+            shardDir = argv[++i];
+        else if (arg == "--merge-dictionary" && i+1 < argc)
+            mergeDictionary = atoi(argv[++i]);
+        else if (arg == "--merge-histograms" && i+1 < argc)
+            mergeHistograms = atoi(argv[++i]);
+        else if (arg == "--merge-samples" && i+1 < argc)
+            mergeSamples = strtoull(argv[++i], NULL, 10);
+        else if (arg == "--sparse-sampling")
+            sparseSampling = true;
+        else if (trainingSet == NULL && arg[0] != '-')
+            trainingSet = argv[i];
+        else
+        {
+            help();
+            return -1;
+        }
+    }
+    bool merging = mergeDictionary > 0 || mergeHistograms > 0;
+    if ((trainingSet == NULL && !merging) || (numShards > 0 && addLabels))
     {
         help();
         return -1;
     }
+    if (profilePath || tracePath)
+        enableProfiling(tracePath != NULL);
+
+    // Merge steps of sharded training (see shard.hpp).
+    if (mergeDictionary > 0)
+    {
+        FilterBank filterbank;
+        Dictionary dict;
+        dict.setSparseSampling(sparseSampling);
+        dict.setKMeansParams(kmeansParams);
+        dict.setVocabularyTree(treeBranching, treeLevels);
+        double start;
+        if (kmeansParams.miniBatch > 0 && treeBranching == 0
+            && mergeSamples == 0)
+        {
+            // Mini-batch k-means reads random rows only: they are read
+            // from the partials instead of being stacked in memory.
+            PartialSamples samples;
+            if (!samples.open(shardDir, mergeDictionary,
+                              samplesContext(filterbank, dict)))
+                return -1;
+            cout << "Computing dictionary from " << samples.rows()
+                 << " samples of " << mergeDictionary << " shards ...\n";
+            start = omp_get_wtime();
+            if (!dict.cluster(NUM_WORDS, samples, filterbank.getDepth()))
+                return -1;
+        }
+        else
+        {
+            Mat samples;
+            cout << "Merging the samples of " << mergeDictionary
+                 << " shards ...\n";
+            if (!mergePartials(shardDir, PARTIAL_SAMPLES, mergeDictionary,
+                               samplesContext(filterbank, dict), samples,
+                               mergeSamples,
+                               kmeansParams.seed ? kmeansParams.seed : 1))
+                return -1;
+            cout << "Computing dictionary from " << samples.rows
+                 << " samples ...\n";
+            start = omp_get_wtime();
+            dict.cluster(NUM_WORDS, samples);
+        }
+        dict.save("dictionary/");
+        cout << "Elapsed time(ms): "
+             << (long)((omp_get_wtime() - start) * 1000) << endl;
+        return 0;
+    }
+    if (mergeHistograms > 0)
+    {
+        FilterBank filterbank;
+        Dictionary dict;
+        if (!dict.load(dictionaryPath ? dictionaryPath
+                                      : "dictionary/dictionary.xml"))
+            return -1;
+        Mat histograms;
+        if (!mergePartials(shardDir, PARTIAL_HISTOGRAMS, mergeHistograms,
+                           featureContext(filterbank, dict), histograms))
+            return -1;
+        if (!saveHistograms(histograms))
+            return -1;
+        cout << "Merged " << histograms.rows << " histograms of "
+             << mergeHistograms << " shards\n";
+        return 0;
+    }
 
-    ifstream in(argv[1]);
+    ifstream in(trainingSet);
     string imageDir = "images/";
     string targetDir = "wordmaps/";
     vector<string> trainingImagesPath;
@@ -37,7 +231,7 @@ int main(int argc, char **argv)
     if (!in.is_open())
     {
         cout << "Error opening file\n";
-        cout << "File " << argv[1] << " may not exist.\n";
+        cout << "File " << trainingSet << " may not exist.\n";
     }
     // Reads image paths.
     string str;
@@ -48,106 +242,497 @@ int main(int argc, char **argv)
 
     cout << "Initializing filterbank ...\n";
     FilterBank filterbank;
+    if (numShards > 0)
+    {
+        Dictionary dict;
+        dict.setSparseSampling(sparseSampling);
+        dict.setKMeansParams(kmeansParams);
+        dict.setPipelineParams(pipelineParams);
+        return trainShard(shard, numShards, shardDir, trainingImagesPath,
+                          imageDir, targetDir, filterbank, dict,
+                          dictionaryPath, stripRows, wordmapFormat, compress,
+                          pipelineParams, cacheDir, cacheMB);
+    }
+
+    // Add mode: the images are appended to an existing model.
+    if (addLabels && !dictionaryPath)
+        dictionaryPath = "dictionary/dictionary.xml";
+    Mat oldHistograms;
+    vector<int> oldLabels, newLabels;
+    if (addLabels)
+    {
+        if (!readHistogramFile("histograms.xml", oldHistograms)
+            || !readLabels(oldLabels, histogramLabelsPath().c_str())
+            || !readLabels(newLabels, addLabels))
+            return -1;
+        if (oldHistograms.rows != (int)oldLabels.size())
+        {
+            cout << "histograms.xml and " << histogramLabelsPath()
+                 << " disagree ("
+                 << oldHistograms.rows << " histograms, "
+                 << oldLabels.size() << " labels)\n";
+            return -1;
+        }
+        if (newLabels.size() != trainingImagesPath.size())
+        {
+            cout << addLabels << " has " << newLabels.size()
+                 << " labels for " << trainingImagesPath.size()
+                 << " images\n";
+            return -1;
+        }
+    }
 
-    cout << "Computing dictionary ...\n";
-    tic();
     Dictionary dict;
-    int alpha = 50;
-    int K = 150;
-    dict.create(alpha, K, filterbank, trainingImagesPath, imageDir);
-    cout << "Elapsed time(ms): " << toc() << endl;
-    dict.save("dictionary/");
-
-    //Dictionary dict;
-    //dict.load("dictionary/dictionary.xml");
-    cout << "Build word maps ...\n";
-    tic();
-    computeWordmaps(trainingImagesPath, imageDir, targetDir, dict, filterbank);
-    cout << "Elapsed time(ms): " << toc() << endl;
-
-    cout << "Create histograms ...\n";
-    tic();
-    createHistograms(trainingImagesPath, dict.getWordsNum(), targetDir);
-    cout << "Elapsed time(ms): " << toc() << endl;
+    if (dictionaryPath)
+    {
+        // Keeping the dictionary keeps cached word maps valid.
+        cout << "Loading dictionary " << dictionaryPath << " ...\n";
+        if (!dict.load(dictionaryPath))
+            return -1;
+    }
+    else
+    {
+        cout << "Computing dictionary ...\n";
+        double start = omp_get_wtime();
+        dict.setSparseSampling(sparseSampling);
+        dict.setKMeansParams(kmeansParams);
+        dict.setVocabularyTree(treeBranching, treeLevels);
+        dict.setPipelineParams(pipelineParams);
+        dict.create(ALPHA, NUM_WORDS, filterbank, trainingImagesPath,
+                    imageDir);
+        cout << "Elapsed time(ms): "
+             << (long)((omp_get_wtime() - start) * 1000) << endl;
+    }
+    dict.setStripRows(stripRows);
+    if (addLabels && oldHistograms.cols != dict.getWordsNum())
+    {
+        cout << "histograms.xml does not match the dictionary\n";
+        return -1;
+    }
+    if (!addLabels)
+        dict.save("dictionary/");
+
+    FeatureCache cache;
+    if (cacheDir && !openCache(cache, cacheDir, cacheMB, filterbank, dict))
+        return -1;
+
+    cout << "Build word maps and histograms ...\n";
+    double start = omp_get_wtime();
+    // Rows of images that cannot be read stay zero.
+    Mat histograms = Mat::zeros(trainingImagesPath.size(),
+                                dict.getWordsNum(), CV_64F);
+    computeWordmaps(trainingImagesPath, imageDir, targetDir, dict, filterbank,
+                    histograms, wordmapFormat, compress, pipelineParams,
+                    cacheDir ? &cache : NULL);
+    cout << "Elapsed time(ms): "
+         << (long)((omp_get_wtime() - start) * 1000) << endl;
+
+    if (addLabels)
+    {
+        // Appends the images that could be read, with their labels. The
+        // labels are only replaced once histograms.xml has been written.
+        vector<int> appended = newLabels;
+        dropUnreadable(histograms, appended);
+        Mat merged = oldHistograms.clone();
+        if (!histograms.empty())
+            merged.push_back(histograms);
+        histograms = merged;
+        vector<int> labels = oldLabels;
+        labels.insert(labels.end(), appended.begin(), appended.end());
+        if (!writeHistograms(histograms, labels))
+            return -1;
+        cout << "Added " << appended.size() << " images, "
+             << histograms.rows << " in total\n";
+
+        if (driftCheck)
+        {
+            double drift = measureDrift(trainingImagesPath, imageDir, dict,
+                                        filterbank, pipelineParams);
+            if (drift > 0)
+                cout << "Drift: new images are " << drift
+                     << " times as far from their words as the training "
+                     << "samples"
+                     << (drift > DRIFT_THRESHOLD
+                         ? "; rebuilding the dictionary is recommended\n"
+                         : "\n");
+            else
+                cout << "Drift: unknown, the dictionary predates the drift "
+                     << "check\n";
+        }
+    }
+    else if (!saveHistograms(histograms))
+    {
+        return -1;
+    }
+    if (cacheDir)
+        cout << "Cache: " << cache.getHits() << " hits, "
+             << cache.getMisses() << " misses, "
+             << (cache.getBytes() >> 20) << " MB\n";
+    if (profilePath && !writeProfile(profilePath))
+        cout << "Error writing " << profilePath << endl;
+    if (tracePath && !writeTrace(tracePath))
+        cout << "Error writing " << tracePath << endl;
 
     return 0;
 }
 
 void help()
 {
-    cout << "Usage: ./train <training_set>\n";
+    cout << "Usage: ./train [options] <training_set>\n";
     cout << "\t<training_set> is a txt file that contains the relative paths ";
     cout << "of all training images.\n";
+    cout << "Options:\n";
+    cout << "\t--strip-rows <n>  compute word maps in strips of n rows to ";
+    cout << "bound memory (0: whole image)\n";
+    cout << "\t--wordmaps <fmt>  also save word maps: none (default), xml, ";
+    cout << "or bin (compact .wmap files)\n";
+    cout << "\t--compress        run-length encode bin word maps\n";
+    cout << "\t--sparse-sampling filter only the sampled pixels of the ";
+    cout << "training images (default: whole images); also needed by ";
+    cout << "--merge-dictionary of such shards\n";
+    cout << "\t--seed <n>        fixed seed for a reproducible dictionary\n";
+    cout << "\t--kmeans-iters <n> maximum k-means iterations (default 100)\n";
+    cout << "\t--mini-batch <n>  mini-batch k-means with n samples per ";
+    cout << "step (default: full Lloyd)\n";
+    cout << "\t--tree <b> <L>    hierarchical vocabulary of up to b^L words ";
+    cout << "(branching b, depth L) instead of the flat 150\n";
+    cout << "\t--dictionary <f>  reuse the dictionary file f instead of ";
+    cout << "computing a new one\n";
+    cout << "\t--add <labels>    append <training_set>, labelled by the ";
+    cout << "file <labels>, to the existing dictionary, histograms.xml and ";
+    cout << HISTOGRAM_LABELS << " instead of training from scratch\n";
+    cout << "\t--drift-check     with --add, compare how well the ";
+    cout << "dictionary fits the new images with how it fit its own\n";
+    cout << "\t--cache <dir>     reuse the word maps cached in dir for ";
+    cout << "unchanged images, and cache the new ones\n";
+    cout << "\t--cache-size <n>  cache limit in MB (default 1024); least ";
+    cout << "recently used entries are evicted\n";
+    cout << "\t--readers <n>     threads reading images (default 2)\n";
+    cout << "\t--threads <n>     threads filtering and assigning words ";
+    cout << "(default: one per core)\n";
+    cout << "\t--writers <n>     threads saving word maps (default 1)\n";
+    cout << "\t--queue <n>       images buffered between stages ";
+    cout << "(default 16)\n";
+    cout << "\t--shard <i>/<n>   sharded training: process the i-th of n ";
+    cout << "slices of <training_set> only and write a partial to the ";
+    cout << "shard directory; samples for the dictionary, or with ";
+    cout << "--dictionary, histograms\n";
+    cout << "\t--shard-dir <d>   directory of the partials (default ";
+    cout << "shards/)\n";
+    cout << "\t--merge-dictionary <n>  build dictionary/ from the samples ";
+    cout << "of shards 0..n-1 (no <training_set> needed); with ";
+    cout << "--mini-batch, the samples are read from the partials as ";
+    cout << "needed instead of being loaded\n";
+    cout << "\t--merge-samples <m>  cluster at most m merged samples, ";
+    cout << "drawn evenly from the shards (default: all)\n";
+    cout << "\t--merge-histograms <n>  write histograms.xml from the ";
+    cout << "histograms of shards 0..n-1\n";
+    cout << "\t--profile <f>     write per-stage latency percentiles and ";
+    cout << "throughput to f (JSON)\n";
+    cout << "\t--trace <f>       write a per-image timeline of every ";
+    cout << "stage to f (Chrome trace format)\n";
 }
 
 /*
- * Starts a timer.
+ * Computes the word map of every training image and its histogram (row i
+ * of histograms). Each row of the matrix is the histogram of one image.
+ * Images go through the read/compute/output pipeline of pipeline.hpp, so
+ * reads and word map writes overlap with the filtering. Word maps are
+ * only written to targetDir when a format is requested. With a cache,
+ * the word maps of images seen before are loaded instead of computed.
  */
-void tic()
+void computeWordmaps(vector<string>& trainingImagesPath, string& imageDir,
+        string& targetDir, Dictionary& dictionary, FilterBank& filterbank,
+        Mat& histograms, WordmapFormat format, bool compress,
+        PipelineParams pipelineParams, FeatureCache* cache)
+{
+    int dictionarySize = dictionary.getWordsNum();
+    std::mutex logLock;
+    pipelineParams.hashContent = cache != NULL;
+
+    PipelineStage compute = [&](PipelineItem& item)
+    {
+        if (item.image.empty())
+        {
+            std::lock_guard<std::mutex> guard(logLock);
+            cout << "Error reading " << trainingImagesPath[item.index] << endl;
+            return;
+        }
+        if (!cache
+            || !cache->get(item.contentHash, item.wordmap, dictionarySize))
+        {
+            item.wordmap = dictionary.getWordmap(item.image, filterbank);
+            if (cache)
+                cache->put(item.contentHash, item.wordmap, dictionarySize);
+        }
+        computeHistogram(item.wordmap, item.histogram, dictionarySize);
+        item.histogram.copyTo(histograms.row(item.index));
+    };
+
+    // Save wordmap to ./wordmaps/<category>/<imageName>.{xml,wmap}
+    PipelineStage save = [&](PipelineItem& item)
+    {
+        if (item.wordmap.empty())
+            return;
+        ProfileTimer timer(PROFILE_WRITE, 1);
+        string& imagePath = trainingImagesPath[item.index];
+        string savepath = targetDir + imagePath.substr(0, imagePath.size()-3);
+        if (format == WORDMAP_XML)
+        {
+            FileStorage fs(savepath + "xml", FileStorage::WRITE);
+            fs << "wordmap" << item.wordmap;
+            fs.release();
+        }
+        else if (!saveWordmap(savepath + "wmap", item.wordmap,
+                              dictionarySize, compress))
+        {
+            std::lock_guard<std::mutex> guard(logLock);
+            cout << "Error writing " << savepath << "wmap\n";
+        }
+    };
+
+    runPipeline(trainingImagesPath, imageDir, pipelineParams, compute,
+                format == WORDMAP_NONE ? PipelineStage() : save);
+}
+
+bool openCache(FeatureCache& cache, const char *cacheDir, size_t cacheMB,
+        const FilterBank& filterbank, const Dictionary& dictionary)
 {
-    gettimeofday(&tStart, NULL);
+    if (!cache.open(cacheDir, cacheMB << 20))
+    {
+        cout << "Error opening cache " << cacheDir << endl;
+        return false;
+    }
+    cache.setContext(filterbank, dictionary);
+    return true;
 }
 
 /*
- * Returns how many miliseconds has passed since last time tic() is called.
+ * Context of sampled responses: featureContext, plus the sampling mode
+ * when sparse (full-image samples keep their earlier context), so that
+ * shards sampled in different modes are never merged.
  */
-time_t toc()
+uint64 samplesContext(const FilterBank& filterbank, const Dictionary& dict)
 {
-    gettimeofday(&cTime, NULL);
-    cTime.tv_sec -= tStart.tv_sec;
-    cTime.tv_usec -= tStart.tv_usec;
-    return cTime.tv_sec*1000 + cTime.tv_usec/1000;
+    uint64 h = featureContext(filterbank, dict);
+    if (!dict.getSparseSampling())
+        return h;
+    const char sparse[] = "sparse-sampling";
+    return hashBytes(sparse, sizeof(sparse), h);
 }
 
-void computeWordmaps(vector<string>& trainingImagesPath, string& imageDir,
-        string& targetDir, Dictionary& dictionary, FilterBank& filterbank)
+/*
+ * One shard of sharded training (see shard.hpp): the slice of the list
+ * this shard owns goes through the first round (samples) without a
+ * dictionary, through the second (histograms) with one, and the result
+ * is written as a partial to shardDir.
+ */
+int trainShard(int shard, int numShards, const string& shardDir,
+        vector<string>& trainingImagesPath, string& imageDir,
+        string& targetDir, FilterBank& filterbank, Dictionary& dict,
+        const char *dictionaryPath, int stripRows,
+        WordmapFormat wordmapFormat, bool compress,
+        const PipelineParams& pipelineParams, const char *cacheDir,
+        size_t cacheMB)
+{
+    PartialHeader header;
+    header.shard = shard;
+    header.numShards = numShards;
+    header.totalImages = trainingImagesPath.size();
+    shardRange(shard, numShards, header.totalImages, header.firstImage,
+               header.numImages);
+    vector<string> slice(trainingImagesPath.begin() + header.firstImage,
+                         trainingImagesPath.begin() + header.firstImage
+                                                    + header.numImages);
+    cout << "Shard " << shard << "/" << numShards << ": images "
+         << header.firstImage << " to "
+         << header.firstImage + header.numImages - 1 << endl;
+
+    Mat data;
+    double start = omp_get_wtime();
+    if (dictionaryPath == NULL)
+    {
+        cout << "Sampling responses ...\n";
+        header.kind = PARTIAL_SAMPLES;
+        dict.sampleImages(ALPHA, filterbank, slice, imageDir,
+                          header.firstImage, data);
+    }
+    else
+    {
+        cout << "Build word maps and histograms ...\n";
+        header.kind = PARTIAL_HISTOGRAMS;
+        if (!dict.load(dictionaryPath))
+            return -1;
+        dict.setStripRows(stripRows);
+        FeatureCache cache;
+        if (cacheDir && !openCache(cache, cacheDir, cacheMB, filterbank, dict))
+            return -1;
+        data = Mat::zeros(header.numImages, dict.getWordsNum(), CV_64F);
+        computeWordmaps(slice, imageDir, targetDir, dict, filterbank, data,
+                        wordmapFormat, compress, pipelineParams,
+                        cacheDir ? &cache : NULL);
+    }
+    // Without a dictionary, this covers the filterbank and the sampling
+    // mode only.
+    header.context = header.kind == PARTIAL_SAMPLES
+                     ? samplesContext(filterbank, dict)
+                     : featureContext(filterbank, dict);
+    cout << "Elapsed time(ms): "
+         << (long)((omp_get_wtime() - start) * 1000) << endl;
+
+    string path = partialPath(shardDir, header.kind, shard);
+    if (!savePartial(path, header, data))
+    {
+        cout << "Error writing " << path << endl;
+        return -1;
+    }
+    cout << "Wrote " << path << " (" << data.rows << " rows)\n";
+    return 0;
+}
+
+bool readLabels(vector<int>& labels, const char *filename)
 {
-    int N = trainingImagesPath.size(); // debug info
+    ifstream in(filename);
+    if (!in.is_open())
+    {
+        cout << "Error opening file\n";
+        cout << "File " << filename << " may not exist.\n";
+        return false;
+    }
+    int label;
+    while (in >> label)
+        labels.push_back(label);
+    return true;
+}
 
-    #pragma omp parallel for
-    for (int i = 0; i < N; i++)
+/*
+ * Removes the rows of images that could not be read (their histograms
+ * are zero; any other histogram sums to 1) together with their labels.
+ * Returns the number of rows removed and reports it.
+ */
+int dropUnreadable(Mat& histograms, vector<int>& labels)
+{
+    Mat kept;
+    vector<int> keptLabels;
+    for (int i = 0; i < histograms.rows; i++)
     {
-        //cout << "Processing image " << i+1 << "/" << N << endl; // debug info
+        if (sum(histograms.row(i))[0] == 0)
+            continue;
+        kept.push_back(histograms.row(i));
+        keptLabels.push_back(labels[i]);
+    }
+    int dropped = histograms.rows - kept.rows;
+    if (dropped > 0)
+        cout << "Dropped " << dropped << " unreadable images and their "
+             << "labels\n";
+    histograms = kept;
+    labels.swap(keptLabels);
+    return dropped;
+}
 
-        string& imagePath = trainingImagesPath[i];
-        Mat image = imread(imageDir + imagePath);
-        Mat wordmap = dictionary.getWordmap(image, filterbank);
+/*
+ * Replaces histograms.xml and HISTOGRAM_LABELS (histogram.hpp), one label
+ * per row. Both are written aside and renamed into place only once both
+ * are complete, so a failure leaves the previous pair untouched. Without
+ * labels, readers fall back to training_label.txt.
+ */
+bool writeHistograms(const Mat& histograms, const vector<int>& labels)
+{
+    const char *histogramsTmp = "histograms.tmp.xml";
+    string labelsTmp = string(HISTOGRAM_LABELS) + ".tmp";
+    if (!writeHistogramFile(histogramsTmp, histograms))
+    {
+        cout << "Error writing histograms.xml\n";
+        return false;
+    }
+    if (!labels.empty())
+    {
+        ofstream out(labelsTmp.c_str());
+        for (size_t i = 0; i < labels.size(); i++)
+            out << labels[i] << "\n";
+        out.close();
+        if (!out)
+        {
+            cout << "Error writing " << HISTOGRAM_LABELS << endl;
+            remove(histogramsTmp);
+            remove(labelsTmp.c_str());
+            return false;
+        }
+    }
+    if (rename(histogramsTmp, "histograms.xml") != 0)
+    {
+        cout << "Error writing histograms.xml\n";
+        return false;
+    }
+    if (labels.empty())
+        remove(HISTOGRAM_LABELS);
+    else if (rename(labelsTmp.c_str(), HISTOGRAM_LABELS) != 0)
+    {
+        cout << "Error writing " << HISTOGRAM_LABELS << endl;
+        return false;
+    }
+    return true;
+}
 
-        // Constructs path for the xml file that stores the word map.
-        string savepath = targetDir;
-        savepath += imagePath.substr(0, imagePath.size()-3) + "xml";
+/*
+ * Writes the histograms of the images of training_label.txt, which is
+ * left as it is. Rows of unreadable images are dropped with their labels
+ * in HISTOGRAM_LABELS. If training_label.txt is missing or does not have
+ * one label per row, the rows are kept (zero histograms: the least
+ * similar neighbours) and reported, since dropping them would shift the
+ * labels of every later image.
+ */
+bool saveHistograms(Mat& histograms)
+{
+    vector<int> labels;
+    ifstream in("training_label.txt");
+    int label;
+    while (in >> label)
+        labels.push_back(label);
+    in.close();
 
-        // Save wordmap to ./wordmaps/<category>/<imageName>.xml
-        FileStorage fs(savepath, FileStorage::WRITE);
-        fs << "wordmap" << wordmap;
-        fs.release();
+    if ((int)labels.size() == histograms.rows)
+    {
+        dropUnreadable(histograms, labels);
+    }
+    else
+    {
+        labels.clear();
+        int unreadable = 0;
+        for (int i = 0; i < histograms.rows; i++)
+            unreadable += sum(histograms.row(i))[0] == 0;
+        if (unreadable > 0)
+            cout << "Warning: " << unreadable << " images could not be read "
+                 << "and have zero histograms; training_label.txt does not "
+                 << "have one label per image, so they are kept\n";
     }
+    return writeHistograms(histograms, labels);
 }
 
 /*
- * Computes the feature histograms of training images, puts them together to
- * form a big matrix, and saves it.
- * Each row of the matrix is the histogram of one image, so the number of row
- * equals to that of training images.
+ * Distortion of the dictionary on pixels sampled from the images, as a
+ * ratio to the one recorded when it was created (0 if that is unknown).
  */
-void createHistograms(vector<string>& trainingImagesPath, int dictionarySize,
-        string& targetDir)
+double measureDrift(vector<string>& imagesPath, string& imageDir,
+        Dictionary& dictionary, FilterBank& filterbank,
+        const PipelineParams& pipelineParams)
 {
-    int numImages = trainingImagesPath.size();
-    Mat histograms(numImages, dictionarySize, CV_64F);
-    for (int i = 0; i < numImages; i++)
-    {
-        string& imagePath = trainingImagesPath[i];
-        string savepath = targetDir + imagePath.substr(0, imagePath.size()-3)
-                          + "xml";
-        FileStorage fs(savepath, FileStorage::READ);
-        Mat wordmap;
-        fs["wordmap"] >> wordmap;
-
-        Mat h;
-        computeHistogram(wordmap, h, dictionarySize);
-        h.copyTo(histograms.row(i));
-    }
-    FileStorage fs("histograms.xml", FileStorage::WRITE);
-    fs << "histograms" << histograms;
+    if (dictionary.getDistortion() <= 0)
+        return 0;
+
+    vector<Mat> samples(imagesPath.size());
+    runPipeline(imagesPath, imageDir, pipelineParams,
+                [&](PipelineItem& item) {
+        if (item.image.empty())
+            return;
+        RNG rng(item.index + 1);
+        dictionary.sampleResponses(item.image, filterbank, ALPHA, rng,
+                                   samples[item.index]);
+    });
+
+    Mat all;
+    for (size_t i = 0; i < samples.size(); i++)
+        if (!samples[i].empty())
+            all.push_back(samples[i]);
+    return dictionary.measureDistortion(all) / dictionary.getDistortion();
 }
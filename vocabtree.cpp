@@ -0,0 +1,260 @@
+#include "vocabtree.hpp"
+#include <limits>
+
+// Columns of a row of nodes.
+enum { FIRST_CHILD = 0, NUM_CHILDREN = 1, WORD = 2, NODE_FIELDS = 3 };
+
+VocabularyTree::VocabularyTree() : numWords(0)
+{
+}
+
+/*
+ * Seed of the k-means split of node, derived from the seed of the build
+ * (splitmix64 of the seed offset by the node) so that every split draws
+ * its own samples.
+ */
+static uint64 nodeSeed(uint64 seed, int node)
+{
+    uint64 z = seed + (uint64)(node + 1) * 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    z ^= z >> 31;
+    return z ? z : 1; // 0 would mean "seed from the clock"
+}
+
+void VocabularyTree::build(const cv::Mat& samples, int branching, int levels,
+                           const KMeansParams& params)
+{
+    CV_Assert(samples.type() == CV_32F && samples.rows > 0);
+    CV_Assert(branching >= 2 && levels >= 1);
+
+    struct Pending
+    {
+        int node;
+        int level;
+        std::vector<int> members; // rows of samples
+    };
+
+    int dims = samples.cols;
+    std::vector<float> c;  // dims per node
+    std::vector<int> info; // NODE_FIELDS per node
+    numWords = 0;
+
+    // The root center is never compared against; the mean keeps the file
+    // meaningful.
+    cv::Mat mean;
+    cv::reduce(samples, mean, 0, cv::REDUCE_AVG);
+    c.insert(c.end(), mean.ptr<float>(0), mean.ptr<float>(0) + dims);
+    info.push_back(-1);
+    info.push_back(0);
+    info.push_back(-1);
+
+    // One seed for the whole build, so that a fixed seed fixes the tree.
+    KMeansParams nodeParams = params;
+    uint64 seed = params.seed ? params.seed : (uint64)cv::getTickCount();
+
+    std::vector<Pending> stack(1);
+    stack[0].node = 0;
+    stack[0].level = 0;
+    for (int i = 0; i < samples.rows; i++)
+        stack[0].members.push_back(i);
+
+    while (!stack.empty())
+    {
+        Pending p;
+        p.node = stack.back().node;
+        p.level = stack.back().level;
+        p.members.swap(stack.back().members);
+        stack.pop_back();
+
+        int n = (int)p.members.size();
+        if (p.level == levels || n < branching)
+        {
+            info[p.node*NODE_FIELDS + WORD] = numWords++;
+            continue;
+        }
+
+        cv::Mat subset(n, dims, CV_32F);
+        for (int i = 0; i < n; i++)
+            samples.row(p.members[i]).copyTo(subset.row(i));
+        cv::Mat childCenters;
+        std::vector<int> labels;
+        nodeParams.seed = nodeSeed(seed, p.node);
+        KMeans(branching, nodeParams).fit(subset, childCenters, &labels);
+
+        int first = (int)info.size() / NODE_FIELDS;
+        info[p.node*NODE_FIELDS + FIRST_CHILD] = first;
+        info[p.node*NODE_FIELDS + NUM_CHILDREN] = branching;
+
+        std::vector<Pending> children(branching);
+        for (int k = 0; k < branching; k++)
+        {
+            const float* ck = childCenters.ptr<float>(k);
+            c.insert(c.end(), ck, ck + dims);
+            info.push_back(-1);
+            info.push_back(0);
+            info.push_back(-1);
+            children[k].node = first + k;
+            children[k].level = p.level + 1;
+        }
+        for (int i = 0; i < n; i++)
+            children[labels[i]].members.push_back(p.members[i]);
+
+        // Pushed in reverse so that words are numbered depth first, left
+        // to right.
+        for (int k = branching - 1; k >= 0; k--)
+        {
+            stack.push_back(Pending());
+            stack.back().node = children[k].node;
+            stack.back().level = children[k].level;
+            stack.back().members.swap(children[k].members);
+        }
+    }
+
+    int numNodes = (int)info.size() / NODE_FIELDS;
+    centers = cv::Mat(numNodes, dims, CV_32F, &c[0]).clone();
+    nodes = cv::Mat(numNodes, NODE_FIELDS, CV_32S, &info[0]).clone();
+}
+
+bool VocabularyTree::isValid(const cv::Mat& centers, const cv::Mat& nodes)
+{
+    if (nodes.type() != CV_32S || nodes.cols != NODE_FIELDS
+        || !nodes.isContinuous() || nodes.rows == 0
+        || centers.rows != nodes.rows
+        || (centers.depth() != CV_32F && centers.depth() != CV_64F))
+        return false;
+    for (int n = 0; n < nodes.rows; n++)
+    {
+        const int* info = nodes.ptr<int>(n);
+        if (info[FIRST_CHILD] < 0)
+        {
+            if (info[WORD] < 0)
+                return false;
+        }
+        else if (info[FIRST_CHILD] <= n || info[NUM_CHILDREN] < 1
+                 || info[NUM_CHILDREN] > nodes.rows - info[FIRST_CHILD])
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+void VocabularyTree::set(const cv::Mat& centers, const cv::Mat& nodes,
+                         int depth)
+{
+    CV_Assert(nodes.type() == CV_32S && nodes.cols == NODE_FIELDS);
+    CV_Assert(centers.rows == nodes.rows && nodes.isContinuous());
+
+    if (centers.depth() == depth)
+        this->centers = centers;
+    else
+        centers.convertTo(this->centers, depth);
+    this->nodes = nodes;
+
+    numWords = 0;
+    for (int n = 0; n < nodes.rows; n++)
+        numWords = std::max(numWords, nodes.at<int>(n, WORD) + 1);
+}
+
+bool VocabularyTree::empty() const
+{
+    return nodes.empty();
+}
+
+int VocabularyTree::getNumWords() const
+{
+    return numWords;
+}
+
+const cv::Mat& VocabularyTree::getCenters() const
+{
+    return centers;
+}
+
+const cv::Mat& VocabularyTree::getNodes() const
+{
+    return nodes;
+}
+
+void VocabularyTree::getWords(cv::Mat& words) const
+{
+    words.create(numWords, centers.cols, centers.type());
+    for (int n = 0; n < nodes.rows; n++)
+    {
+        int w = nodes.at<int>(n, WORD);
+        if (w >= 0)
+            centers.row(n).copyTo(words.row(w));
+    }
+}
+
+/*
+ * Descends to a leaf, taking the nearest child at every level (strict
+ * comparison: the first child wins a tie).
+ */
+template <typename T>
+static int descend(const cv::Mat& centers, const cv::Mat& nodes, const T* x)
+{
+    const int* info = nodes.ptr<int>(0);
+    int dims = centers.cols;
+    int n = 0;
+    while (info[n*NODE_FIELDS + FIRST_CHILD] >= 0)
+    {
+        int first = info[n*NODE_FIELDS + FIRST_CHILD];
+        int last = first + info[n*NODE_FIELDS + NUM_CHILDREN];
+        T best = std::numeric_limits<T>::infinity();
+        int nearest = first;
+        for (int child = first; child < last; child++)
+        {
+            const T* c = centers.ptr<T>(child);
+            T d = 0;
+            for (int j = 0; j < dims; j++)
+            {
+                T diff = x[j] - c[j];
+                d += diff*diff;
+            }
+            if (d < best)
+            {
+                best = d;
+                nearest = child;
+            }
+        }
+        n = nearest;
+    }
+    return info[n*NODE_FIELDS + WORD];
+}
+
+int VocabularyTree::lookup(const float* x) const
+{
+    CV_Assert(centers.depth() == CV_32F);
+    return descend(centers, nodes, x);
+}
+
+int VocabularyTree::lookup(const double* x) const
+{
+    CV_Assert(centers.depth() == CV_64F);
+    return descend(centers, nodes, x);
+}
+
+void VocabularyTree::write(cv::FileStorage& fs) const
+{
+    fs << "vocabulary_tree" << "{";
+    fs << "centers" << centers;
+    fs << "nodes" << nodes;
+    fs << "}";
+}
+
+bool VocabularyTree::read(const cv::FileNode& node, int depth)
+{
+    *this = VocabularyTree();
+    if (node.isNone())
+        return false;
+
+    cv::Mat c, n;
+    node["centers"] >> c;
+    node["nodes"] >> n;
+    if (!isValid(c, n))
+        return false;
+    set(c, n, depth);
+    return true;
+}
@@ -0,0 +1,78 @@
+#ifndef VOCABTREE_H_
+#define VOCABTREE_H_
+
+#include <opencv2/opencv.hpp>
+
+#include "kmeans.hpp"
+
+/*
+ * Hierarchical k-means vocabulary tree (Nister & Stewenius, 2006).
+ *
+ * The samples are split into `branching` clusters, each cluster again into
+ * `branching`, down to `levels` levels; the leaves are the visual words. A
+ * lookup descends from the root choosing the nearest child at every level,
+ * so it costs O(branching * levels) distances instead of O(K). The result
+ * is the leaf reached, which is not always the globally nearest word.
+ *
+ * Nodes are stored flat. Row n of centers is the center of node n (node 0
+ * is the root) and row n of nodes holds { first child, number of
+ * children, word }: children are contiguous, a leaf has first child -1,
+ * and an inner node has word -1.
+ */
+class VocabularyTree
+{
+private:
+    cv::Mat centers; // numNodes x dims, CV_32F or CV_64F
+    cv::Mat nodes;   // numNodes x 3, CV_32S
+    int numWords;
+
+public:
+    VocabularyTree();
+
+    /*
+     * Builds the tree from CV_32F samples (one per row). Nodes with fewer
+     * samples than branching become leaves early, so there are at most
+     * branching^levels words.
+     */
+    void build(const cv::Mat& samples, int branching, int levels,
+               const KMeansParams& params = KMeansParams());
+
+    /*
+     * Uses a stored tree; centers is converted to depth, or shared if it
+     * already has it (e.g. a memory-mapped model).
+     */
+    void set(const cv::Mat& centers, const cv::Mat& nodes, int depth);
+
+    /*
+     * Whether nodes describe a tree over centers: types and shapes as
+     * above, children within the nodes and every leaf with a word. For
+     * trees read from files.
+     */
+    static bool isValid(const cv::Mat& centers, const cv::Mat& nodes);
+
+    bool empty() const;
+    int getNumWords() const;
+    const cv::Mat& getCenters() const;
+    const cv::Mat& getNodes() const;
+
+    /*
+     * The leaf centers, row w being word w.
+     */
+    void getWords(cv::Mat& words) const;
+
+    /*
+     * Word of one sample of the depth of the tree.
+     */
+    int lookup(const float* x) const;
+    int lookup(const double* x) const;
+
+    /*
+     * Storage as a "vocabulary_tree" node of a dictionary file. read()
+     * returns false and leaves the tree empty if the node is missing or
+     * not a valid tree.
+     */
+    void write(cv::FileStorage& fs) const;
+    bool read(const cv::FileNode& node, int depth);
+};
+
+#endif
@@ -0,0 +1,199 @@
+#include "wordmap.hpp"
+#include <algorithm>
+#include <climits>
+#include <fstream>
+#include <iterator>
+#include <vector>
+
+static const char MAGIC[4] = {'B', 'O', 'W', 'W'};
+static const unsigned char VERSION = 1;
+enum { COMPRESSION_NONE = 0, COMPRESSION_RLE = 1 };
+
+static void putUint(std::vector<unsigned char>& buf, unsigned v, int bytes)
+{
+    for (int i = 0; i < bytes; i++)
+        buf.push_back((v >> (8*i)) & 0xff);
+}
+
+static unsigned getUint(const unsigned char* p, int bytes)
+{
+    unsigned v = 0;
+    for (int i = 0; i < bytes; i++)
+        v |= (unsigned)p[i] << (8*i);
+    return v;
+}
+
+static void putVarint(std::vector<unsigned char>& buf, unsigned v)
+{
+    while (v >= 0x80)
+    {
+        buf.push_back((v & 0x7f) | 0x80);
+        v >>= 7;
+    }
+    buf.push_back(v);
+}
+
+/*
+ * Reads a varint at p, not past end. Returns the next position, or NULL
+ * if the varint is truncated.
+ */
+static const unsigned char* getVarint(const unsigned char* p,
+                                      const unsigned char* end, unsigned& v)
+{
+    v = 0;
+    for (int shift = 0; p < end && shift < 35; shift += 7)
+    {
+        unsigned char b = *p++;
+        v |= (unsigned)(b & 0x7f) << shift;
+        if (!(b & 0x80))
+            return p;
+    }
+    return NULL;
+}
+
+bool saveWordmap(const std::string& path, const cv::Mat& wordmap,
+                 int numWords, bool compress)
+{
+    CV_Assert(wordmap.type() == CV_32S);
+    int labelBytes = numWords <= 256 ? 1 : (numWords <= 65536 ? 2 : 4);
+
+    std::vector<unsigned char> buf(MAGIC, MAGIC + 4);
+    buf.push_back(VERSION);
+    buf.push_back(labelBytes);
+    buf.push_back(compress ? COMPRESSION_RLE : COMPRESSION_NONE);
+    buf.push_back(0);
+    putUint(buf, wordmap.rows, 4);
+    putUint(buf, wordmap.cols, 4);
+
+    unsigned run = 0;
+    int current = 0;
+    for (int i = 0; i < wordmap.rows; i++)
+    {
+        const int* row = wordmap.ptr<int>(i);
+        for (int j = 0; j < wordmap.cols; j++)
+        {
+            if (!compress)
+            {
+                putUint(buf, row[j], labelBytes);
+            }
+            else if (run > 0 && row[j] == current)
+            {
+                run++;
+            }
+            else
+            {
+                if (run > 0)
+                {
+                    putUint(buf, current, labelBytes);
+                    putVarint(buf, run);
+                }
+                current = row[j];
+                run = 1;
+            }
+        }
+    }
+    if (compress && run > 0)
+    {
+        putUint(buf, current, labelBytes);
+        putVarint(buf, run);
+    }
+
+    std::ofstream out(path.c_str(), std::ios::binary);
+    if (!out.is_open())
+        return false;
+    out.write((const char*)&buf[0], buf.size());
+    return out.good();
+}
+
+bool loadWordmap(const std::string& path, cv::Mat& wordmap, int numWords)
+{
+    if (path.size() >= 4 && path.compare(path.size() - 4, 4, ".xml") == 0)
+    {
+        cv::FileStorage fs(path, cv::FileStorage::READ);
+        if (!fs.isOpened())
+            return false;
+        fs["wordmap"] >> wordmap;
+        if (wordmap.empty() || wordmap.type() != CV_32S)
+            return false;
+        double minLabel, maxLabel;
+        cv::minMaxLoc(wordmap, &minLabel, &maxLabel);
+        return minLabel >= 0 && maxLabel < numWords;
+    }
+
+    std::ifstream in(path.c_str(), std::ios::binary);
+    if (!in.is_open())
+        return false;
+    std::vector<unsigned char> buf((std::istreambuf_iterator<char>(in)),
+                                   std::istreambuf_iterator<char>());
+    if (buf.size() < 16 || !std::equal(MAGIC, MAGIC + 4, buf.begin())
+        || buf[4] != VERSION)
+        return false;
+
+    int labelBytes = buf[5];
+    int compression = buf[6];
+    unsigned rows = getUint(&buf[8], 4);
+    unsigned cols = getUint(&buf[12], 4);
+    if (labelBytes != 1 && labelBytes != 2 && labelBytes != 4)
+        return false;
+    if (compression != COMPRESSION_NONE && compression != COMPRESSION_RLE)
+        return false;
+    if (rows == 0 || cols == 0 || rows > INT_MAX || cols > INT_MAX)
+        return false;
+
+    // Both below 2^31: neither product overflows.
+    size_t total = (size_t)rows * cols;
+    size_t payload = buf.size() - 16;
+    if (compression == COMPRESSION_NONE && payload != total * labelBytes)
+        return false;
+    if (numWords <= 0)
+        return false;
+    unsigned limit = (unsigned)numWords;
+    const unsigned char* begin = &buf[0] + 16;
+    const unsigned char* end = &buf[0] + buf.size();
+    const unsigned char* p = begin;
+    if (compression == COMPRESSION_RLE)
+    {
+        // The runs must cover exactly rows*cols labels and the whole
+        // payload, checked before allocating the map.
+        size_t covered = 0;
+        while (p < end)
+        {
+            unsigned run;
+            if (end - p < labelBytes || getUint(p, labelBytes) >= limit)
+                return false;
+            p = getVarint(p + labelBytes, end, run);
+            if (p == NULL || run > total - covered)
+                return false;
+            covered += run;
+        }
+        if (covered != total)
+            return false;
+    }
+
+    wordmap.create((int)rows, (int)cols, CV_32S);
+    int* labels = wordmap.ptr<int>(0);
+    p = begin;
+
+    if (compression == COMPRESSION_NONE)
+    {
+        for (size_t i = 0; i < total; i++, p += labelBytes)
+        {
+            unsigned label = getUint(p, labelBytes);
+            if (label >= limit)
+                return false;
+            labels[i] = (int)label;
+        }
+        return true;
+    }
+
+    size_t filled = 0;
+    while (filled < total)
+    {
+        int label = getUint(p, labelBytes);
+        unsigned run;
+        p = getVarint(p + labelBytes, end, run);
+        std::fill(labels + filled, labels + filled + run, label);
+        filled += run;
+    }
+    return true;
+}
@@ -0,0 +1,40 @@
+#ifndef WORDMAP_H_
+#define WORDMAP_H_
+
+#include <opencv2/opencv.hpp>
+#include <string>
+
+/*
+ * Compact binary word map file (.wmap).
+ *
+ * Header, 16 bytes, little endian:
+ *     char[4] magic "BOWW"
+ *     uint8   version (1)
+ *     uint8   bytes per label: 1 (K <= 256), 2 (K <= 65536) or 4
+ *     uint8   compression: 0 raw, 1 run-length
+ *     uint8   reserved (0)
+ *     uint32  rows
+ *     uint32  cols
+ * Payload, row-major labels:
+ *     raw         rows*cols labels
+ *     run-length  (label, run length as LEB128 varint) pairs
+ * Word maps are spatially coherent, so the run-length form is usually
+ * much smaller than the raw one.
+ */
+
+/*
+ * Writes a CV_32S word map whose labels are in [0, numWords).
+ * Returns false if the file cannot be written.
+ */
+bool saveWordmap(const std::string& path, const cv::Mat& wordmap,
+                 int numWords, bool compress);
+
+/*
+ * Reads a word map written by saveWordmap, or an XML word map
+ * ("wordmap" node) when path ends with ".xml". wordmap is CV_32S.
+ * Returns false if the file is missing or malformed, or if a label is
+ * outside [0, numWords): word maps index histograms.
+ */
+bool loadWordmap(const std::string& path, cv::Mat& wordmap, int numWords);
+
+#endif
@@ -0,0 +1,90 @@
+#include "workspace.hpp"
+#include <atomic>
+#include <memory>
+#include <vector>
+
+static std::mutex poolLock;
+static std::vector<std::unique_ptr<Workspace> > pool; // all workspaces
+static std::vector<Workspace*> idle;
+static std::atomic<size_t> limit(0);
+
+Workspace::Workspace()
+    : bytes(0)
+{
+}
+
+cv::Mat Workspace::buffer(int slot, int index, int rows, int cols, int type)
+{
+    size_t needed = (size_t)rows * cols * CV_ELEM_SIZE(type);
+    std::lock_guard<std::mutex> guard(lock);
+    cv::Mat& store = slots[std::make_pair(slot, index)];
+    if (store.total() < needed)
+    {
+        bytes += needed - store.total();
+        store.release(); // before allocating, so peak memory is one copy
+        store.create(1, (int)needed, CV_8U);
+    }
+    return cv::Mat(rows, cols, type, store.data);
+}
+
+size_t Workspace::capacity()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return bytes;
+}
+
+void Workspace::release()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    slots.clear();
+    bytes = 0;
+}
+
+WorkspaceLease::WorkspaceLease(Workspace* use)
+    : workspace(use), pooled(use == NULL)
+{
+    if (!pooled)
+        return;
+    std::lock_guard<std::mutex> guard(poolLock);
+    if (idle.empty())
+    {
+        pool.push_back(std::unique_ptr<Workspace>(new Workspace));
+        idle.push_back(pool.back().get());
+    }
+    workspace = idle.back();
+    idle.pop_back();
+}
+
+WorkspaceLease::~WorkspaceLease()
+{
+    if (!pooled)
+        return;
+    size_t maxBytes = limit;
+    if (maxBytes > 0 && workspace->capacity() > maxBytes)
+        workspace->release();
+    std::lock_guard<std::mutex> guard(poolLock);
+    idle.push_back(workspace);
+}
+
+Workspace& threadWorkspace()
+{
+    static thread_local Workspace workspace;
+    return workspace;
+}
+
+void releaseWorkspaces()
+{
+    std::lock_guard<std::mutex> guard(poolLock);
+    for (size_t i = 0; i < idle.size(); i++)
+        idle[i]->release();
+}
+
+void setWorkspaceLimit(size_t bytes)
+{
+    limit = bytes;
+}
+
+size_t getWorkspaceLimit()
+{
+    return limit;
+}
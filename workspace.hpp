@@ -0,0 +1,113 @@
+#ifndef WORKSPACE_H_
+#define WORKSPACE_H_
+
+#include <opencv2/opencv.hpp>
+#include <map>
+#include <mutex>
+#include <utility>
+
+/*
+ * Buffers of the per-image hot path, by kind; kinds with one buffer per
+ * kernel, channel or tile tell them apart by an index.
+ */
+enum WorkspaceSlot
+{
+    WS_LAB,            // Lab image
+    WS_RESPONSE,       // filter responses, numPixels x 3*numFilters
+    WS_KERNEL_OUTPUT,  // output of kernel i, before interleaving
+    WS_PADDED,         // image padded for the FFT kernels
+    WS_SPECTRUM,       // DFT of channel i of the padded image
+    WS_DFT_PLANE,      // zero-padded DFT input, channel or kernel i
+    WS_DFT_PRODUCT,    // spectrum products and inverse transforms, i
+    WS_SEPARABLE_TERM, // one term of a separable kernel
+    WS_SCORES          // cross terms of a word assignment tile
+};
+
+/*
+ * Grow-only scratch memory. buffer() returns a matrix header over the
+ * memory of one slot, which is reallocated only when a request is larger
+ * than anything the slot held before: once the largest image has gone
+ * through, filtering and word assignment stop calling the allocator, and
+ * threads stop contending on it.
+ *
+ * Headers stay valid until the same slot is requested again with a
+ * larger size; contents are undefined. Different slots may be requested
+ * concurrently by the tasks of one computation.
+ */
+class Workspace
+{
+private:
+    std::mutex lock;
+    std::map<std::pair<int, int>, cv::Mat> slots; // CV_8U backing stores
+    size_t bytes;
+
+    Workspace(const Workspace&);
+    Workspace& operator=(const Workspace&);
+
+public:
+    Workspace();
+
+    cv::Mat buffer(int slot, int index, int rows, int cols, int type);
+    cv::Mat buffer(int slot, int rows, int cols, int type)
+    {
+        return buffer(slot, 0, rows, cols, type);
+    }
+
+    /*
+     * Bytes held, and giving them back.
+     */
+    size_t capacity();
+    void release();
+};
+
+/*
+ * A workspace borrowed from a process-wide pool for the lifetime of the
+ * lease, e.g. the processing of one image; or the one given, so that
+ * functions taking an optional workspace can write
+ *
+ *     WorkspaceLease ws(workspace);   // workspace, or one from the pool
+ *
+ * The pool holds as many workspaces as there have been concurrent leases,
+ * each sized to the largest image it has seen; Dictionary::setStripRows
+ * bounds that size for very large images, and setWorkspaceLimit what a
+ * workspace keeps between leases.
+ */
+class WorkspaceLease
+{
+private:
+    Workspace* workspace;
+    bool pooled;
+
+    WorkspaceLease(const WorkspaceLease&);
+    WorkspaceLease& operator=(const WorkspaceLease&);
+
+public:
+    explicit WorkspaceLease(Workspace* use = NULL);
+    ~WorkspaceLease();
+
+    Workspace& operator*() const { return *workspace; }
+    Workspace* operator->() const { return workspace; }
+};
+
+/*
+ * Workspace of the calling thread, for code that does not fork tasks:
+ * a worker waiting for its tasks may run unrelated ones in between (see
+ * scheduler.hpp), so buffers that outlive a parallelFor must come from a
+ * lease instead.
+ */
+Workspace& threadWorkspace();
+
+/*
+ * Frees the memory of the idle workspaces of the pool.
+ */
+void releaseWorkspaces();
+
+/*
+ * Workspaces returned to the pool holding more than bytes are freed, so
+ * that one exceptionally large image does not pin its buffers for the
+ * lifetime of a server. 0 (default): no limit.
+ */
+void setWorkspaceLimit(size_t bytes);
+size_t getWorkspaceLimit();
+
+#endif